@@ -0,0 +1,44 @@
+#include "antlr_parser.h"
+
+#include <memory>
+#include <string>
+
+#include "antlr4-runtime.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+#include "ast_builder_listener.h"
+#include "bail_error_listener.h"
+#include "common.h"
+
+namespace listener_utils {
+void Run(const std::string &expr,
+         antlr4::tree::ParseTreeListener *listener) {
+  antlr4::ANTLRInputStream input(expr);
+
+  FormulaLexer lexer(&input);
+  BailErrorListener error_listener;
+  lexer.removeErrorListeners();
+  lexer.addErrorListener(&error_listener);
+
+  antlr4::CommonTokenStream tokens(&lexer);
+
+  FormulaParser parser(&tokens);
+  auto error_handler = std::make_shared<antlr4::BailErrorStrategy>();
+  parser.setErrorHandler(error_handler);
+  parser.removeErrorListeners();
+
+  antlr4::tree::ParseTree *tree;
+  try {
+    tree = parser.main();
+  } catch (...) {
+    throw FormulaException("Wrong formula format");
+  }
+  antlr4::tree::ParseTreeWalker::DEFAULT.walk(listener, tree);
+}
+}
+
+FormulaAst ParseFormulaAstWithAntlr(const std::string &expr) {
+  AstBuilderListener listener;
+  listener_utils::Run(expr, &listener);
+  return listener.ReleaseAst();
+}
@@ -0,0 +1,25 @@
+#ifndef SPREADSHEET_ANTLR_PARSER_H_
+#define SPREADSHEET_ANTLR_PARSER_H_
+
+#include <string>
+
+#include "antlr4-runtime.h"
+
+#include "formula_ast.h"
+
+// The ANTLR grammar, off the hot path since expr_parser replaced it. Kept
+// for the differential test and the benchmark; the sheet doesn't depend on
+// it, so only they need the ANTLR runtime.
+
+namespace listener_utils {
+// Parses expr and walks the tree with listener. Throws FormulaException if
+// expr is syntactically incorrect. O(N), N - expr.size
+void Run(const std::string &expr, antlr4::tree::ParseTreeListener *listener);
+}
+
+// Reference implementation of ParseFormulaAst over the ANTLR parse tree.
+// Throws FormulaException if expr is syntactically incorrect.
+// O(N), N - expr.size
+FormulaAst ParseFormulaAstWithAntlr(const std::string &expr);
+
+#endif // SPREADSHEET_ANTLR_PARSER_H_
@@ -0,0 +1,42 @@
+#include "ast_builder_listener.h"
+
+#include <stdexcept>
+#include <string>
+
+#include "common.h"
+#include "FormulaParser.h"
+
+void AstBuilderListener::exitUnaryOp(FormulaParser::UnaryOpContext *ctx) {
+  ast_.AddUnaryOp(ctx->ADD() ? '+' : '-');
+}
+
+void AstBuilderListener::exitLiteral(FormulaParser::LiteralContext *ctx) {
+  ast_.AddLiteral(ctx->getText());
+}
+
+void AstBuilderListener::exitCell(FormulaParser::CellContext *ctx) {
+  auto pos = Position::FromString(ctx->CELL()->getText());
+  if (!pos.IsValid()) {
+    throw FormulaException("Wrong formula format");
+  }
+  ast_.AddCell(pos);
+}
+
+void AstBuilderListener::exitBinaryOp(FormulaParser::BinaryOpContext *ctx) {
+  if (ctx->ADD()) {
+    ast_.AddBinaryOp('+');
+  } else if (ctx->SUB()) {
+    ast_.AddBinaryOp('-');
+  } else if (ctx->MUL()) {
+    ast_.AddBinaryOp('*');
+  } else {
+    ast_.AddBinaryOp('/');
+  }
+}
+
+FormulaAst AstBuilderListener::ReleaseAst() {
+  if (ast_.Empty()) {
+    throw std::runtime_error("AstBuilderListener::ReleaseAst failed");
+  }
+  return std::move(ast_);
+}
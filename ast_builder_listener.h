@@ -0,0 +1,23 @@
+#ifndef SPREADSHEET_AST_BUILDER_LISTENER_H_
+#define SPREADSHEET_AST_BUILDER_LISTENER_H_
+
+#include <string>
+
+#include "formula_ast.h"
+#include "FormulaParser.h"
+#include "FormulaBaseListener.h"
+
+class AstBuilderListener : public FormulaBaseListener {
+ public:
+  void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override;
+  void exitLiteral(FormulaParser::LiteralContext *ctx) override;
+  void exitCell(FormulaParser::CellContext *ctx) override;
+  void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override;
+
+  FormulaAst ReleaseAst();
+
+ private:
+  FormulaAst ast_;
+};
+
+#endif // SPREADSHEET_AST_BUILDER_LISTENER_H_
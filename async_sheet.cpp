@@ -0,0 +1,115 @@
+#include "async_sheet.h"
+
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+AsyncSheet::AsyncSheet(RecalcEngine::Invalidation invalidation) {
+  sheet_.SetInvalidation(invalidation);
+  sheet_.SetConcurrentReads(true);
+  // Every edit counts once in the sheet version, ApplyBatch ones included, so
+  // the tickets number the edits from the sheet's version on.
+  queued_version_ = applied_version_ = sheet_.GetVersion();
+  editor_ = std::thread([this] { EditLoop(); });
+}
+
+AsyncSheet::~AsyncSheet() {
+  {
+    std::lock_guard lock(queue_mutex_);
+    stop_ = true;
+  }
+  queued_cv_.notify_one();
+  editor_.join();
+}
+
+AsyncSheet::Ticket AsyncSheet::SetCellAsync(Position pos, std::string text) {
+  Edit edit{{pos, std::move(text)}, {}};
+  Ticket ticket{0, edit.done.get_future().share()};
+  {
+    std::lock_guard lock(queue_mutex_);
+    ticket.version = ++queued_version_;
+    queue_.push_back(std::move(edit));
+  }
+  queued_cv_.notify_one();
+  return ticket;
+}
+
+uint64_t AsyncSheet::GetVersion() const {
+  std::lock_guard lock(queue_mutex_);
+  return applied_version_;
+}
+
+void AsyncSheet::WaitForVersion(uint64_t version) const {
+  std::unique_lock lock(queue_mutex_);
+  applied_cv_.wait(lock, [&] { return applied_version_ >= version; });
+}
+
+void AsyncSheet::WaitForVersion(const Ticket &ticket) const {
+  WaitForVersion(ticket.version);
+}
+
+std::shared_ptr<const SheetSnapshot> AsyncSheet::Snapshot() {
+  std::unique_lock turnstile(turnstile_);
+  std::unique_lock lock(sheet_mutex_);
+  turnstile.unlock();
+  return sheet_.Snapshot();
+}
+
+size_t AsyncSheet::GetBatchCount() const {
+  std::lock_guard lock(queue_mutex_);
+  return batch_count_;
+}
+
+void AsyncSheet::EditLoop() {
+  std::vector<Edit> batch;
+  std::vector<Sheet::Edit> edits;
+  while (true) {
+    {
+      std::unique_lock lock(queue_mutex_);
+      queued_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      // Everything queued meanwhile goes into this batch.
+      batch.swap(queue_);
+    }
+
+    edits.clear();
+    for (auto &edit : batch) {
+      edits.push_back(std::move(edit.edit));
+    }
+    std::vector<std::exception_ptr> errors;
+    {
+      // With concurrent reads on, the batch ends recalculated.
+      std::unique_lock turnstile(turnstile_);
+      std::unique_lock lock(sheet_mutex_);
+      turnstile.unlock();
+      try {
+        errors = sheet_.ApplyBatch(std::move(edits));
+      } catch (...) {
+        errors.assign(batch.size(), std::current_exception());
+      }
+    }
+
+    {
+      std::lock_guard lock(queue_mutex_);
+      // The sheet counts every edit of the batch, failed as a whole or not.
+      applied_version_ = sheet_.GetVersion();
+      ++batch_count_;
+    }
+    applied_cv_.notify_all();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (errors[i]) {
+        batch[i].done.set_exception(errors[i]);
+      } else {
+        batch[i].done.set_value();
+      }
+    }
+    batch.clear();
+  }
+}
@@ -0,0 +1,105 @@
+#ifndef SPREADSHEET_ASYNC_SHEET_H_
+#define SPREADSHEET_ASYNC_SHEET_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "recalc_engine.h"
+#include "sheet.h"
+#include "sheet_snapshot.h"
+
+// Sheet edited on a background thread. SetCellAsync only queues the edit and
+// returns at once; the cycle checks, the invalidation and the recalculation
+// run on the editing thread. The edits queued while it is busy are applied
+// together, as one ApplyBatch, with one recalculation. The sheet has
+// concurrent reads on, so any number of readers share it between batches.
+class AsyncSheet {
+ public:
+  // A queued edit. done is ready once the edit is applied and recalculated,
+  // with the exception it failed with, if any.
+  struct Ticket {
+    // GetVersion once the edit is applied. The snapshots of version and
+    // later ones have the edit, see SheetSnapshot::GetVersion.
+    uint64_t version = 0;
+    std::shared_future<void> done;
+  };
+
+  // Starts the editing thread. O(1)
+  explicit AsyncSheet(RecalcEngine::Invalidation invalidation =
+                          RecalcEngine::Invalidation::kEager);
+  // Applies the queued edits, then stops the editing thread.
+  // O(N), N - cost of the queued edits
+  ~AsyncSheet();
+  AsyncSheet(const AsyncSheet &) = delete;
+  AsyncSheet &operator=(const AsyncSheet &) = delete;
+
+  // Queues Sheet::SetCell. O(1) amortized
+  Ticket SetCellAsync(Position pos, std::string text);
+
+  // Edits applied so far, the same as Sheet::GetVersion. O(1)
+  uint64_t GetVersion() const;
+  // Blocks until the edits up to version are applied and recalculated: the
+  // reads afterwards see them. O(1) if they are
+  void WaitForVersion(uint64_t version) const;
+  void WaitForVersion(const Ticket &ticket) const;
+
+  // Calls f(const Sheet &) between batches, concurrently with other
+  // readers; returns what f does. O(1) besides f
+  template <typename F>
+  auto Read(F f) const;
+  // Sheet::Snapshot between batches, for readers not holding the sheet.
+  // Same cost as Sheet::Snapshot
+  std::shared_ptr<const SheetSnapshot> Snapshot();
+
+  // Batches applied so far. O(1)
+  size_t GetBatchCount() const;
+
+ private:
+  struct Edit {
+    Sheet::Edit edit;
+    std::promise<void> done;
+  };
+
+  // Applies the queued edits until stopped and the queue is empty. An
+  // exception escaping ApplyBatch (e.g. std::bad_alloc) fails every edit of
+  // the batch.
+  void EditLoop();
+
+  Sheet sheet_;
+  // Held exclusively by the editing thread while applying a batch.
+  mutable std::shared_mutex sheet_mutex_;
+  // Held by the writers while they wait for sheet_mutex_. New readers pass
+  // through it first, so a stream of readers can't starve the edits.
+  mutable std::mutex turnstile_;
+
+  // Guards the fields below.
+  mutable std::mutex queue_mutex_;
+  std::condition_variable queued_cv_;
+  mutable std::condition_variable applied_cv_;
+  std::vector<Edit> queue_;
+  uint64_t queued_version_ = 0;
+  uint64_t applied_version_ = 0;
+  size_t batch_count_ = 0;
+  bool stop_ = false;
+
+  // Started last, everything it uses is constructed before.
+  std::thread editor_;
+};
+
+template <typename F>
+auto AsyncSheet::Read(F f) const {
+  { std::lock_guard turnstile(turnstile_); }
+  std::shared_lock lock(sheet_mutex_);
+  return f(static_cast<const Sheet &>(sheet_));
+}
+
+#endif // SPREADSHEET_ASYNC_SHEET_H_
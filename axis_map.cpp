@@ -0,0 +1,255 @@
+#include "axis_map.h"
+
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+AxisMap::AxisMap(int size) : nodes_(size) {
+  // Cartesian tree over the identity order, a max-heap by random priorities.
+  std::mt19937 gen(static_cast<uint32_t>(size));
+  std::vector<int32_t> right_spine;
+  for (int32_t id = 0; id < size; ++id) {
+    nodes_[id].priority = gen();
+    int32_t last = kNone;
+    while (!right_spine.empty() &&
+        nodes_[right_spine.back()].priority < nodes_[id].priority) {
+      last = right_spine.back();
+      right_spine.pop_back();
+    }
+    nodes_[id].left = last;
+    if (last != kNone) {
+      nodes_[last].parent = id;
+    }
+    if (!right_spine.empty()) {
+      nodes_[right_spine.back()].right = id;
+      nodes_[id].parent = right_spine.back();
+    }
+    right_spine.push_back(id);
+  }
+  root_ = right_spine.empty() ? kNone : right_spine.front();
+
+  // Children precede parents in a reversed BFS order.
+  std::vector<int32_t> order;
+  if (root_ != kNone) {
+    order.push_back(root_);
+  }
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (auto child : {nodes_[order[i]].left, nodes_[order[i]].right}) {
+      if (child != kNone) {
+        order.push_back(child);
+      }
+    }
+  }
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    Update(*it);
+  }
+
+  to_physical_.resize(nodes_.size());
+  to_logical_.resize(nodes_.size());
+  for (int32_t id = 0; id < size; ++id) {
+    to_physical_[id] = to_logical_[id] = id;
+  }
+  tables_valid_ = true;
+}
+
+int AxisMap::Size() const {
+  return static_cast<int>(nodes_.size());
+}
+
+int AxisMap::ToPhysical(int logical) const {
+  if (tables_valid_) {
+    return to_physical_[logical];
+  }
+  tree_lookups_.fetch_add(1, std::memory_order_relaxed);
+  return TreeToPhysical(logical);
+}
+
+int AxisMap::ToLogical(int physical) const {
+  if (tables_valid_) {
+    return to_logical_[physical];
+  }
+  tree_lookups_.fetch_add(1, std::memory_order_relaxed);
+  return TreeToLogical(physical);
+}
+
+void AxisMap::BuildTables() {
+  if (tables_valid_ ||
+      tree_lookups_.load(std::memory_order_relaxed) * kTreeLookupCost <
+          Size()) {
+    return;
+  }
+  to_physical_.clear();
+  to_physical_.reserve(nodes_.size());
+  Collect(root_, to_physical_);
+  to_logical_.resize(nodes_.size());
+  for (int logical = 0; logical < Size(); ++logical) {
+    to_logical_[to_physical_[logical]] = logical;
+  }
+  tables_valid_ = true;
+}
+
+void AxisMap::Insert(int before, int count) {
+  if (before < 0 || count < 0 || before + count > Size()) {
+    throw std::out_of_range("AxisMap::Insert : out of range");
+  }
+  if (count == 0) return;
+
+  int32_t head, tail, left, right;
+  Split(root_, Size() - count, head, tail);
+  Split(head, before, left, right);
+  root_ = Merge(Merge(left, tail), right);
+  nodes_[root_].parent = kNone;
+  tables_valid_ = false;
+  tree_lookups_.store(0, std::memory_order_relaxed);
+}
+
+std::vector<int> AxisMap::Erase(int first, int count) {
+  if (first < 0 || count < 0 || first + count > Size()) {
+    throw std::out_of_range("AxisMap::Erase : out of range");
+  }
+  std::vector<int> ids;
+  if (count == 0) return ids;
+
+  int32_t left, rest, middle, right;
+  Split(root_, first, left, rest);
+  Split(rest, count, middle, right);
+  ids.reserve(count);
+  Collect(middle, ids);
+  root_ = Merge(Merge(left, right), middle);
+  nodes_[root_].parent = kNone;
+  tables_valid_ = false;
+  tree_lookups_.store(0, std::memory_order_relaxed);
+  return ids;
+}
+
+void AxisMap::AddCount(int physical, int counter, int delta) {
+  nodes_[physical].counts[counter] += delta;
+  for (auto node = static_cast<int32_t>(physical); node != kNone;
+       node = nodes_[node].parent) {
+    nodes_[node].sums[counter] += delta;
+  }
+}
+
+int AxisMap::Count(int physical, int counter) const {
+  return nodes_[physical].counts[counter];
+}
+
+int AxisMap::Extent(int counter) const {
+  if (SumOf(root_, counter) == 0) {
+    return 0;
+  }
+  int offset = 0;
+  auto node = root_;
+  while (node != kNone) {
+    const auto &n = nodes_[node];
+    if (SumOf(n.right, counter) > 0) {
+      offset += SizeOf(n.left) + 1;
+      node = n.right;
+    } else if (n.counts[counter] > 0) {
+      return offset + SizeOf(n.left) + 1;
+    } else {
+      node = n.left;
+    }
+  }
+  throw std::logic_error("AxisMap::Extent : inconsistent sums");
+}
+
+int32_t AxisMap::SizeOf(int32_t node) const {
+  return node == kNone ? 0 : nodes_[node].size;
+}
+
+int32_t AxisMap::SumOf(int32_t node, int counter) const {
+  return node == kNone ? 0 : nodes_[node].sums[counter];
+}
+
+void AxisMap::Update(int32_t node) {
+  auto &n = nodes_[node];
+  n.size = 1 + SizeOf(n.left) + SizeOf(n.right);
+  for (int counter = 0; counter < kCounters; ++counter) {
+    n.sums[counter] = n.counts[counter] + SumOf(n.left, counter) +
+        SumOf(n.right, counter);
+  }
+}
+
+void AxisMap::Split(int32_t tree, int32_t count, int32_t &left,
+                    int32_t &right) {
+  if (tree == kNone) {
+    left = right = kNone;
+    return;
+  }
+  auto &n = nodes_[tree];
+  if (SizeOf(n.left) < count) {
+    int32_t child;
+    Split(n.right, count - SizeOf(n.left) - 1, child, right);
+    n.right = child;
+    if (child != kNone) nodes_[child].parent = tree;
+    left = tree;
+  } else {
+    int32_t child;
+    Split(n.left, count, left, child);
+    n.left = child;
+    if (child != kNone) nodes_[child].parent = tree;
+    right = tree;
+  }
+  Update(tree);
+}
+
+int32_t AxisMap::Merge(int32_t left, int32_t right) {
+  if (left == kNone) return right;
+  if (right == kNone) return left;
+  if (nodes_[left].priority > nodes_[right].priority) {
+    auto child = Merge(nodes_[left].right, right);
+    nodes_[left].right = child;
+    nodes_[child].parent = left;
+    Update(left);
+    return left;
+  }
+  auto child = Merge(left, nodes_[right].left);
+  nodes_[right].left = child;
+  nodes_[child].parent = right;
+  Update(right);
+  return right;
+}
+
+void AxisMap::Collect(int32_t tree, std::vector<int> &ids) const {
+  std::vector<int32_t> st;
+  auto node = tree;
+  while (node != kNone || !st.empty()) {
+    while (node != kNone) {
+      st.push_back(node);
+      node = nodes_[node].left;
+    }
+    node = st.back();
+    st.pop_back();
+    ids.push_back(node);
+    node = nodes_[node].right;
+  }
+}
+
+int AxisMap::TreeToPhysical(int logical) const {
+  auto node = root_;
+  while (true) {
+    const auto &n = nodes_[node];
+    auto left_size = SizeOf(n.left);
+    if (logical < left_size) {
+      node = n.left;
+    } else if (logical == left_size) {
+      return node;
+    } else {
+      logical -= left_size + 1;
+      node = n.right;
+    }
+  }
+}
+
+int AxisMap::TreeToLogical(int physical) const {
+  auto node = static_cast<int32_t>(physical);
+  int logical = SizeOf(nodes_[node].left);
+  for (auto parent = nodes_[node].parent; parent != kNone;
+       node = parent, parent = nodes_[node].parent) {
+    if (nodes_[parent].right == node) {
+      logical += SizeOf(nodes_[parent].left) + 1;
+    }
+  }
+  return logical;
+}
@@ -0,0 +1,87 @@
+#ifndef SPREADSHEET_AXIS_MAP_H_
+#define SPREADSHEET_AXIS_MAP_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Permutation between logical indexes of the rows (cols) of a sheet and their
+// physical ids, which address the storage. Always holds `size` entries: the
+// ids are 0..size-1 and initially the map is the identity.
+// Kept as an implicit treap (order-statistic tree) over the ids, so inserting
+// or deleting rows moves whole subtrees instead of renumbering every row.
+// Every entry also keeps kCounters counters, the tree maintains their sums to
+// find the last logical index with a non-zero counter.
+class AxisMap {
+ public:
+  static constexpr int kCounters = 2;
+
+  explicit AxisMap(int size); // O(N), N - size
+
+  int Size() const; // O(1)
+
+  // Read only, so they may run concurrently. O(1) through flat tables while
+  // they are valid, O(logN) through the treap after a structural edit until
+  // BuildTables rebuilds them.
+  int ToPhysical(int logical) const;
+  int ToLogical(int physical) const;
+  // Rebuilds the tables once the treap lookups since the last edit add up
+  // to about the rebuild, so a run of edits with few lookups in between
+  // doesn't pay it per edit. The writer calls it between edits.
+  // O(N) if rebuilding, O(1) otherwise
+  void BuildTables();
+
+  // Moves the last count entries to before, so the ids falling out of the
+  // map come back as the new entries. O(logN)
+  void Insert(int before, int count);
+  // Moves the entries [first, first + count) to the end and returns their ids.
+  // O(count + logN)
+  std::vector<int> Erase(int first, int count);
+
+  void AddCount(int physical, int counter, int delta); // O(logN)
+  int Count(int physical, int counter) const; // O(1)
+  // One past the logical index of the last entry with a non-zero counter,
+  // 0 if there are none. O(logN)
+  int Extent(int counter) const;
+
+ private:
+  static constexpr int32_t kNone = -1;
+  // Treap lookups worth one table entry rebuilt
+  static constexpr int kTreeLookupCost = 16;
+
+  struct Node {
+    int32_t left = kNone;
+    int32_t right = kNone;
+    int32_t parent = kNone;
+    int32_t size = 1;
+    uint32_t priority = 0;
+    std::array<int32_t, kCounters> counts{};
+    std::array<int32_t, kCounters> sums{};
+  };
+
+  int32_t SizeOf(int32_t node) const; // O(1)
+  int32_t SumOf(int32_t node, int counter) const; // O(1)
+  void Update(int32_t node); // O(1)
+
+  // Splits tree into the first count entries and the rest. O(logN)
+  void Split(int32_t tree, int32_t count, int32_t &left, int32_t &right);
+  int32_t Merge(int32_t left, int32_t right); // O(logN)
+
+  void Collect(int32_t tree, std::vector<int> &ids) const; // O(N), N - tree.size
+  int TreeToPhysical(int logical) const; // O(logN)
+  int TreeToLogical(int physical) const; // O(logN)
+
+  std::vector<Node> nodes_;
+  int32_t root_ = kNone;
+
+  // Valid until the next structural edit, written by BuildTables only
+  std::vector<int> to_physical_;
+  std::vector<int> to_logical_;
+  bool tables_valid_ = false;
+  // Treap lookups since the tables went invalid, counted by concurrent
+  // readers too
+  mutable std::atomic<int64_t> tree_lookups_{0};
+};
+
+#endif // SPREADSHEET_AXIS_MAP_H_
@@ -0,0 +1,241 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "antlr_parser.h"
+#include "common.h"
+#include "expr_parser.h"
+#include "formula.h"
+#include "sheet.h"
+#include "tree_shape_listener.h"
+#include "utils.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kMinBenchmarkDuration = std::chrono::milliseconds(500);
+
+// Runs func until kMinBenchmarkDuration passes and returns operations/sec,
+// where a single func call performs ops_per_run operations.
+template <typename Func>
+double OpsPerSecond(size_t ops_per_run, Func func) {
+  size_t runs = 0;
+  auto start = Clock::now();
+  auto elapsed = Clock::duration::zero();
+  do {
+    func();
+    ++runs;
+    elapsed = Clock::now() - start;
+  } while (elapsed < kMinBenchmarkDuration);
+  return static_cast<double>(runs * ops_per_run) /
+      std::chrono::duration<double>(elapsed).count();
+}
+
+void Report(const std::string &name, double ops_per_sec) {
+  std::cout << std::left << std::setw(48) << name << std::right
+            << std::setw(14) << std::fixed << std::setprecision(0)
+            << ops_per_sec << " ops/s" << std::endl;
+}
+
+// Pascal triangle as in TestPaskal: A1 = 1, every next row sums the two
+// cells above. Returns the expressions of all formula cells.
+std::vector<std::string> FillPaskal(ISheet &sheet, int rows) {
+  std::vector<std::string> exprs;
+  sheet.SetCell({0, 0}, "1");
+  for (int row = 1; row < rows; ++row) {
+    for (int col = 0; col <= row; ++col) {
+      std::string expr = Position{row - 1, col}.ToString();
+      if (col > 0) {
+        expr = Position{row - 1, col - 1}.ToString() + "+" + expr;
+      }
+      sheet.SetCell({row, col}, kFormulaSign + expr);
+      exprs.push_back(std::move(expr));
+    }
+  }
+  return exprs;
+}
+
+void BenchmarkPaskalEvaluation() {
+  std::cout << "Pascal triangle evaluation" << std::endl;
+
+  auto sheet = CreateSheet();
+  auto exprs = FillPaskal(*sheet, 200);
+  // Fill every cell cache, so only the formula itself is measured.
+  std::ostringstream values;
+  sheet->PrintValues(values);
+
+  double checksum = 0;
+  auto listener_ops = OpsPerSecond(exprs.size(), [&] {
+    for (const auto &expr : exprs) {
+      FormulaEvaluatorListener listener(*sheet);
+      listener_utils::Run(expr, &listener);
+      checksum += std::get<double>(listener.GetResult());
+    }
+  });
+
+  std::vector<std::unique_ptr<IFormula>> formulas;
+  for (const auto &expr : exprs) {
+    formulas.push_back(ParseFormula(expr));
+  }
+  auto program_ops = OpsPerSecond(formulas.size(), [&] {
+    for (const auto &formula : formulas) {
+      checksum += std::get<double>(formula->Evaluate(*sheet));
+    }
+  });
+
+  Report("  parse + FormulaEvaluatorListener", listener_ops);
+  Report("  FormulaProgram (bytecode)", program_ops);
+  std::cout << "  speedup: " << std::setprecision(1)
+            << program_ops / listener_ops << "x (checksum " << checksum
+            << ")" << std::endl;
+}
+
+void BenchmarkParsing() {
+  std::cout << "Formula parsing" << std::endl;
+
+  auto sheet = CreateSheet();
+  auto exprs = FillPaskal(*sheet, 100);
+  // Longer formulas with every kind of token.
+  for (int i = 1; i <= 500; ++i) {
+    auto row = std::to_string(i);
+    exprs.push_back("-(A" + row + " + 2.5e-3) * B" + row + " / (C" + row +
+                    " - 1) + .5 * (D" + row + " + E" + row + ") - 42");
+  }
+
+  size_t nodes = 0;
+  auto antlr_ops = OpsPerSecond(exprs.size(), [&] {
+    for (const auto &expr : exprs) {
+      nodes += ParseFormulaAstWithAntlr(expr).Nodes().size();
+    }
+  });
+  auto parser_ops = OpsPerSecond(exprs.size(), [&] {
+    for (const auto &expr : exprs) {
+      nodes += ParseFormulaAst(expr).Nodes().size();
+    }
+  });
+
+  Report("  listener_utils::Run + AstBuilderListener", antlr_ops);
+  Report("  expr_parser (Pratt)", parser_ops);
+  std::cout << "  speedup: " << std::setprecision(1)
+            << parser_ops / antlr_ops << "x (nodes " << nodes << ")"
+            << std::endl;
+}
+
+// Loads a sheet of kRows chains of kCols formulas cell by cell and as a batch.
+void BenchmarkLoad() {
+  constexpr int kRows = 1000;
+  constexpr int kCols = 100;
+  std::cout << "Loading of " << kRows << "x" << kCols << " cells" << std::endl;
+
+  std::vector<Sheet::Edit> edits;
+  for (int i = 0; i < kRows; ++i) {
+    edits.push_back({{i, 0}, std::to_string(i)});
+    for (int j = 1; j < kCols; ++j) {
+      edits.push_back({{i, j}, "=" + Position{i, j - 1}.ToString() + "+1"});
+    }
+  }
+
+  Report("  SetCell, cells", OpsPerSecond(edits.size(), [&edits] {
+    Sheet sheet;
+    for (const auto &edit : edits) {
+      sheet.SetCell(edit.pos, edit.text);
+    }
+  }));
+  Report("  ApplyBatch, cells", OpsPerSecond(edits.size(), [&edits] {
+    Sheet sheet;
+    sheet.ApplyBatch(edits);
+  }));
+}
+
+// Financial-model shaped sheet: inputs in column A, every next column grows
+// the previous one by its input: kRows independent chains of kCols formulas.
+void BenchmarkParallelRecalc() {
+  constexpr int kRows = 10'000;
+  constexpr int kCols = 100;
+  std::cout << "Recalculation of " << kRows << "x" << kCols << " cells"
+            << std::endl;
+
+  Sheet sheet;
+  for (int i = 0; i < kRows; ++i) {
+    auto input = Position{i, 0}.ToString();
+    sheet.SetCell({i, 0}, std::to_string(i % 7));
+    for (int j = 1; j < kCols; ++j) {
+      sheet.SetCell({i, j}, "=" + Position{i, j - 1}.ToString() + "*1.01+" +
+                                input + "/100");
+    }
+  }
+  sheet.Recalculate();
+
+  double base_ops = 0;
+  int runs = 0;
+  for (size_t threads : {1, 2, 4, 8, 16}) {
+    sheet.SetRecalcThreads(threads);
+    size_t evaluated = 0;
+    auto elapsed = Clock::duration::zero();
+    while (elapsed < kMinBenchmarkDuration) {
+      // Only the recalculation is measured, not marking the cells dirty.
+      ++runs;
+      for (int i = 0; i < kRows; ++i) {
+        sheet.SetCell({i, 0}, std::to_string((i + runs) % 7));
+      }
+      auto start = Clock::now();
+      sheet.Recalculate();
+      elapsed += Clock::now() - start;
+      evaluated += sheet.GetRecalcStats().evaluated;
+    }
+
+    auto ops = static_cast<double>(evaluated) /
+        std::chrono::duration<double>(elapsed).count();
+    if (threads == 1) {
+      base_ops = ops;
+    }
+    Report("  " + std::to_string(threads) + " thread(s), formulas", ops);
+    std::cout << "  speedup: " << std::setprecision(1) << ops / base_ops
+              << "x" << std::endl;
+  }
+  std::cout << "  hardware threads: " << std::thread::hardware_concurrency()
+            << std::endl;
+}
+
+// Memory of a sheet holding kRows x kCols numbers: the cells with their data
+// and the bookkeeping in the arena, and the storage slots.
+void BenchmarkMemory() {
+  constexpr int kRows = 10'000;
+  constexpr int kCols = 1'000;
+  constexpr size_t kCells = size_t{kRows} * kCols;
+  std::cout << "Memory of " << kRows << "x" << kCols << " numeric cells"
+            << std::endl;
+
+  Sheet sheet;
+  for (int i = 0; i < kRows; ++i) {
+    for (int j = 0; j < kCols; ++j) {
+      sheet.SetCell({i, j}, std::to_string((i * kCols + j) % 9973));
+    }
+  }
+  auto arena = sheet.GetCellArena().GetStats().chunk_bytes;
+  auto tiles = sheet.GetCellStorage().TileBytes();
+  auto report = [](const std::string &name, double bytes) {
+    std::cout << std::left << std::setw(48) << name << std::right
+              << std::setw(14) << std::fixed << std::setprecision(1) << bytes
+              << " bytes/cell" << std::endl;
+  };
+  report("  cells and bookkeeping (arena)",
+         static_cast<double>(arena) / kCells);
+  report("  storage slots", static_cast<double>(tiles) / kCells);
+  report("  total", static_cast<double>(arena + tiles) / kCells);
+}
+}
+
+int main() {
+  BenchmarkPaskalEvaluation();
+  BenchmarkParsing();
+  BenchmarkLoad();
+  BenchmarkParallelRecalc();
+  BenchmarkMemory();
+  return 0;
+}
@@ -1,80 +1,132 @@
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 #include <unordered_set>
 
 #include "cell.h"
 #include "formula.h"
+#include "sheet.h"
 #include "utils.h"
 
-Cell::Cell(Sheet &sheet, Position position)
-    : sheet_(sheet),
-      pos_in_sheet_(position),
-      internal_data_({.data = std::make_unique<cell_data::Text>("")}) {}
+Cell::Cell(Sheet &sheet, Position physical)
+    : physical_pos_(physical),
+      order_(sheet.GetTopoOrder().NewCell()),
+      sheet_(sheet) {}
+
+Cell::~Cell() {
+  if (links_) {
+    sheet_.GetCellArena().Destroy(links_);
+  }
+}
 
 void Cell::Set(std::string text) {
-  if (last_set_args_) {
-    if (last_set_args_->second && text == last_set_args_->first) {
-      throw CircularDependencyException("Circular dependency appeared");
-    }
-    if (text == last_set_args_->first) {
-      return;
-    }
+  auto pos = GetPosition();
+  if (links_ && links_->last_set_text && text == *links_->last_set_text &&
+      pos == links_->last_set_pos) {
+    return;
   }
 
   CellState state;
-  std::unique_ptr<ICellData> data;
+  cell_data::Payload data;
 
   if (text.empty()) {
     state = CellState::kEmpty;
-    data = std::make_unique<cell_data::Text>("");
   } else if (text.size() > 1 && text[0] == kFormulaSign) {
     state = CellState::kFormula;
-    data = std::make_unique<cell_data::Formula>(text.substr(1), sheet_);
+    data.emplace<cell_data::Formula>(text.substr(1), pos,
+                                     sheet_.GetFormulaPool());
   } else {
     state = CellState::kText;
-    data = std::make_unique<cell_data::Text>(text);
+    data.emplace<cell_data::Text>(text);
   }
 
+  auto new_text = [&data, pos] {
+    return std::visit(
+        [pos](const auto &payload) { return payload.GetText(pos); }, data);
+  };
   if (State() == CellState::kEmpty && state == CellState::kEmpty)
     return;
   if (State() == CellState::kText && state == CellState::kText &&
-      GetText() == data->GetText())
+      GetText() == new_text())
     return;
   if (State() != CellState::kEmpty && state != CellState::kEmpty &&
       State() != CellState::kText && state != CellState::kText &&
-      GetText() == data->GetText())
+      GetText() == new_text())
     return;
 
-  if (IsAddingCircularDependency(*data)) {
-    last_set_args_ = {std::move(text), true};
+  if (IsAddingCircularDependency(data)) {
     throw CircularDependencyException("Circular dependency appeared");
   }
 
   ClearRefs();
-  internal_data_.data = std::move(data);
-  internal_data_.state = state;
-  internal_data_.referenced_cells = internal_data_.data->GetReferencedCells();
-  // internal_data_.referencing_cells - stays unchanged
+  data_ = std::move(data);
+  state_ = state;
+  MarkChanged();
+  // The referencing cells stay unchanged
   SetRefs();
+  // Before the recalculation, which reads the epochs of the formula.
+  if (state_ == CellState::kFormula) {
+    GetLinks().last_set_text = std::move(text);
+    links_->last_set_pos = pos;
+  } else if (links_) {
+    links_->last_set_text.reset();
+    ReleaseLinks();
+  }
 
-  ResetCache(true);
-  last_set_args_ = {std::move(text), false};
+  sheet_.GetRecalcEngine().MarkDirty(*this);
+}
+
+const cell_data::Payload &Cell::GetPayload() const {
+  return data_;
+}
+
+void Cell::Restore(cell_data::Payload data, CellState state) {
+  if (IsAddingCircularDependency(data)) {
+    throw std::runtime_error("Cell::Restore : the references close a cycle");
+  }
+  ClearRefs();
+  data_ = std::move(data);
+  state_ = state;
+  // The journaled value is as old as the image, while the references may
+  // have changed since. Dropped, it's neither cached nor a base for the early
+  // cutoff of the dependents.
+  if (auto formula = std::get_if<cell_data::Formula>(&data_)) {
+    formula->DropCache();
+    GetLinks();
+  }
+  MarkChanged();
+  SetRefs();
+  if (links_) {
+    links_->last_set_text.reset();
+    ReleaseLinks();
+  }
+  sheet_.GetRecalcEngine().MarkDirty(*this);
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-  return internal_data_.referenced_cells;
+  auto pos = GetPosition();
+  return std::visit(
+      [pos](const auto &data) { return data.GetReferencedCells(pos); },
+      data_);
 }
 
 std::string Cell::GetText() const {
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::GetText : Data can't be not initialized "
-                             "here");
-  }
-  return internal_data_.data->GetText();
+  auto pos = GetPosition();
+  return std::visit([pos](const auto &data) { return data.GetText(pos); },
+                    data_);
 }
 
 ICell::Value Cell::GetValue() const {
+  auto value = PeekValue();
+  sheet_.GetRecalcEngine().NoteRead(*this);
+  return value;
+}
+
+ICell::Value Cell::PeekValue() const {
   if (State() == CellState::kRefError) {
     return FormulaError{FormulaError::Category::Ref};
   } else if (State() == CellState::kValueError) {
@@ -82,147 +134,197 @@ ICell::Value Cell::GetValue() const {
   } else if (State() == CellState::kDiv0Error) {
     return FormulaError{FormulaError::Category::Div0};
   }
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::GetValue : Data can't be not initialized "
-                             "here");
+  UpdateValue();
+  return std::visit([](const auto &data) { return data.GetValue(); }, data_);
+}
+
+CellValue Cell::GetOperand() const {
+  // The error states are the last ones.
+  if (State() >= CellState::kRefError) {
+    return CellValue::Error(std::get<FormulaError>(PeekValue()).GetCategory());
+  }
+  UpdateValue();
+  return std::visit([](const auto &data) { return data.GetOperand(); },
+                    data_);
+}
+
+void Cell::MarkChanged() const {
+  sheet_.GetCellStorage().MarkChanged(physical_pos_);
+}
+
+void Cell::UpdateValue() const {
+  auto &engine = sheet_.GetRecalcEngine();
+  if (engine.GetInvalidation() != RecalcEngine::Invalidation::kEager) {
+    engine.Validate(*this);
+  } else if (!IsCached()) {
+    // Evaluates every dirty formula once, the references of this one first.
+    sheet_.Recalculate();
+  }
+  if (!IsCached()) {
+    // Not expected after the engine's pass: the payload reads only the
+    // cache, so a value left outdated is evaluated here, at the cell.
+    Refresh(true);
+  }
+}
+
+const std::unordered_set<Cell *> &Cell::GetReferencingCells() const {
+  static const std::unordered_set<Cell *> kNone;
+  return links_ ? links_->referencing_cells : kNone;
+}
+
+const std::vector<Cell *> &Cell::GetPrecedents() const {
+  static const std::vector<Cell *> kNone;
+  return links_ ? links_->referenced_cells : kNone;
+}
+
+Cell::Links &Cell::GetLinks() {
+  if (!links_) {
+    links_ = sheet_.GetCellArena().Make<Links>().release();
+  }
+  return *links_;
+}
+
+void Cell::ReleaseLinks() {
+  if (links_ && links_->referenced_cells.empty() &&
+      links_->referencing_cells.empty() && !links_->last_set_text &&
+      !links_->hot.load(std::memory_order_relaxed) &&
+      !std::holds_alternative<cell_data::Formula>(data_)) {
+    sheet_.GetCellArena().Destroy(std::exchange(links_, nullptr));
   }
-  return internal_data_.data->GetValue();
 }
 
-std::unordered_set<Position, PositionHash> Cell::GetReferencingCells() const {
-  return internal_data_.referencing_cells;
+Position Cell::GetPosition() const {
+  return sheet_.ToLogical(physical_pos_);
 }
 
 CellState Cell::State() const {
-  return internal_data_.state;
+  return state_;
 }
 
 void Cell::SetState(CellState state) {
-  internal_data_.state = state;
+  state_ = state;
+  MarkChanged();
 }
 
 void Cell::ClearRefs() {
-  for (Position pos : internal_data_.referenced_cells) {
-    auto cell = dynamic_cast<Cell *>(sheet_.GetCell(pos));
-    if (!cell)
-      throw std::runtime_error(
-          "clear refs: failed precondition: null referenced cell");
-    cell->internal_data_.referencing_cells.erase(pos_in_sheet_);
+  if (links_) {
+    for (auto cell : links_->referenced_cells) {
+      cell->links_->referencing_cells.erase(this);
+      cell->ReleaseLinks();
+    }
+    links_->referenced_cells.clear();
+    ReleaseLinks();
   }
+  sheet_.GetRefIndex().Remove(this);
 }
 
 void Cell::SetRefs() {
-  for (auto pos : internal_data_.referenced_cells) {
-    auto cell = dynamic_cast<Cell *>(sheet_.GetCell(pos));
-    if (!cell) {
-      sheet_.ForceInitializeCell(pos);
-      cell = dynamic_cast<Cell *>(sheet_.GetCell(pos));
-    }
-    if (!cell) {
-      throw std::runtime_error("ebat kopat");
-    }
-    cell->internal_data_.referencing_cells.insert(pos_in_sheet_);
+  auto refs = GetReferencedCells();
+  for (auto pos : refs) {
+    auto &cell = sheet_.ForceInitializeCell(pos);
+    GetLinks().referenced_cells.push_back(&cell);
+    cell.GetLinks().referencing_cells.insert(this);
+  }
+  sheet_.GetRefIndex().Add(this, GetPosition(), refs);
+}
+
+void Cell::Detach() {
+  ClearRefs();
+  if (!links_) {
+    return;
   }
+  for (auto cell : links_->referencing_cells) {
+    auto &refs = cell->links_->referenced_cells;
+    refs.erase(std::remove(begin(refs), end(refs), this), end(refs));
+    cell->ReleaseLinks();
+  }
+  links_->referencing_cells.clear();
+  ReleaseLinks();
 }
 
-void Cell::ResetCache(bool force) {
-  if (internal_data_.data->IsCached() || force) {
-    internal_data_.data->ResetCache();
-    last_set_args_.reset();
+void Cell::ResetCache() {
+  std::visit([](const auto &data) { data.ResetCache(); }, data_);
+}
 
-    for (auto ref : internal_data_.referencing_cells) {
-      if (!sheet_.GetCell(ref)) {
-        throw std::runtime_error("ukusi menya pchela");
-      }
-      if (auto cell = dynamic_cast<Cell *>(sheet_.GetCell(ref))) {
-        cell->ResetCache(false);
-      } else {
-        throw std::runtime_error("Cell::ResetCache : cell shouldn't be null"
-                                 "here");
-      }
+bool Cell::Refresh(bool inputs_changed) const {
+  if (auto formula = std::get_if<cell_data::Formula>(&data_)) {
+    if (!formula->Refresh(inputs_changed, sheet_, GetPosition())) {
+      return false;
     }
+    MarkChanged();
   }
+  return true;
+}
+
+bool Cell::IsCached() const {
+  return std::visit([](const auto &data) { return data.IsCached(); },
+                    data_);
 }
 
 IFormula::HandlingResult Cell::HandleInsertedRows(int before, int count) {
-  ResetCache(true);
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::HandleInsertedRows : Data can't be not "
-                             "initialized");
-  }
-  auto res = internal_data_.data->HandleInsertedRows(before, count);
-  if (pos_in_sheet_.row >= before) {
-    internal_data_.referenced_cells = internal_data_.data->GetReferencedCells();
-    pos_in_sheet_.row += before;
-  }
-  return res;
+  return HandleShift(OpType::kAddition, ShiftType::kRows, before, count);
 }
 
 IFormula::HandlingResult Cell::HandleInsertedCols(int before, int count) {
-  ResetCache(true);
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::HandleInsertedCols : Data can't be not "
-                             "initialized");
-  }
-  auto res = internal_data_.data->HandleInsertedCols(before, count);
-  if (pos_in_sheet_.col >= before) {
-    internal_data_.referenced_cells = internal_data_.data->GetReferencedCells();
-    pos_in_sheet_.col += before;
-  }
-  return res;
+  return HandleShift(OpType::kAddition, ShiftType::kCols, before, count);
 }
 
 IFormula::HandlingResult Cell::HandleDeletedRows(int first, int count) {
-  ResetCache(true);
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::HandleDeletedRows : Data can't be not "
-                             "initialized");
-  }
-  auto res = internal_data_.data->HandleDeletedRows(first, count);
-  ClearRefs();
-  internal_data_.referenced_cells = internal_data_.data->GetReferencedCells();
-  if (pos_in_sheet_.row >= first + count) {
-    pos_in_sheet_.row -= count;
-  } else if (pos_in_sheet_.row >= first) {
-    return res;
-  }
-  SetRefs();
-  return res;
+  return HandleShift(OpType::kDeletion, ShiftType::kRows, first, count);
 }
 
 IFormula::HandlingResult Cell::HandleDeletedCols(int first, int count) {
-  ResetCache(true);
-  if (!internal_data_.data) {
-    throw std::runtime_error("Cell::HandleDeletedCols : Data can't be not "
-                             "initialized");
-  }
-  auto res = internal_data_.data->HandleDeletedCols(first, count);
-  ClearRefs();
-  internal_data_.referenced_cells = internal_data_.data->GetReferencedCells();
-  if (pos_in_sheet_.col >= first + count) {
-    pos_in_sheet_.col -= count;
-  } else if (pos_in_sheet_.col >= first) {
+  return HandleShift(OpType::kDeletion, ShiftType::kCols, first, count);
+}
+
+IFormula::HandlingResult Cell::HandleShift(OpType op_type,
+                                           ShiftType shift_type,
+                                           int first_idx, int count) {
+  auto res = IFormula::HandlingResult::NothingChanged;
+  auto formula = std::get_if<cell_data::Formula>(&data_);
+  if (!formula) {
     return res;
   }
-  SetRefs();
+
+  auto pos = GetPosition();
+  auto new_pos = ShiftPosition(pos, op_type, shift_type, first_idx, count);
+  auto old_shape = formula->GetShape();
+  res = formula->Shift(pos, new_pos, op_type, shift_type, first_idx, count,
+                       sheet_.GetFormulaPool());
+
+  if (res != IFormula::HandlingResult::NothingChanged) {
+    // The text has changed, so the same text set again is a new formula.
+    if (links_) links_->last_set_text.reset();
+  }
+  if (formula->GetShape() != old_shape) {
+    // Snapshots print formulas from the shape at their position.
+    MarkChanged();
+  }
+  if (res == IFormula::HandlingResult::ReferencesChanged) {
+    sheet_.GetRecalcEngine().MarkDirty(*this);
+  }
   return res;
 }
 
-bool Cell::IsAddingCircularDependency(const ICellData &new_data) const {
-  std::unordered_set < Position, PositionHash > visited;
-  std::stack<Position> st;
-  for (auto ref : new_data.GetReferencedCells()) {
-    st.push(ref);
-  }
-  while (!st.empty()) {
-    auto node = st.top();
-    st.pop();
-    if (node == pos_in_sheet_) return true;
-    if (!visited.insert(node).second) continue;
-    if (auto cell = sheet_.GetCell(node)) {
-      for (auto ref : cell->GetReferencedCells()) {
-        st.push(ref);
-      }
+bool Cell::IsAddingCircularDependency(const cell_data::Payload &new_data) {
+  auto pos = GetPosition();
+  auto refs = std::visit(
+      [pos](const auto &data) { return data.GetReferencedCells(pos); },
+      new_data);
+  if (refs.empty()) {
+    return false;
+  }
+  if (std::find(begin(refs), end(refs), pos) != end(refs)) {
+    return true;
+  }
+
+  // Missing cells are created without edges, below everything in the order.
+  auto &order = sheet_.GetTopoOrder();
+  for (auto ref : refs) {
+    if (!ref.IsValid()) continue;
+    auto cell = sheet_.FindCell(ref);
+    if (cell && !order.AddEdge(*cell, *this)) {
+      return true;
     }
   }
   return false;
@@ -1,6 +1,8 @@
 #ifndef SPREADSHEET_SRC_CELL_H_
 #define SPREADSHEET_SRC_CELL_H_
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <ostream>
 #include <optional>
@@ -8,12 +10,13 @@
 #include <unordered_set>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #include "common.h"
 #include "formula.h"
-#include "shifted_formula_listener.h"
 #include "utils.h"
 #include "cell_data.h"
+#include "cell_value.h"
 
 enum class CellState {
   kEmpty = 0,
@@ -28,32 +31,70 @@ class Sheet;
 
 class Cell final : public ICell {
  public:
-  Cell(Sheet &sheet, Position position); // O(1)
+  // physical - position of the cell in the sheet storage, which stays the same
+  // on rows/cols insertion or deletion. O(1)
+  Cell(Sheet &sheet, Position physical);
 
-  ~Cell() = default;
+  // Returns the links block to the arena. O(1)
+  ~Cell();
 
   // O(max(N, M); N – non-empty cells count; M – text.size
   void Set(std::string text);
 
-  std::vector<Position> GetReferencedCells() const override; // O(1)
+  // O(NlogN), N - references count
+  std::vector<Position> GetReferencedCells() const override;
+
+  const cell_data::Payload &GetPayload() const; // O(1)
+  // Puts back a payload and state the cell had before, without parsing. The
+  // value of a formula is evaluated again on the next read.
+  // Throws std::runtime_error if the references close a cycle.
+  // O(NlogN), N - references count
+  void Restore(cell_data::Payload data, CellState state);
 
   // text.size()
   std::string GetText() const override;
   // O(N); N – text.size
   Value GetValue() const override;
-
-  // O(1) ???
-  std::unordered_set<Position, PositionHash> GetReferencingCells() const;
+  // GetValue not counted as a read towards the kAdaptive policy, for the
+  // sheet's own reads. O(N); N – text.size
+  Value PeekValue() const;
+  // Value as a formula operand, without building Value. O(1) if cached,
+  // otherwise the cost of Sheet::Recalculate
+  CellValue GetOperand() const;
+
+  // Cells with formulas referring to this one. O(1)
+  const std::unordered_set<Cell *> &GetReferencingCells() const;
+  // Cells this one refers to. O(1)
+  const std::vector<Cell *> &GetPrecedents() const;
 
   CellState State() const; // O(1)
   void SetState(CellState cat); // O(1)
 
-  void ClearRefs(); // O(1)
-  void SetRefs(); // O(max(N, M); N – non-empty cells count; M – text.size
-  void ResetCache(bool force); // O(N); N – non-empty cells count
-
-  inline Position GetPosition() const { return pos_in_sheet_; } // O(1)
-
+  // Drops the edges to the referenced cells. O(N); N – references count
+  void ClearRefs();
+  // Adds the edges to the referenced cells, creating missing ones.
+  // O(NlogN); N – references count
+  void SetRefs();
+  // Drops every edge of the cell before it's removed from the sheet.
+  // O(N + M); N – references count, M – referencing cells count
+  void Detach();
+  // Marks the cached value of this cell only outdated, dependents are reset
+  // through the sheet's recalculation engine. O(1)
+  void ResetCache();
+  bool IsCached() const; // O(1)
+  // Brings the outdated value of a formula up to date, see
+  // cell_data::Formula::Refresh. Returns whether the value has changed;
+  // always true for cells without formulas. O(N), N - evaluation cost
+  bool Refresh(bool inputs_changed) const;
+
+  // Current position of the cell in the sheet. O(1) amortized
+  Position GetPosition() const;
+  inline Position GetPhysicalPosition() const { return physical_pos_; } // O(1)
+
+  // Renames references after rows/cols insertion or deletion, must be called
+  // before the sheet moves its rows/cols. The edges between cells are
+  // pointers, so they stay valid. The sheet indexes the cell again after the
+  // move, see RefIndex.
   // O(N), N - formula_expr.size
   IFormula::HandlingResult HandleInsertedRows(int before, int count);
   // O(N), N - formula_expr.size
@@ -64,21 +105,67 @@ class Cell final : public ICell {
   IFormula::HandlingResult HandleDeletedCols(int first, int count);
 
  private:
-  struct InternalData {
-    std::unique_ptr<ICellData> data;
-    std::vector<Position> referenced_cells;
-    std::unordered_set<Position, PositionHash> referencing_cells;
-    CellState state;
+  // Cold part of the cell: dependency edges, the memo of Set and the epochs.
+  // Most cells of a large sheet are plain values nobody refers to, so the
+  // block is allocated from the arena only when the cell gets an edge or a
+  // formula. A formula keeps it as long as it's a formula.
+  struct Links {
+    std::vector<Cell *> referenced_cells;
+    std::unordered_set<Cell *> referencing_cells;
+    // Text of the last successful Set of a formula. A failed one isn't kept:
+    // the cycle may be gone by the next call, and checking again is cheap.
+    // Text cells compare with the payload instead.
+    std::optional<std::string> last_set_text;
+    // Where the memo holds: a formula moved by a structural edit prints its
+    // unchanged offsets as other references.
+    Position last_set_pos;
+    // RecalcEngine epoch in which the value last changed. The epochs are
+    // written by concurrent readers too, see RecalcEngine::Validate.
+    std::atomic<uint64_t> changed_at{0};
+    // RecalcEngine epoch in which the formula was last found current, or
+    // RecalcEngine::kClaimed while a reader validates it
+    std::atomic<uint64_t> verified_at{0};
+    // Reads of a formula with Invalidation::kAdaptive, see
+    // RecalcEngine::NoteRead
+    std::atomic<uint64_t> read_at{0};
+    std::atomic<int32_t> heat{0};
+    std::atomic<bool> hot{false};
   };
 
-  // O(N); N – non-empty cells count
-  bool IsAddingCircularDependency(const ICellData &new_data) const;
+  // O(1)
+  Links &GetLinks();
+  // Frees the block once it keeps nothing and the cell has no formula. O(1)
+  void ReleaseLinks();
 
+  // Records a change of the text or value for the sheet snapshots. O(1)
+  void MarkChanged() const;
+
+  // Makes the cached value current before a read: recalculates the dirty
+  // formulas or validates this one, see RecalcEngine. O(1) if it's current
+  void UpdateValue() const;
+
+  // O(N), N - formula_expr.size
+  IFormula::HandlingResult HandleShift(OpType op_type, ShiftType shift_type,
+                                       int first_idx, int count);
+
+  // Makes the sheet's topological order allow the references of new_data.
+  // O(1) if it allows them already, otherwise O(KlogK), K - cells between the
+  // ends of a reference in the order
+  bool IsAddingCircularDependency(const cell_data::Payload &new_data);
+
+  friend class TopoOrder;
+  friend class RecalcEngine;
+
+  // Hot fields first: what the recalculation and the readers touch. Kept at
+  // 112 bytes, the arena's size class below 128.
+  cell_data::Payload data_;
+  CellState state_ = CellState::kEmpty;
+  Position physical_pos_;
+  // Number in the sheet's TopoOrder
+  int64_t order_;
   Sheet &sheet_;
-  Position pos_in_sheet_;
-  InternalData internal_data_;
-  // Set bool denotes circular dependency appeared in prev ;
-  std::optional<std::pair<std::string, bool>> last_set_args_;
+  // Null while the cell has no edges and no formula.
+  Links *links_ = nullptr;
 };
 
 #endif // SPREADSHEET_SRC_CELL_H_
@@ -0,0 +1,42 @@
+#include "cell_arena.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+CellArena::CellArena() : pool_(&chunks_) {}
+
+std::pmr::memory_resource *CellArena::Resource() {
+  return &pool_;
+}
+
+CellArena::Stats CellArena::GetStats() const {
+  return {.objects = objects_,
+          .chunks = chunks_.Count(),
+          .chunk_bytes = chunks_.Bytes()};
+}
+
+size_t CellArena::ChunkResource::Count() const {
+  return count_;
+}
+
+size_t CellArena::ChunkResource::Bytes() const {
+  return bytes_;
+}
+
+void *CellArena::ChunkResource::do_allocate(size_t bytes, size_t alignment) {
+  auto ptr = ::operator new(bytes, std::align_val_t(alignment));
+  ++count_;
+  bytes_ += bytes;
+  return ptr;
+}
+
+void CellArena::ChunkResource::do_deallocate(void *ptr, size_t bytes,
+                                             size_t alignment) {
+  ::operator delete(ptr, bytes, std::align_val_t(alignment));
+}
+
+bool CellArena::ChunkResource::do_is_equal(
+    const std::pmr::memory_resource &other) const noexcept {
+  return this == &other;
+}
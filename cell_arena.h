@@ -0,0 +1,100 @@
+#ifndef SPREADSHEET_CELL_ARENA_H_
+#define SPREADSHEET_CELL_ARENA_H_
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+// Sheet-owned memory for cells and their data. Objects are carved out of
+// large chunks by size-class pools, so creating a cell is no malloc call,
+// freed objects are reused by the objects of the same size and every chunk is
+// released at once together with the arena.
+// Objects must not outlive the arena.
+class CellArena {
+ public:
+  // Keeps the allocation size, so the pointer to a base class returns the
+  // memory to the right pool. The base must be the first one of the object.
+  struct Deleter {
+    template <typename T>
+    void operator()(T *ptr) const;
+
+    std::pmr::memory_resource *resource = nullptr;
+    size_t size = 0;
+    size_t alignment = 0;
+  };
+
+  template <typename T>
+  using Ptr = std::unique_ptr<T, Deleter>;
+
+  struct Stats {
+    size_t objects = 0; // Objects created by Make
+    size_t chunks = 0; // Allocations made by the arena itself
+    size_t chunk_bytes = 0;
+  };
+
+  CellArena(); // O(1)
+  CellArena(const CellArena &) = delete;
+  CellArena &operator=(const CellArena &) = delete;
+
+  // O(1) amortized
+  template <typename T, typename... Args>
+  Ptr<T> Make(Args &&...args);
+  // Destroys an object released from the Ptr of its exact type. O(1)
+  template <typename T>
+  void Destroy(T *ptr);
+
+  // For node-based containers living as long as the arena. O(1)
+  std::pmr::memory_resource *Resource();
+
+  Stats GetStats() const; // O(1)
+
+ private:
+  // new/delete, which counts the chunks requested by the pools.
+  class ChunkResource final : public std::pmr::memory_resource {
+   public:
+    size_t Count() const;
+    size_t Bytes() const;
+
+   private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override;
+
+    size_t count_ = 0;
+    size_t bytes_ = 0;
+  };
+
+  ChunkResource chunks_;
+  std::pmr::unsynchronized_pool_resource pool_;
+  size_t objects_ = 0;
+};
+
+template <typename T>
+void CellArena::Deleter::operator()(T *ptr) const {
+  ptr->~T();
+  resource->deallocate(ptr, size, alignment);
+}
+
+template <typename T, typename... Args>
+CellArena::Ptr<T> CellArena::Make(Args &&...args) {
+  void *memory = pool_.allocate(sizeof(T), alignof(T));
+  T *ptr = nullptr;
+  try {
+    ptr = new (memory) T(std::forward<Args>(args)...);
+  } catch (...) {
+    pool_.deallocate(memory, sizeof(T), alignof(T));
+    throw;
+  }
+  ++objects_;
+  return Ptr<T>(ptr, Deleter{&pool_, sizeof(T), alignof(T)});
+}
+
+template <typename T>
+void CellArena::Destroy(T *ptr) {
+  Deleter{&pool_, sizeof(T), alignof(T)}(ptr);
+}
+
+#endif // SPREADSHEET_CELL_ARENA_H_
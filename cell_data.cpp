@@ -1,33 +1,66 @@
 #include "cell_data.h"
 
+#include <atomic>
+#include <cmath>
 #include <memory>
 #include <string>
 #include <vector>
 #include <variant>
 
-#include "cell.h"
-#include "error_handle_listener.h"
+#include "expr_parser.h"
 #include "formula.h"
-#include "my_formula.h"
 #include "utils.h"
 
+namespace cell_data {
+std::string Empty::GetText(Position) const {
+  return "";
+}
+ICell::Value Empty::GetValue() const {
+  return 0.0;
+}
+CellValue Empty::GetOperand() const {
+  return {};
+}
+bool Empty::IsCached() const {
+  return true;
+}
+void Empty::ResetCache() const {
+  return;
+}
+std::vector<Position> Empty::GetReferencedCells(Position) const {
+  return {};
+}
+}
+
 namespace cell_data {
 Text::Text(std::string text) : text_(std::move(text)) {
   if (text_.empty()) {
-    value_ = 0.0;
+    return;
   } else if (auto num = ::ToDouble(text_)) {
-    value_ = num.value();
+    operand_ = CellValue::Number(num.value());
   } else if (text_[0] == kEscapeSign) {
-    value_ = text_.substr(1);
+    kind_ = Kind::kEscaped;
+    operand_ = TextOperand(text_.substr(1));
   } else {
-    value_ = text_;
+    kind_ = Kind::kString;
+    operand_ = TextOperand(text_);
   }
 }
-std::string Text::GetText() const {
+std::string Text::GetText(Position) const {
   return text_;
 }
 ICell::Value Text::GetValue() const {
-  return value_;
+  switch (kind_) {
+    case Kind::kNumber:
+      return operand_.GetNumber();
+    case Kind::kEscaped:
+      return text_.substr(1);
+    default:
+      return text_;
+  }
+}
+CellValue Text::GetOperand() const {
+  return operand_;
 }
 bool Text::IsCached() const {
   return true;
@@ -35,66 +68,90 @@ bool Text::IsCached() const {
 void Text::ResetCache() const {
   return;
 }
-std::vector<Position> Text::GetReferencedCells() const {
+std::vector<Position> Text::GetReferencedCells(Position) const {
   return {};
 }
-IFormula::HandlingResult Text::HandleInsertedRows(int before, int count) {
-  return IFormula::HandlingResult::NothingChanged;
-}
-IFormula::HandlingResult Text::HandleInsertedCols(int before, int count) {
-  return IFormula::HandlingResult::NothingChanged;
-}
-IFormula::HandlingResult Text::HandleDeletedRows(int first, int count) {
-  return IFormula::HandlingResult::NothingChanged;
-}
-IFormula::HandlingResult Text::HandleDeletedCols(int first, int count) {
-  return IFormula::HandlingResult::NothingChanged;
-}
 }
 
 namespace cell_data {
-Formula::Formula(std::string expr, const ISheet &sheet)
-    : sheet_(sheet), formula_(ParseFormula(std::move(expr))) {
+Formula::Formula(std::string expr, Position anchor, FormulaPool &pool) {
+  auto ast = ParseFormulaAst(expr);
+  ast.Rebase({}, anchor);
+  shape_ = pool.Intern(std::move(ast));
 }
-std::string Formula::GetText() const {
-  auto shrank_expr_ = dynamic_cast<::Formula *>(formula_.get())->
-      GetShrankExpr();
-  return '=' + HandleExprErrors(shrank_expr_, sheet_);
+std::string Formula::GetText(Position anchor) const {
+  return kFormulaSign + shape_->ast.ToString(anchor);
 }
 ICell::Value Formula::GetValue() const {
-  if (std::holds_alternative<std::monostate>(value_)) {
-    IFormula::Value res = formula_->Evaluate(sheet_);
-    if (std::holds_alternative<double>(res)) {
-      value_ = std::get<double>(res);
-    } else if (std::holds_alternative<FormulaError>(res)) {
-      value_ = std::get<FormulaError>(res);
-    }
+  auto value = GetOperand();
+  if (value.IsNumber()) {
+    return value.GetNumber();
   }
-
-  if (std::holds_alternative<double>(value_)) {
-    return std::get<double>(value_);
-  }
-  return std::get<FormulaError>(value_);
-}
-std::vector<Position> Formula::GetReferencedCells() const {
-  return formula_->GetReferencedCells();
+  return value.GetError();
 }
-IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
-  return formula_->HandleInsertedRows(before, count);
+CellValue Formula::GetOperand() const {
+  return cache_.value.load(std::memory_order_relaxed);
 }
-IFormula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
-  return formula_->HandleInsertedCols(before, count);
+bool Formula::Refresh(bool inputs_changed, const IOperandSource &source,
+                      Position anchor) const {
+  auto previous = cache_.value.load(std::memory_order_relaxed);
+  if (!inputs_changed && previous.GetKind() != CellValue::Kind::kNone) {
+    cache_.outdated.store(false, std::memory_order_release);
+    return false;
+  }
+  Evaluate(source, anchor);
+  return cache_.value.load(std::memory_order_relaxed) != previous;
 }
-IFormula::HandlingResult Formula::HandleDeletedRows(int first, int count) {
-  return formula_->HandleDeletedRows(first, count);
+void Formula::Evaluate(const IOperandSource &source, Position anchor) const {
+  auto result = shape_->program.Compute(source, anchor);
+  if (result.IsNumber() && !std::isfinite(result.GetNumber())) {
+    result = CellValue::Error(FormulaError::Category::Div0);
+  }
+  cache_.value.store(result, std::memory_order_relaxed);
+  cache_.outdated.store(false, std::memory_order_release);
+}
+std::vector<Position> Formula::GetReferencedCells(Position anchor) const {
+  return shape_->ast.ReferencedCells(anchor);
+}
+IFormula::HandlingResult Formula::Shift(Position anchor, Position new_anchor,
+                                        OpType op_type, ShiftType shift_type,
+                                        int first_idx, int count,
+                                        FormulaPool &pool) {
+  // Usually the cell moves together with its references, or neither of
+  // them moves, so offsets stay the same and the shape is kept as is.
+  auto check = shape_->ast.CheckShift(anchor, new_anchor, op_type, shift_type,
+                                      first_idx, count);
+  if (check.offsets_changed) {
+    auto ast = shape_->ast;
+    ast.Shift(anchor, new_anchor, op_type, shift_type, first_idx, count);
+    shape_ = pool.Intern(std::move(ast));
+  }
+  return check.result;
 }
-IFormula::HandlingResult Formula::HandleDeletedCols(int first, int count) {
-  return formula_->HandleDeletedCols(first, count);
+const std::shared_ptr<const FormulaShape> &Formula::GetShape() const {
+  return shape_;
 }
 bool Formula::IsCached() const {
-  return !std::holds_alternative<std::monostate>(value_);
+  return !cache_.outdated.load(std::memory_order_acquire) &&
+      cache_.value.load(std::memory_order_relaxed).GetKind() !=
+          CellValue::Kind::kNone;
 }
 void Formula::ResetCache() const {
-  value_.emplace<std::monostate>();
+  cache_.outdated.store(true, std::memory_order_relaxed);
+}
+void Formula::DropCache() const {
+  cache_.outdated.store(true, std::memory_order_relaxed);
+  cache_.value.store(CellValue::None(), std::memory_order_relaxed);
+}
+Formula::Cache::Cache(const Cache &other)
+    : value(other.value.load(std::memory_order_relaxed)),
+      outdated(other.outdated.load(std::memory_order_relaxed)) {
+}
+Formula::Cache &Formula::Cache::operator=(const Cache &other) {
+  value.store(other.value.load(std::memory_order_relaxed),
+              std::memory_order_relaxed);
+  outdated.store(other.outdated.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  return *this;
 }
 }
@@ -3,74 +3,120 @@
 #ifndef SPREADSHEET__CELL_DATA_H_
 #define SPREADSHEET__CELL_DATA_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <variant>
-#include "sheet.h"
+#include <vector>
+
+#include "cell_value.h"
+#include "common.h"
 #include "formula.h"
+#include "formula_pool.h"
+#include "utils.h"
 
-class ICellData {
+// Payload kinds of a cell. The set is closed, so cells keep the payload
+// inline in a variant and dispatch without virtual calls. Formulas keep
+// neither the operand source nor their position: the cell passes the sheet
+// and its current position, the anchor of the relative references. So a
+// formula moved by a structural edit is left as is unless its offsets change.
+namespace cell_data {
+class Empty final {
  public:
-  virtual ~ICellData() = default;
-  virtual std::string GetText() const = 0;
-  virtual ICell::Value GetValue() const = 0;
-  virtual bool IsCached() const = 0;
-  virtual void ResetCache() const = 0;
-  virtual std::vector<Position> GetReferencedCells() const = 0;
-  virtual IFormula::HandlingResult HandleInsertedRows(int before,
-                                                      int count) = 0;
-  virtual IFormula::HandlingResult HandleInsertedCols(int before,
-                                                      int count) = 0;
-  virtual IFormula::HandlingResult HandleDeletedRows(int first, int count) = 0;
-  virtual IFormula::HandlingResult HandleDeletedCols(int first, int count) = 0;
+  std::string GetText(Position anchor) const; // O(1)
+  ICell::Value GetValue() const; // O(1)
+  CellValue GetOperand() const; // O(1)
+  bool IsCached() const; // O(1)
+  void ResetCache() const; // O(1)
+  std::vector<Position> GetReferencedCells(Position anchor) const; // O(1)
 };
 
-namespace cell_data {
-class Text final : public ICellData {
+class Text final {
  public:
   explicit Text(std::string text); // O(N); N – text.size
 
-  std::string GetText() const override; // O(N), N - text.size
-  ICell::Value GetValue() const override; // Worst case: O(N), N - str.size
-  bool IsCached() const override; // O(1)
-  void ResetCache() const override; // O(1)
-  std::vector<Position> GetReferencedCells() const override; // O(1)
-  // O(1)
-  IFormula::HandlingResult HandleInsertedRows(int before, int count) override;
-  // O(1)
-  IFormula::HandlingResult HandleInsertedCols(int before, int count) override;
-  // O(1)
-  IFormula::HandlingResult HandleDeletedRows(int first, int count) override;
-  // O(1)
-  IFormula::HandlingResult HandleDeletedCols(int first, int count) override;
+  std::string GetText(Position anchor) const; // O(N), N - text.size
+  // Worst case: O(N), N - str.size
+  ICell::Value GetValue() const;
+  // Read as in formulas, see TextOperand. O(1)
+  CellValue GetOperand() const;
+  bool IsCached() const; // O(1)
+  void ResetCache() const; // O(1)
+  std::vector<Position> GetReferencedCells(Position anchor) const; // O(1)
 
  private:
+  // What the text reads as, decided once. The value is built from the text
+  // on demand instead of being kept next to it.
+  enum class Kind : uint8_t {
+    kNumber,
+    kString,
+    kEscaped, // String without the leading kEscapeSign
+  };
+
   std::string text_;
-  ICell::Value value_;
+  // The number itself for kNumber
+  CellValue operand_;
+  Kind kind_ = Kind::kNumber;
 };
 
-class Formula final : public ICellData {
+class Formula final {
  public:
-  Formula(std::string expr, const ISheet &sheet); // O(N), N – expr.size
+  // anchor is the cell holding the formula, pool shares compiled formula
+  // shapes between the cells of the sheet. O(N), N – expr.size
+  Formula(std::string expr, Position anchor, FormulaPool &pool);
 
-  std::string GetText() const override; // O(N); N – text.size
-  ICell::Value GetValue() const override; // Worst case: O(N); N – str.size
-  bool IsCached() const override; // O(1)
-  void ResetCache() const override; // O(1)
-  std::vector<Position> GetReferencedCells() const override; // O(1)
-  // O(N), N - formula_expr.size
-  IFormula::HandlingResult HandleInsertedRows(int before, int count) override;
-  // O(N), N - formula_expr.size
-  IFormula::HandlingResult HandleInsertedCols(int before, int count) override;
+  std::string GetText(Position anchor) const; // O(N); N – text.size
+  // The cached value, which must be current, see IsCached. O(1)
+  ICell::Value GetValue() const;
+  CellValue GetOperand() const; // O(1)
+  bool IsCached() const; // O(1)
+  // Marks the value outdated, keeping it for Refresh to compare with. O(1)
+  void ResetCache() const;
+  // Marks the value outdated and drops it, so Refresh evaluates the formula
+  // and reports a change. O(1)
+  void DropCache() const;
+  // Brings an outdated value up to date: evaluates the formula at anchor if
+  // inputs_changed or there is no previous value, takes the previous value
+  // back otherwise. Returns whether the value differs from the previous one
+  // bitwise. Worst case: O(N); N – str.size
+  bool Refresh(bool inputs_changed, const IOperandSource &source,
+               Position anchor) const;
+  // O(NlogN), N - references count
+  std::vector<Position> GetReferencedCells(Position anchor) const;
+  // Renames references after rows/cols insertion or deletion, which moves
+  // the cell from anchor to new_anchor. The shape is kept if the offsets
+  // stay the same, otherwise the shifted one is interned in pool.
   // O(N), N - formula_expr.size
-  IFormula::HandlingResult HandleDeletedRows(int first, int count) override;
-  // O(N), N - formula_expr.size
-  IFormula::HandlingResult HandleDeletedCols(int first, int count) override;
+  IFormula::HandlingResult Shift(Position anchor, Position new_anchor,
+                                 OpType op_type, ShiftType shift_type,
+                                 int first_idx, int count, FormulaPool &pool);
+  // Shared with the structurally equal formulas. O(1)
+  const std::shared_ptr<const FormulaShape> &GetShape() const;
 
  private:
-  const ISheet &sheet_;
-  std::unique_ptr<IFormula> formula_;
-  mutable std::variant<std::monostate, double, FormulaError> value_;
+  // The cached value, published to concurrent readers: the value word is
+  // stored before outdated is cleared with release, so a reader acquiring
+  // outdated == false reads the value it was cleared for. Copied as plain
+  // values, copies are made by the writer only.
+  struct Cache {
+    Cache() = default;
+    Cache(const Cache &other); // O(1)
+    Cache &operator=(const Cache &other); // O(1)
+
+    // kNone until evaluated first
+    std::atomic<CellValue> value{CellValue::None()};
+    std::atomic<bool> outdated{false};
+  };
+
+  // Worst case: O(N); N – str.size
+  void Evaluate(const IOperandSource &source, Position anchor) const;
+
+  std::shared_ptr<const FormulaShape> shape_;
+  mutable Cache cache_;
 };
+
+using Payload = std::variant<Empty, Text, Formula>;
 }
 
 #endif //SPREADSHEET__CELL_DATA_H_
@@ -0,0 +1,102 @@
+#include "cell_storage.h"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "cell.h"
+
+CellStorage::CellStorage(CellArena &arena) : arena_(arena) {}
+
+CellStorage::~CellStorage() {
+  for (auto &tile_row : tiles_) {
+    for (auto &tile : tile_row) {
+      if (!tile) continue;
+      for (auto cell : tile->cells) {
+        if (cell) arena_.Destroy(cell);
+      }
+    }
+  }
+}
+
+Cell *CellStorage::Get(Position physical) const {
+  auto tile_row = static_cast<size_t>(physical.row / kTileSize);
+  auto tile_col = static_cast<size_t>(physical.col / kTileSize);
+  if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size() ||
+      !tiles_[tile_row][tile_col]) {
+    return nullptr;
+  }
+  return tiles_[tile_row][tile_col]->cells[SlotOf(physical)];
+}
+
+Cell &CellStorage::Put(Position physical, CellArena::Ptr<Cell> cell) {
+  auto tile_row = static_cast<size_t>(physical.row / kTileSize);
+  auto tile_col = static_cast<size_t>(physical.col / kTileSize);
+  if (tile_row >= tiles_.size()) {
+    tiles_.resize(tile_row + 1);
+  }
+  auto &row = tiles_[tile_row];
+  if (tile_col >= row.size()) {
+    row.resize(tile_col + 1);
+  }
+  if (!row[tile_col]) {
+    row[tile_col] = std::make_unique<Tile>();
+    ++tile_count_;
+  }
+
+  auto &tile = *row[tile_col];
+  auto &slot = tile.cells[SlotOf(physical)];
+  if (slot) {
+    throw std::runtime_error("CellStorage::Put : slot is occupied");
+  }
+  slot = cell.release();
+  ++tile.count;
+  tile.changed.store(true, std::memory_order_relaxed);
+  return *slot;
+}
+
+void CellStorage::Erase(Position physical) {
+  auto tile_row = static_cast<size_t>(physical.row / kTileSize);
+  auto tile_col = static_cast<size_t>(physical.col / kTileSize);
+  if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size() ||
+      !tiles_[tile_row][tile_col]) {
+    return;
+  }
+  auto &tile = tiles_[tile_row][tile_col];
+  auto &slot = tile->cells[SlotOf(physical)];
+  if (!slot) {
+    return;
+  }
+  arena_.Destroy(slot);
+  slot = nullptr;
+  if (--tile->count == 0) {
+    tile.reset();
+    --tile_count_;
+  } else {
+    tile->changed.store(true, std::memory_order_relaxed);
+  }
+}
+
+void CellStorage::MarkChanged(Position physical) const {
+  auto tile_row = static_cast<size_t>(physical.row / kTileSize);
+  auto tile_col = static_cast<size_t>(physical.col / kTileSize);
+  if (tile_row < tiles_.size() && tile_col < tiles_[tile_row].size() &&
+      tiles_[tile_row][tile_col]) {
+    tiles_[tile_row][tile_col]->changed.store(true,
+                                              std::memory_order_relaxed);
+  }
+}
+
+size_t CellStorage::TileCount() const {
+  return tile_count_;
+}
+
+size_t CellStorage::TileBytes() const {
+  return tile_count_ * sizeof(Tile);
+}
+
+size_t CellStorage::SlotOf(Position physical) {
+  return static_cast<size_t>(physical.row % kTileSize) * kTileSize +
+      physical.col % kTileSize;
+}
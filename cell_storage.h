@@ -0,0 +1,126 @@
+#ifndef SPREADSHEET_CELL_STORAGE_H_
+#define SPREADSHEET_CELL_STORAGE_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "cell_arena.h"
+#include "common.h"
+
+class Cell;
+
+// Sparse cell storage by physical position. The sheet is split into tiles of
+// kTileSize x kTileSize cells; a tile is allocated when it gets its first cell
+// and freed with its last one, so far-away cells cost one tile each instead
+// of a row of empty slots. Slots of a tile are row-major and contiguous.
+// The cells themselves live in the arena.
+class CellStorage {
+ public:
+  static constexpr int kTileSize = 64;
+
+  explicit CellStorage(CellArena &arena); // O(1)
+  ~CellStorage(); // O(N), N - cells count
+
+  Cell *Get(Position physical) const; // O(1)
+  // The slot must be empty. O(1)
+  Cell &Put(Position physical, CellArena::Ptr<Cell> cell);
+  // Destroys the cell, if any. O(1)
+  void Erase(Position physical);
+
+  // Calls f(Cell &) for the cells of a physical row (col).
+  // O(N), N - cells in the row (col) tiles
+  template <typename F>
+  void ForEachInRow(int row, F f) const;
+  template <typename F>
+  void ForEachInCol(int col, F f) const;
+  // Calls f(Cell &) for every cell. O(N + T), N - cells count, T - tiles count
+  template <typename F>
+  void ForEach(F f) const;
+
+  // Records that the text or value of the cell at physical changed, for
+  // CollectChanges. Put and Erase record their slot themselves. Safe on
+  // concurrent threads. O(1)
+  void MarkChanged(Position physical) const;
+  // Calls f(tile_row, tile_col, cells, changed) for every tile, cells being
+  // its slots and changed whether any of them changed since the previous
+  // call, and clears the marks. O(T), T - tiles count
+  template <typename F>
+  void CollectChanges(F f);
+
+  size_t TileCount() const; // O(1)
+  // Memory of the slots, excluding the cells. O(1)
+  size_t TileBytes() const;
+
+ private:
+  struct Tile {
+    std::array<Cell *, kTileSize * kTileSize> cells{};
+    int count = 0;
+    // Set by MarkChanged from the recalculation threads too
+    std::atomic<bool> changed{true};
+  };
+
+  static size_t SlotOf(Position physical); // O(1)
+
+  CellArena &arena_;
+  // Directory of tiles, grown by tile rows (cols) only when needed.
+  std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+  size_t tile_count_ = 0;
+};
+
+template <typename F>
+void CellStorage::ForEachInRow(int row, F f) const {
+  auto tile_row = static_cast<size_t>(row / kTileSize);
+  if (tile_row >= tiles_.size()) return;
+  for (const auto &tile : tiles_[tile_row]) {
+    if (!tile) continue;
+    auto first = begin(tile->cells) + (row % kTileSize) * kTileSize;
+    for (auto it = first; it != first + kTileSize; ++it) {
+      if (*it) f(**it);
+    }
+  }
+}
+
+template <typename F>
+void CellStorage::ForEachInCol(int col, F f) const {
+  auto tile_col = static_cast<size_t>(col / kTileSize);
+  for (const auto &tile_row : tiles_) {
+    if (tile_col >= tile_row.size() || !tile_row[tile_col]) {
+      continue;
+    }
+    const auto &cells = tile_row[tile_col]->cells;
+    for (size_t slot = col % kTileSize; slot < cells.size();
+         slot += kTileSize) {
+      if (cells[slot]) f(*cells[slot]);
+    }
+  }
+}
+
+template <typename F>
+void CellStorage::CollectChanges(F f) {
+  for (size_t tile_row = 0; tile_row < tiles_.size(); ++tile_row) {
+    for (size_t tile_col = 0; tile_col < tiles_[tile_row].size(); ++tile_col) {
+      if (auto &tile = tiles_[tile_row][tile_col]) {
+        f(tile_row, tile_col, std::as_const(tile->cells),
+          tile->changed.exchange(false, std::memory_order_relaxed));
+      }
+    }
+  }
+}
+
+template <typename F>
+void CellStorage::ForEach(F f) const {
+  for (const auto &tile_row : tiles_) {
+    for (const auto &tile : tile_row) {
+      if (!tile) continue;
+      for (auto cell : tile->cells) {
+        if (cell) f(*cell);
+      }
+    }
+  }
+}
+
+#endif // SPREADSHEET_CELL_STORAGE_H_
@@ -0,0 +1,27 @@
+#include "cell_value.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+IFormula::Value CellValue::ToFormulaValue() const {
+  if (IsNumber()) {
+    return GetNumber();
+  }
+  if (GetKind() == Kind::kError) {
+    return GetError();
+  }
+  throw std::logic_error("CellValue::ToFormulaValue : not a number or error");
+}
+
+CellValue TextOperand(const std::string &text) {
+  if (text.empty()) {
+    return {};
+  }
+  std::istringstream in(text);
+  int num = 0;
+  if (!(in >> num) || !in.eof()) {
+    return CellValue::Error(FormulaError::Category::Value);
+  }
+  return CellValue::Number(num);
+}
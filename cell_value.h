@@ -0,0 +1,134 @@
+#ifndef SPREADSHEET_CELL_VALUE_H_
+#define SPREADSHEET_CELL_VALUE_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "common.h"
+#include "formula.h"
+
+// Value of a cell in one 8-byte word (NaN boxing): a number is the double
+// itself with every NaN made the positive quiet one, the other kinds are
+// negative quiet NaNs with a tag and a payload no arithmetic result has. The
+// sheet keeps and passes values around in this form; ICell::Value is built
+// only by GetValue.
+class CellValue {
+ public:
+  enum class Kind : uint8_t {
+    kNumber,
+    kError,
+    kText, // The string is the text of the cell, read through the cell
+    kNone, // No value yet
+  };
+
+  CellValue() = default; // 0.0
+
+  static CellValue Number(double number); // O(1)
+  static CellValue Error(FormulaError::Category category); // O(1)
+  static CellValue Text(); // O(1)
+  static CellValue None(); // O(1)
+
+  Kind GetKind() const; // O(1)
+  bool IsNumber() const; // O(1)
+  // Valid for the kind only. O(1)
+  double GetNumber() const;
+  FormulaError GetError() const;
+
+  // The value of a number or an error. O(1)
+  IFormula::Value ToFormulaValue() const;
+
+  // Same representation: 0 and -0 differ, a NaN equals itself. O(1)
+  bool operator==(CellValue rhs) const;
+  bool operator!=(CellValue rhs) const;
+
+ private:
+  static constexpr uint64_t kBoxMask = 0xFFFF'0000'0000'0000;
+  static constexpr uint64_t kCanonicalNaN = 0x7FF8'0000'0000'0000;
+  // Tags of the boxed kinds in the top 16 bits, payload in the low 48.
+  static constexpr uint64_t kErrorBox = 0xFFF9'0000'0000'0000;
+  static constexpr uint64_t kTextBox = 0xFFFA'0000'0000'0000;
+  static constexpr uint64_t kNoneBox = 0xFFFB'0000'0000'0000;
+
+  explicit CellValue(uint64_t bits);
+
+  uint64_t bits_ = 0;
+};
+
+// Operand value of a cell showing text: the empty text reads as 0, a whole
+// number as itself, anything else is #VALUE!. O(N), N - text.size
+CellValue TextOperand(const std::string &text);
+
+// Operands of the formulas of a sheet: cell values as words, without the
+// virtual ICell calls and the strings of ICell::Value.
+class IOperandSource {
+ public:
+  // #REF! for an invalid pos, 0 for a missing cell. The cells of the sheet
+  // read as in formulas: text through TextOperand.
+  virtual CellValue GetOperand(Position pos) const = 0;
+
+ protected:
+  ~IOperandSource() = default;
+};
+
+inline CellValue::CellValue(uint64_t bits) : bits_(bits) {}
+
+inline CellValue CellValue::Number(double number) {
+  if (std::isnan(number)) {
+    return CellValue(kCanonicalNaN);
+  }
+  uint64_t bits;
+  std::memcpy(&bits, &number, sizeof(bits));
+  return CellValue(bits);
+}
+
+inline CellValue CellValue::Error(FormulaError::Category category) {
+  return CellValue(kErrorBox | static_cast<uint64_t>(category));
+}
+
+inline CellValue CellValue::Text() {
+  return CellValue(kTextBox);
+}
+
+inline CellValue CellValue::None() {
+  return CellValue(kNoneBox);
+}
+
+inline CellValue::Kind CellValue::GetKind() const {
+  switch (bits_ & kBoxMask) {
+    case kErrorBox:
+      return Kind::kError;
+    case kTextBox:
+      return Kind::kText;
+    case kNoneBox:
+      return Kind::kNone;
+    default:
+      return Kind::kNumber;
+  }
+}
+
+inline bool CellValue::IsNumber() const {
+  // Boxes are above every negative double, the NaNs being positive.
+  return bits_ < kErrorBox;
+}
+
+inline double CellValue::GetNumber() const {
+  double number;
+  std::memcpy(&number, &bits_, sizeof(number));
+  return number;
+}
+
+inline FormulaError CellValue::GetError() const {
+  return static_cast<FormulaError::Category>(bits_ & ~kBoxMask);
+}
+
+inline bool CellValue::operator==(CellValue rhs) const {
+  return bits_ == rhs.bits_;
+}
+
+inline bool CellValue::operator!=(CellValue rhs) const {
+  return bits_ != rhs.bits_;
+}
+
+#endif // SPREADSHEET_CELL_VALUE_H_
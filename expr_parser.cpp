@@ -0,0 +1,257 @@
+#include "expr_parser.h"
+
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "common.h"
+#include "formula_ast.h"
+#include "utils.h"
+
+namespace {
+using expr_parser::Result;
+using expr_parser::Status;
+
+constexpr int kLetterCount = 26;
+
+bool IsSpace(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+bool IsDigit(char ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+bool IsUpper(char ch) {
+  return ch >= 'A' && ch <= 'Z';
+}
+
+// Binding power of a binary operator, 0 if ch isn't one.
+int Precedence(char ch) {
+  switch (ch) {
+    case '+':
+    case '-':
+      return 1;
+    case '*':
+    case '/':
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// Same rules as Position::FromString, without the intermediate strings.
+std::optional<Position> ToPosition(std::string_view letters,
+                                   std::string_view digits) {
+  if (letters.size() + digits.size() > 8 ||
+      (digits.size() > 1 && digits[0] == '0')) {
+    return std::nullopt;
+  }
+  Position pos{0, 0};
+  for (char ch : digits) {
+    pos.row = pos.row * 10 + (ch - '0');
+  }
+  for (char ch : letters) {
+    pos.col = pos.col * kLetterCount + (ch - 'A' + 1);
+  }
+  --pos.row;
+  --pos.col;
+  if (!pos.IsValid()) {
+    return std::nullopt;
+  }
+  return pos;
+}
+
+// Same value as ToDouble, without the string stream on the common path.
+std::optional<double> ToNumber(std::string_view text) {
+  double value = 0.0;
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(),
+                                   value);
+  if (ec == std::errc::result_out_of_range) {
+    // Overflow is an error, while underflow gives 0 for ToDouble.
+    return ToDouble(std::string(text));
+  }
+  if (ec != std::errc() || end != text.data() + text.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+class Parser {
+ public:
+  Parser(std::string_view expr, FormulaAst &ast) : expr_(expr), ast_(ast) {}
+
+  Result Run() {
+    if (ParseExpr(1) && Peek() != '\0') {
+      Fail(Status::kTrailingInput, pos_);
+    }
+    return result_;
+  }
+
+ private:
+  // expr : operand (op expr)*, where every op binds at least min_precedence.
+  bool ParseExpr(int min_precedence) {
+    if (!ParseOperand()) {
+      return false;
+    }
+    while (true) {
+      char op = Peek();
+      int precedence = Precedence(op);
+      if (precedence == 0 || precedence < min_precedence) {
+        return true;
+      }
+      ++pos_;
+      if (!ParseExpr(precedence + 1)) {
+        return false;
+      }
+      ast_.AddBinaryOp(op);
+    }
+  }
+
+  // operand : '(' expr ')' | ('+' | '-') operand | NUMBER | CELL
+  bool ParseOperand() {
+    char ch = Peek();
+    if (ch == '(') {
+      auto open = pos_++;
+      if (!ParseExpr(1)) {
+        return false;
+      }
+      if (Peek() != ')') {
+        return Fail(Status::kUnbalancedParens, open);
+      }
+      ++pos_;
+      return true;
+    }
+    if (ch == '+' || ch == '-') {
+      ++pos_;
+      if (!ParseOperand()) {
+        return false;
+      }
+      ast_.AddUnaryOp(ch);
+      return true;
+    }
+    if (IsDigit(ch) || ch == '.') {
+      return ParseNumber();
+    }
+    if (IsUpper(ch)) {
+      return ParseCell();
+    }
+    if (ch == '\0') {
+      return Fail(Status::kUnexpectedEnd, pos_);
+    }
+    return Fail(Status::kUnexpectedChar, pos_);
+  }
+
+  // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+  bool ParseNumber() {
+    auto start = pos_;
+    bool has_int = SkipDigits();
+    if (Current() == '.') {
+      ++pos_;
+      if (!SkipDigits()) {
+        return Fail(Status::kBadNumber, start);
+      }
+    } else if (!has_int) {
+      return Fail(Status::kBadNumber, start);
+    }
+    if (Current() == 'e' || Current() == 'E') {
+      ++pos_;
+      if (Current() == '+' || Current() == '-') {
+        ++pos_;
+      }
+      if (!SkipDigits()) {
+        return Fail(Status::kBadNumber, start);
+      }
+    }
+
+    auto text = expr_.substr(start, pos_ - start);
+    ast_.AddLiteral(std::string(text), ToNumber(text));
+    return true;
+  }
+
+  // CELL : [A-Z]+ [0-9]+
+  bool ParseCell() {
+    auto start = pos_;
+    while (IsUpper(Current())) {
+      ++pos_;
+    }
+    auto digits_start = pos_;
+    SkipDigits();
+
+    auto pos = ToPosition(expr_.substr(start, digits_start - start),
+                          expr_.substr(digits_start, pos_ - digits_start));
+    if (!pos) {
+      return Fail(Status::kBadCell, start);
+    }
+    ast_.AddCell(*pos);
+    return true;
+  }
+
+  // Returns false if there are no digits.
+  bool SkipDigits() {
+    auto start = pos_;
+    while (IsDigit(Current())) {
+      ++pos_;
+    }
+    return pos_ > start;
+  }
+
+  char Current() const {
+    return pos_ < expr_.size() ? expr_[pos_] : '\0';
+  }
+
+  // Skips whitespaces and returns the next char, '\0' at the end.
+  char Peek() {
+    while (IsSpace(Current())) {
+      ++pos_;
+    }
+    return Current();
+  }
+
+  bool Fail(Status status, size_t offset) {
+    result_ = {.status = status, .offset = offset};
+    return false;
+  }
+
+  std::string_view expr_;
+  size_t pos_ = 0;
+  FormulaAst &ast_;
+  Result result_;
+};
+}
+
+namespace expr_parser {
+Result Parse(std::string_view expr, FormulaAst &ast) {
+  return Parser(expr, ast).Run();
+}
+
+std::string_view ToString(Status status) {
+  switch (status) {
+    case Status::kOk:
+      return "ok";
+    case Status::kUnexpectedEnd:
+      return "unexpected end of expression";
+    case Status::kUnexpectedChar:
+      return "unexpected character";
+    case Status::kBadNumber:
+      return "malformed number";
+    case Status::kBadCell:
+      return "invalid cell reference";
+    case Status::kUnbalancedParens:
+      return "unbalanced parentheses";
+    case Status::kTrailingInput:
+      return "unexpected input after expression";
+  }
+  return "";
+}
+}
+
+FormulaAst ParseFormulaAst(const std::string &expr) {
+  FormulaAst ast;
+  if (expr_parser::Parse(expr, ast).status != expr_parser::Status::kOk) {
+    throw FormulaException("Wrong formula format");
+  }
+  return ast;
+}
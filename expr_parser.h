@@ -0,0 +1,42 @@
+#ifndef SPREADSHEET_EXPR_PARSER_H_
+#define SPREADSHEET_EXPR_PARSER_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "formula_ast.h"
+
+// Hand-written single pass parser of the Formula.g4 grammar. Builds the same
+// FormulaAst as AstBuilderListener over the ANTLR parse tree, but reports
+// errors with status codes and doesn't allocate besides the tree itself.
+// Operators are parsed by precedence climbing (Pratt): unary +/- binds
+// tighter than * and /, which bind tighter than binary + and -; binary
+// operators are left associative.
+namespace expr_parser {
+enum class Status {
+  kOk = 0,
+  kUnexpectedEnd, // expression ended where an operand was expected
+  kUnexpectedChar, // character which can't start a token
+  kBadNumber, // number literal doesn't match the grammar
+  kBadCell, // cell reference is out of the table or malformed
+  kUnbalancedParens,
+  kTrailingInput, // a complete expression is followed by something else
+};
+
+struct Result {
+  Status status = Status::kOk;
+  size_t offset = 0; // offset of the error in expr
+};
+
+// Appends the expression to ast. On error ast is left partially built.
+// O(N), N - expr.size
+Result Parse(std::string_view expr, FormulaAst &ast);
+
+std::string_view ToString(Status status); // O(1)
+}
+
+// Throws FormulaException if expr is syntactically incorrect.
+FormulaAst ParseFormulaAst(const std::string &expr); // O(N), N - expr.size
+
+#endif // SPREADSHEET_EXPR_PARSER_H_
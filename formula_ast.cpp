@@ -0,0 +1,269 @@
+#include "formula_ast.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "utils.h"
+
+namespace {
+bool IsAdditive(char op) {
+  return op == '+' || op == '-';
+}
+
+bool NeedParenthesis(char parent_op, bool is_rhs,
+                     const FormulaAst::Node &child) {
+  if (child.type != FormulaAst::NodeType::kBinaryOp) {
+    return false;
+  }
+  return (parent_op == '-' && is_rhs && IsAdditive(child.op)) ||
+      ((parent_op == '*' || parent_op == '/') && IsAdditive(child.op)) ||
+      (parent_op == '/' && is_rhs && !IsAdditive(child.op));
+}
+
+// Offset of a reference after rows/cols insertion or deletion, while the
+// anchor moves from anchor to new_anchor. Updates result accordingly.
+Position ShiftOffset(Position offset, Position anchor, Position new_anchor,
+                     OpType op_type, ShiftType shift_type, int first_idx,
+                     int count, IFormula::HandlingResult &result) {
+  if (offset == FormulaAst::kDeletedRef) {
+    return offset;
+  }
+  auto pos = FromOffset(offset, anchor);
+  int &idx = shift_type == ShiftType::kRows ? pos.row : pos.col;
+  if (count > 0 && idx >= first_idx) {
+    if (op_type == OpType::kAddition) {
+      idx += count;
+    } else if (idx < first_idx + count) {
+      result = IFormula::HandlingResult::ReferencesChanged;
+      return FormulaAst::kDeletedRef;
+    } else {
+      idx -= count;
+    }
+    if (result == IFormula::HandlingResult::NothingChanged) {
+      result = IFormula::HandlingResult::ReferencesRenamedOnly;
+    }
+  }
+  return ToOffset(pos, new_anchor);
+}
+
+void ClampShift(int &first_idx, int &count) {
+  int max_idx = Position::kMaxRows;
+  first_idx = std::min(max_idx, first_idx);
+  count = std::max(0, std::min(max_idx, count));
+}
+}
+
+void FormulaAst::AddLiteral(std::string text) {
+  auto value = ToDouble(text);
+  AddLiteral(std::move(text), value);
+}
+
+void FormulaAst::AddLiteral(std::string text, std::optional<double> value) {
+  nodes_.push_back({.type = NodeType::kLiteral,
+                    .first = static_cast<int32_t>(nodes_.size()),
+                    .operand = static_cast<int32_t>(literals_.size())});
+  literals_.push_back({.text = std::move(text), .value = value});
+}
+
+void FormulaAst::AddCell(Position pos) {
+  nodes_.push_back({.type = NodeType::kCell,
+                    .first = static_cast<int32_t>(nodes_.size()),
+                    .operand = static_cast<int32_t>(refs_.size())});
+  refs_.push_back(pos);
+}
+
+void FormulaAst::AddUnaryOp(char op) {
+  if (nodes_.empty()) {
+    throw std::runtime_error("FormulaAst::AddUnaryOp : no operand");
+  }
+  nodes_.push_back({.type = NodeType::kUnaryOp,
+                    .op = op,
+                    .first = nodes_.back().first});
+}
+
+void FormulaAst::AddBinaryOp(char op) {
+  if (nodes_.empty() || nodes_.back().first == 0) {
+    throw std::runtime_error("FormulaAst::AddBinaryOp : no operands");
+  }
+  auto lhs = nodes_.back().first - 1;
+  nodes_.push_back({.type = NodeType::kBinaryOp,
+                    .op = op,
+                    .first = nodes_[lhs].first});
+}
+
+void FormulaAst::Rebase(Position from, Position to) {
+  for (auto &offset : refs_) {
+    if (!(offset == kDeletedRef)) {
+      offset = ToOffset(FromOffset(offset, from), to);
+    }
+  }
+}
+
+bool FormulaAst::Empty() const {
+  return nodes_.empty();
+}
+
+const std::vector<FormulaAst::Node> &FormulaAst::Nodes() const {
+  return nodes_;
+}
+
+const FormulaAst::Literal &FormulaAst::GetLiteral(int32_t idx) const {
+  return literals_[idx];
+}
+
+const std::vector<Position> &FormulaAst::Refs() const {
+  return refs_;
+}
+
+std::string FormulaAst::ToString(Position anchor) const {
+  std::string result;
+  if (!nodes_.empty()) {
+    Print(anchor, result);
+  }
+  return result;
+}
+
+std::vector<Position> FormulaAst::ReferencedCells(Position anchor) const {
+  std::vector<Position> refs;
+  refs.reserve(refs_.size());
+  for (auto offset : refs_) {
+    if (!(offset == kDeletedRef)) {
+      refs.push_back(FromOffset(offset, anchor));
+    }
+  }
+  std::sort(begin(refs), end(refs));
+  refs.erase(std::unique(begin(refs), end(refs)), end(refs));
+  return refs;
+}
+
+IFormula::HandlingResult FormulaAst::Shift(Position anchor,
+                                           Position new_anchor,
+                                           OpType op_type,
+                                           ShiftType shift_type,
+                                           int first_idx,
+                                           int count) {
+  ClampShift(first_idx, count);
+  auto result = IFormula::HandlingResult::NothingChanged;
+  for (auto &offset : refs_) {
+    offset = ShiftOffset(offset, anchor, new_anchor, op_type, shift_type,
+                         first_idx, count, result);
+  }
+  return result;
+}
+
+FormulaAst::ShiftCheck FormulaAst::CheckShift(Position anchor,
+                                              Position new_anchor,
+                                              OpType op_type,
+                                              ShiftType shift_type,
+                                              int first_idx,
+                                              int count) const {
+  ClampShift(first_idx, count);
+  ShiftCheck check{.result = IFormula::HandlingResult::NothingChanged,
+                   .offsets_changed = false};
+  for (auto offset : refs_) {
+    if (!(ShiftOffset(offset, anchor, new_anchor, op_type, shift_type,
+                      first_idx, count, check.result) == offset)) {
+      check.offsets_changed = true;
+    }
+  }
+  return check;
+}
+
+size_t FormulaAst::Hash() const {
+  size_t hash = nodes_.size();
+  auto combine = [&hash](size_t value) {
+    hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  };
+
+  std::hash<std::string> string_hash;
+  for (const auto &node : nodes_) {
+    combine(static_cast<size_t>(node.type) << 8 | static_cast<uint8_t>(node.op));
+    if (node.type == NodeType::kLiteral) {
+      combine(string_hash(literals_[node.operand].text));
+    }
+  }
+  for (auto offset : refs_) {
+    combine(PositionHash{}(offset));
+  }
+  return hash;
+}
+
+bool FormulaAst::operator==(const FormulaAst &rhs) const {
+  if (nodes_ != rhs.nodes_ || refs_ != rhs.refs_ ||
+      literals_.size() != rhs.literals_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < literals_.size(); ++i) {
+    if (literals_[i].text != rhs.literals_[i].text) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FormulaAst::Node::operator==(const Node &rhs) const {
+  return type == rhs.type && op == rhs.op && first == rhs.first &&
+      operand == rhs.operand;
+}
+
+int32_t FormulaAst::Lhs(int32_t idx) const {
+  return nodes_[idx - 1].first - 1;
+}
+
+void FormulaAst::Print(Position anchor, std::string &out) const {
+  // Pending output in reverse: a node to print or, with kChar, a character.
+  constexpr int32_t kChar = -1;
+  struct Item {
+    int32_t idx;
+    char ch = 0;
+  };
+  std::vector<Item> st{{static_cast<int32_t>(nodes_.size()) - 1}};
+  auto push_operand = [&st](int32_t operand, bool parens) {
+    if (parens) st.push_back({kChar, ')'});
+    st.push_back({operand});
+    if (parens) st.push_back({kChar, '('});
+  };
+
+  while (!st.empty()) {
+    auto [idx, ch] = st.back();
+    st.pop_back();
+    if (idx == kChar) {
+      out += ch;
+      continue;
+    }
+    const auto &node = nodes_[idx];
+    switch (node.type) {
+      case NodeType::kLiteral:
+        out += literals_[node.operand].text;
+        break;
+      case NodeType::kCell:
+        if (refs_[node.operand] == kDeletedRef) {
+          out += FormulaError{FormulaError::Category::Ref}.ToString();
+        } else {
+          out += FromOffset(refs_[node.operand], anchor).ToString();
+        }
+        break;
+      case NodeType::kUnaryOp: {
+        const auto &operand = nodes_[idx - 1];
+        push_operand(idx - 1, operand.type == NodeType::kBinaryOp &&
+            IsAdditive(operand.op));
+        st.push_back({kChar, node.op});
+        break;
+      }
+      case NodeType::kBinaryOp: {
+        auto lhs = Lhs(idx);
+        push_operand(idx - 1,
+                     NeedParenthesis(node.op, true, nodes_[idx - 1]));
+        st.push_back({kChar, node.op});
+        push_operand(lhs, NeedParenthesis(node.op, false, nodes_[lhs]));
+        break;
+      }
+    }
+  }
+}
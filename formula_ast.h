@@ -0,0 +1,107 @@
+#ifndef SPREADSHEET_FORMULA_AST_H_
+#define SPREADSHEET_FORMULA_AST_H_
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "formula.h"
+#include "utils.h"
+
+// Parsed once, owned expression tree of a formula.
+// Nodes are stored in post-order in a single vector: an operand always
+// precedes its operator and the root is the last node. The right operand of a
+// binary operator is the previous node, the left one ends right before the
+// first node of the right subtree.
+// References are relative and kept apart from the nodes: refs_ holds the
+// offset of every referenced cell from the formula anchor (the cell holding
+// the formula), a cell node keeps an index in it. A formula filled down a
+// column has the same tree in every cell, and rows/cols shifts only adjust
+// the integers in refs_.
+class FormulaAst {
+ public:
+  enum class NodeType : uint8_t {
+    kLiteral,
+    kCell,
+    kUnaryOp,
+    kBinaryOp,
+  };
+
+  struct Node {
+    NodeType type;
+    char op = 0; // '+', '-', '*' or '/' for operators
+    int32_t first = 0; // index of the first node of this subtree
+    int32_t operand = -1; // index in literals_ or refs_ for kLiteral/kCell
+
+    bool operator==(const Node &rhs) const;
+  };
+
+  struct Literal {
+    std::string text;
+    std::optional<double> value; // empty if text can't be read as a number
+  };
+
+  // Offset of a reference to a deleted cell, printed as #REF!.
+  static constexpr Position kDeletedRef{std::numeric_limits<int>::min(),
+                                        std::numeric_limits<int>::min()};
+
+  struct ShiftCheck {
+    IFormula::HandlingResult result;
+    bool offsets_changed;
+  };
+
+  // Post-order construction. Each call appends one node. Cells are added with
+  // absolute positions, i.e. relative to the A1 anchor. O(1)
+  void AddLiteral(std::string text);
+  // Literal with an already computed value.
+  void AddLiteral(std::string text, std::optional<double> value);
+  void AddCell(Position pos);
+  void AddUnaryOp(char op);
+  void AddBinaryOp(char op);
+
+  // Makes offsets relative to `to` instead of `from`. O(R), R - refs.size
+  void Rebase(Position from, Position to);
+
+  bool Empty() const; // O(1)
+  const std::vector<Node> &Nodes() const; // O(1)
+  const Literal &GetLiteral(int32_t idx) const; // O(1)
+  // Offsets of the cell nodes in post-order, kDeletedRef for deleted ones.
+  const std::vector<Position> &Refs() const; // O(1)
+
+  // Expression without spaces and redundant parentheses.
+  // Deleted references are printed as #REF!. O(N), N - nodes.size
+  std::string ToString(Position anchor) const;
+
+  // Sorted unique list of referenced cells. O(RlogR), R - refs.size
+  std::vector<Position> ReferencedCells(Position anchor) const;
+
+  // Renames/invalidates references after rows/cols insertion or deletion,
+  // while the anchor moves from `anchor` to `new_anchor`. Only refs_ change.
+  // O(R), R - refs.size
+  IFormula::HandlingResult Shift(Position anchor, Position new_anchor,
+                                 OpType op_type, ShiftType shift_type,
+                                 int first_idx, int count);
+  // Result of the same Shift and whether it would change any offset, without
+  // changing the tree. O(R), R - refs.size
+  ShiftCheck CheckShift(Position anchor, Position new_anchor,
+                        OpType op_type, ShiftType shift_type,
+                        int first_idx, int count) const;
+
+  size_t Hash() const; // O(N), N - nodes.size
+  bool operator==(const FormulaAst &rhs) const; // O(N), N - nodes.size
+
+ private:
+  int32_t Lhs(int32_t idx) const; // O(1)
+  // Appends the expression. Iterative, so a chain of any length fits the
+  // stack. O(N), N - nodes.size
+  void Print(Position anchor, std::string &out) const;
+
+  std::vector<Node> nodes_;
+  std::vector<Literal> literals_;
+  std::vector<Position> refs_;
+};
+
+#endif // SPREADSHEET_FORMULA_AST_H_
@@ -0,0 +1,57 @@
+#include "formula_pool.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+FormulaShape::FormulaShape(FormulaAst ast, size_t hash)
+    : ast(std::move(ast)),
+      program(FormulaProgram::Compile(this->ast)),
+      hash(hash) {}
+
+std::shared_ptr<const FormulaShape> FormulaPool::Intern(FormulaAst ast) {
+  auto hash = ast.Hash();
+
+  auto [it, end] = shapes_.equal_range(hash);
+  while (it != end) {
+    if (auto shape = it->second.lock()) {
+      if (shape->ast == ast) {
+        return shape;
+      }
+      ++it;
+    } else {
+      it = shapes_.erase(it);
+    }
+  }
+
+  if (shapes_.size() >= purge_size_) {
+    Purge();
+  }
+  // Not make_shared: a released shape must free its memory even though the
+  // pool still holds a weak_ptr to it.
+  std::shared_ptr<const FormulaShape> shape(
+      new FormulaShape(std::move(ast), hash));
+  shapes_.emplace(hash, shape);
+  return shape;
+}
+
+void FormulaPool::Purge() {
+  for (auto it = shapes_.begin(); it != shapes_.end();) {
+    if (it->second.expired()) {
+      it = shapes_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  purge_size_ = std::max(kMinPurgeSize, 2 * shapes_.size());
+}
+
+size_t FormulaPool::Size() const {
+  size_t size = 0;
+  for (const auto &[hash, shape] : shapes_) {
+    if (!shape.expired()) {
+      ++size;
+    }
+  }
+  return size;
+}
@@ -0,0 +1,43 @@
+#ifndef SPREADSHEET_FORMULA_POOL_H_
+#define SPREADSHEET_FORMULA_POOL_H_
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+
+#include "formula_ast.h"
+#include "formula_program.h"
+
+// Compiled formula in relative form, shared by every formula with the same
+// structure. Immutable once created.
+struct FormulaShape {
+  FormulaShape(FormulaAst ast, size_t hash); // O(N), N - ast.size
+
+  FormulaAst ast;
+  FormulaProgram program;
+  size_t hash;
+};
+
+// Sheet-level intern pool of formula shapes. A formula filled down a column
+// is compiled and stored once; cells keep a handle plus their anchor.
+// A shape lives while some formula holds it.
+class FormulaPool {
+ public:
+  // Returns the pooled shape equal to ast, compiling a new one only if there
+  // is none. O(N) on average, N - ast.size
+  std::shared_ptr<const FormulaShape> Intern(FormulaAst ast);
+
+  size_t Size() const; // O(K), K - interned shapes count
+
+ private:
+  static constexpr size_t kMinPurgeSize = 1024;
+
+  // Drops entries of released shapes. O(K), K - interned shapes count
+  void Purge();
+
+  std::unordered_multimap<size_t, std::weak_ptr<const FormulaShape>> shapes_;
+  // Entries count which triggers the next Purge
+  size_t purge_size_ = kMinPurgeSize;
+};
+
+#endif // SPREADSHEET_FORMULA_POOL_H_
@@ -0,0 +1,179 @@
+#include "formula_program.h"
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "common.h"
+#include "utils.h"
+
+namespace {
+// Reads the value of a referenced cell as a formula operand through the
+// public interface.
+CellValue ReadCell(const ISheet &sheet, Position pos) {
+  if (!pos.IsValid()) {
+    return CellValue::Error(FormulaError::Category::Ref);
+  }
+  auto cell = sheet.GetCell(pos);
+  if (!cell) {
+    return {};
+  }
+
+  auto value = cell->GetValue();
+  if (std::holds_alternative<double>(value)) {
+    return CellValue::Number(std::get<double>(value));
+  }
+  if (std::holds_alternative<FormulaError>(value)) {
+    return CellValue::Error(std::get<FormulaError>(value).GetCategory());
+  }
+  return TextOperand(std::get<std::string>(value));
+}
+}
+
+FormulaProgram FormulaProgram::Compile(const FormulaAst &ast) {
+  FormulaProgram program;
+  program.code_.reserve(ast.Nodes().size());
+
+  size_t depth = 0;
+  auto push = [&](OpCode code, int32_t operand) {
+    program.code_.push_back({code, operand});
+    program.stack_depth_ = std::max(program.stack_depth_, ++depth);
+  };
+
+  for (const auto &node : ast.Nodes()) {
+    switch (node.type) {
+      case FormulaAst::NodeType::kLiteral: {
+        const auto &literal = ast.GetLiteral(node.operand);
+        if (!literal.value) {
+          push(OpCode::kPushError,
+               static_cast<int32_t>(FormulaError::Category::Value));
+          break;
+        }
+        push(OpCode::kPushNumber,
+             static_cast<int32_t>(program.numbers_.size()));
+        program.numbers_.push_back(*literal.value);
+        break;
+      }
+      case FormulaAst::NodeType::kCell: {
+        auto offset = ast.Refs()[node.operand];
+        if (offset == FormulaAst::kDeletedRef) {
+          push(OpCode::kPushError,
+               static_cast<int32_t>(FormulaError::Category::Ref));
+          break;
+        }
+        push(OpCode::kLoadCell, static_cast<int32_t>(program.cells_.size()));
+        program.cells_.push_back(offset);
+        break;
+      }
+      case FormulaAst::NodeType::kUnaryOp:
+        if (node.op == '-') {
+          program.code_.push_back({OpCode::kNeg});
+        }
+        break;
+      case FormulaAst::NodeType::kBinaryOp:
+        switch (node.op) {
+          case '+':
+            program.code_.push_back({OpCode::kAdd});
+            break;
+          case '-':
+            program.code_.push_back({OpCode::kSub});
+            break;
+          case '*':
+            program.code_.push_back({OpCode::kMul});
+            break;
+          case '/':
+            program.code_.push_back({OpCode::kDiv});
+            break;
+          default:
+            throw std::logic_error("Unexpected binary operator");
+        }
+        --depth;
+        break;
+    }
+  }
+
+  if (depth != 1) {
+    throw std::runtime_error("FormulaProgram::Compile : unbalanced ast");
+  }
+  return program;
+}
+
+IFormula::Value FormulaProgram::Execute(const ISheet &sheet,
+                                        Position anchor) const {
+  auto load = [&sheet](Position pos) { return ReadCell(sheet, pos); };
+  return RunWithStack(load, anchor).ToFormulaValue();
+}
+
+CellValue FormulaProgram::Compute(const IOperandSource &source,
+                                  Position anchor) const {
+  auto load = [&source](Position pos) { return source.GetOperand(pos); };
+  return RunWithStack(load, anchor);
+}
+
+const std::vector<FormulaProgram::Instruction> &FormulaProgram::Code() const {
+  return code_;
+}
+
+size_t FormulaProgram::StackDepth() const {
+  return stack_depth_;
+}
+
+template <typename Load>
+CellValue FormulaProgram::RunWithStack(const Load &load,
+                                       Position anchor) const {
+  if (stack_depth_ <= kInlineStackSize) {
+    double stack[kInlineStackSize];
+    return Run(load, anchor, stack);
+  }
+  auto stack = std::make_unique<double[]>(stack_depth_);
+  return Run(load, anchor, stack.get());
+}
+
+template <typename Load>
+CellValue FormulaProgram::Run(const Load &load, Position anchor,
+                              double *stack) const {
+  size_t size = 0;
+
+  for (const auto &instruction : code_) {
+    switch (instruction.code) {
+      case OpCode::kPushNumber:
+        stack[size++] = numbers_[instruction.operand];
+        break;
+      case OpCode::kLoadCell: {
+        auto operand = load(FromOffset(cells_[instruction.operand], anchor));
+        if (!operand.IsNumber()) {
+          return operand;
+        }
+        stack[size++] = operand.GetNumber();
+        break;
+      }
+      case OpCode::kPushError:
+        return CellValue::Error(
+            static_cast<FormulaError::Category>(instruction.operand));
+      case OpCode::kNeg:
+        stack[size - 1] = -stack[size - 1];
+        break;
+      case OpCode::kAdd:
+        --size;
+        stack[size - 1] += stack[size];
+        break;
+      case OpCode::kSub:
+        --size;
+        stack[size - 1] -= stack[size];
+        break;
+      case OpCode::kMul:
+        --size;
+        stack[size - 1] *= stack[size];
+        break;
+      case OpCode::kDiv:
+        --size;
+        stack[size - 1] /= stack[size];
+        break;
+    }
+  }
+  return CellValue::Number(stack[0]);
+}
@@ -0,0 +1,61 @@
+#ifndef SPREADSHEET_FORMULA_PROGRAM_H_
+#define SPREADSHEET_FORMULA_PROGRAM_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "cell_value.h"
+#include "common.h"
+#include "formula.h"
+#include "formula_ast.h"
+
+// Flat postfix bytecode of a formula. Executing it is a single loop over the
+// instructions with a value stack preallocated on the native stack, so an
+// evaluation doesn't allocate.
+class FormulaProgram {
+ public:
+  enum class OpCode : uint8_t {
+    kPushNumber, // operand: index in numbers_
+    kLoadCell, // operand: index in cells_, which keeps anchor offsets
+    kPushError, // operand: FormulaError::Category
+    kNeg,
+    kAdd,
+    kSub,
+    kMul,
+    kDiv,
+  };
+
+  struct Instruction {
+    OpCode code;
+    int32_t operand = 0;
+  };
+
+  static FormulaProgram Compile(const FormulaAst &ast); // O(N), N - ast.size
+
+  // Evaluates the program for the formula at anchor. Doesn't check the
+  // result for overflow. O(N), N - code.size
+  IFormula::Value Execute(const ISheet &sheet, Position anchor = {}) const;
+  // Same with the operands read as value words, for the formulas of a sheet.
+  // O(N), N - code.size
+  CellValue Compute(const IOperandSource &source, Position anchor) const;
+
+  const std::vector<Instruction> &Code() const; // O(1)
+  size_t StackDepth() const; // O(1)
+
+ private:
+  // Programs deeper than this use a heap buffer for the value stack.
+  static constexpr size_t kInlineStackSize = 64;
+
+  // load(Position) returns the operand of a cell. O(N), N - code.size
+  template <typename Load>
+  CellValue Run(const Load &load, Position anchor, double *stack) const;
+  template <typename Load>
+  CellValue RunWithStack(const Load &load, Position anchor) const;
+
+  std::vector<Instruction> code_;
+  std::vector<double> numbers_;
+  std::vector<Position> cells_;
+  size_t stack_depth_ = 0;
+};
+
+#endif // SPREADSHEET_FORMULA_PROGRAM_H_
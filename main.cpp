@@ -1,13 +1,118 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <numeric>
+#include <optional>
 #include <ostream>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
+#include "antlr_parser.h"
+#include "async_sheet.h"
+#include "axis_map.h"
 #include "cell.h"
+#include "cell_arena.h"
+#include "cell_value.h"
 #include "common.h"
+#include "expr_parser.h"
+#include "formula_program.h"
 #include "my_formula.h"
 #include "sheet.h"
+#include "sheet_snapshot.h"
 #include "test_runner.h"
+#include "worker_pool.h"
+
+namespace {
+// Calls of the global operator new, for the allocation reports.
+std::atomic<size_t> heap_allocations{0};
+// The first allocation of at least this many bytes fails with std::bad_alloc
+// and disarms it; 0 for none.
+std::atomic<size_t> failing_allocation_size{0};
+
+// Every replaced form of operator new goes through here and every form of
+// operator delete frees, so the compiler sees matching pairs whichever
+// forms the library picks.
+void *CountedAllocate(std::size_t size, std::size_t alignment) {
+  auto failing = failing_allocation_size.load(std::memory_order_relaxed);
+  if (failing != 0 && size >= failing &&
+      failing_allocation_size.compare_exchange_strong(failing, 0)) {
+    throw std::bad_alloc();
+  }
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  size = size == 0 ? 1 : size;
+  auto ptr = alignment <= alignof(std::max_align_t)
+      ? std::malloc(size)
+      // aligned_alloc wants a multiple of the alignment
+      : std::aligned_alloc(alignment,
+                           (size + alignment - 1) / alignment * alignment);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+}
+
+void *operator new(std::size_t size) {
+  return CountedAllocate(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+  return CountedAllocate(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return CountedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return CountedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
 
 std::ostream &operator<<(std::ostream &output, Position pos) {
   return output << "(" << pos.row << ", " << pos.col << ")";
@@ -210,6 +315,1742 @@ void TestFormulaExpressionFormatting() {
   ASSERT_EQUAL(reformat("(1 / 2) / 3"), "1/2/3")
   ASSERT_EQUAL(reformat("1 / (2 / 3)"), "1/(2/3)")
   ASSERT_EQUAL(reformat("((1 + 2) / 3) / A2"), "(1+2)/3/A2")
+
+  // The parser reads a chain iteratively, printing must not recurse into it.
+  constexpr int kTerms = 100'000;
+  std::string chain = "A1";
+  for (int i = 1; i < kTerms; ++i) {
+    chain += i % 2 ? "+A" : "-A";
+    chain += std::to_string(i % Position::kMaxRows + 1);
+  }
+  ASSERT_EQUAL(reformat(chain), chain)
+}
+
+void TestFormulaNestedParensFormatting() {
+  auto reformat = [](std::string expr) {
+    return ParseFormula(std::move(expr))->GetExpression();
+  };
+
+  ASSERT_EQUAL(reformat("((1 + 2)) * 3"), "(1+2)*3")
+  ASSERT_EQUAL(reformat("-((A1 - B1))"), "-(A1-B1)")
+  ASSERT_EQUAL(reformat("1 - (2 - (3 + 4))"), "1-(2-(3+4))")
+
+  auto f = ParseFormula("(A1 + B2) / (C3)");
+  f->HandleInsertedRows(1);
+  ASSERT_EQUAL(f->GetExpression(), "(A1+B3)/C4")
+  f->HandleDeletedCols(0);
+  ASSERT_EQUAL(f->GetExpression(), "(#REF!+A3)/B4")
+}
+
+void TestFormulaProgram() {
+  using OpCode = FormulaProgram::OpCode;
+
+  auto program = FormulaProgram::Compile(ParseFormulaAst("+1 + 2 * -A1"));
+  std::vector<OpCode> codes;
+  for (auto instruction : program.Code()) {
+    codes.push_back(instruction.code);
+  }
+  ASSERT(codes == (std::vector{OpCode::kPushNumber, OpCode::kPushNumber,
+                               OpCode::kLoadCell, OpCode::kNeg, OpCode::kMul,
+                               OpCode::kAdd}))
+  ASSERT_EQUAL(program.StackDepth(), 3u)
+
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "4");
+  ASSERT_EQUAL(std::get<double>(program.Execute(*sheet)), -7)
+
+  // Deeper than the inline value stack.
+  std::string expr = "1";
+  for (int i = 0; i < 100; ++i) {
+    expr = "1+(" + expr + ")";
+  }
+  auto deep = FormulaProgram::Compile(ParseFormulaAst(expr));
+  ASSERT_EQUAL(deep.StackDepth(), 101u)
+  ASSERT_EQUAL(std::get<double>(deep.Execute(*sheet)), 101)
+}
+
+void TestCellValue() {
+  using Kind = CellValue::Kind;
+  ASSERT_EQUAL(sizeof(CellValue), 8u)
+
+  for (double number : {0.0, -0.0, 1.5, -1e300,
+                        std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::denorm_min()}) {
+    auto value = CellValue::Number(number);
+    ASSERT(value.IsNumber())
+    ASSERT(value.GetKind() == Kind::kNumber)
+    ASSERT(std::signbit(value.GetNumber()) == std::signbit(number))
+    ASSERT_EQUAL(value.GetNumber(), number)
+  }
+  ASSERT(CellValue::Number(0.0) != CellValue::Number(-0.0))
+  // Every NaN is the same number, none of them looks like a box.
+  auto nan = CellValue::Number(std::nan(""));
+  ASSERT(nan.IsNumber())
+  ASSERT(std::isnan(nan.GetNumber()))
+  ASSERT(CellValue::Number(-std::nan("")) == nan)
+
+  for (auto category : {FormulaError::Category::Ref,
+                        FormulaError::Category::Value,
+                        FormulaError::Category::Div0}) {
+    auto value = CellValue::Error(category);
+    ASSERT(!value.IsNumber())
+    ASSERT(value.GetKind() == Kind::kError)
+    ASSERT_EQUAL(value.GetError(), FormulaError(category))
+  }
+  ASSERT(CellValue::Text().GetKind() == Kind::kText)
+  ASSERT(CellValue::None().GetKind() == Kind::kNone)
+  ASSERT(CellValue{} == CellValue::Number(0.0))
+
+  // Operands of the cells showing text, read without building ICell::Value.
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "'12");
+  sheet.SetCell("A2"_pos, "abc");
+  sheet.SetCell("A3"_pos, "=1/0");
+  sheet.SetCell("B1"_pos, "=A1+A4");
+  sheet.SetCell("B2"_pos, "=A2");
+  sheet.SetCell("B3"_pos, "=A3");
+  ASSERT(sheet.GetOperand("A1"_pos) == CellValue::Number(12))
+  ASSERT(sheet.GetOperand("A4"_pos) == CellValue::Number(0))
+  ASSERT(sheet.GetOperand(Position{-1, 0}) ==
+         CellValue::Error(FormulaError::Category::Ref))
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 12)
+  ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B2"_pos)->GetValue()),
+               FormulaError(FormulaError::Category::Value))
+  ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B3"_pos)->GetValue()),
+               FormulaError(FormulaError::Category::Div0))
+  ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()),
+               "12")
+}
+
+void TestFormulaPool() {
+  Sheet sheet;
+  for (int i = 1; i <= 100; ++i) {
+    auto row = std::to_string(i);
+    sheet.SetCell(Position::FromString("C" + row), "=A" + row + "*B" + row);
+  }
+  ASSERT_EQUAL(sheet.GetFormulaPool().Size(), 1u)
+  ASSERT_EQUAL(sheet.GetCell("C42"_pos)->GetText(), "=A42*B42")
+
+  sheet.SetCell("A10"_pos, "3");
+  sheet.SetCell("B10"_pos, "5");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("C10"_pos)->GetValue()), 15)
+
+  // Every formula moves together with its references.
+  sheet.InsertRows(0, 1);
+  ASSERT_EQUAL(sheet.GetFormulaPool().Size(), 1u)
+  ASSERT_EQUAL(sheet.GetCell("C11"_pos)->GetText(), "=A11*B11")
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("C11"_pos)->GetValue()), 15)
+
+  // Offsets to column A grow by one, still the same for all formulas.
+  sheet.InsertCols(1, 1);
+  ASSERT_EQUAL(sheet.GetFormulaPool().Size(), 1u)
+  ASSERT_EQUAL(sheet.GetCell("D11"_pos)->GetText(), "=A11*C11")
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("D11"_pos)->GetValue()), 15)
+
+  sheet.SetCell("D11"_pos, "=A11+C11");
+  ASSERT_EQUAL(sheet.GetFormulaPool().Size(), 2u)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("D11"_pos)->GetValue()), 8)
+}
+
+void TestFormulaShiftKeepsShape() {
+  Sheet sheet;
+  sheet.SetCell("C3"_pos, "=A1+B5");
+  sheet.SetCell("C4"_pos, "=A2+B6");
+  const auto &pool = sheet.GetFormulaPool();
+  ASSERT_EQUAL(pool.Size(), 1u)
+  auto shape = [&sheet](Position pos) {
+    auto &payload = sheet.FindCell(pos)->GetPayload();
+    return std::get<cell_data::Formula>(payload).GetShape().get();
+  };
+  auto c3 = shape("C3"_pos);
+
+  // The formulas move together with their references: offsets stay the same
+  // and the cells keep their shape.
+  sheet.InsertRows(0, 2);
+  ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=A3+B7")
+  ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "=A4+B8")
+  ASSERT_EQUAL(shape("C5"_pos), c3)
+  ASSERT_EQUAL(pool.Size(), 1u)
+
+  sheet.InsertCols(5, 1);
+  ASSERT_EQUAL(shape("C5"_pos), c3)
+
+  // Only the references to B7 and below move.
+  sheet.InsertRows(6, 1);
+  ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=A3+B8")
+  ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "=A4+B9")
+  ASSERT_EQUAL(shape("C6"_pos), shape("C5"_pos))
+  ASSERT(shape("C5"_pos) != c3)
+
+  sheet.DeleteRows(2, 1);
+  ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=#REF!+B7")
+  ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("C4"_pos)->GetValue()),
+               FormulaError(FormulaError::Category::Ref))
+  ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=A3+B8")
+}
+
+void TestMovedFormulaSetAgain() {
+  Sheet sheet;
+  sheet.SetCell("A2"_pos, "1");
+  sheet.SetCell("A3"_pos, "2");
+  sheet.SetCell("B2"_pos, "=A2");
+  sheet.InsertRows(0, 1);
+  ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3")
+
+  // The text set before the move names another cell at the new position.
+  sheet.SetCell("B3"_pos, "=A2");
+  ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A2")
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 0)
+  sheet.SetCell("B3"_pos, "=A3");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 1)
+
+  auto snapshot = sheet.Snapshot();
+  sheet.InsertRows(0, 1);
+  ASSERT_EQUAL(*snapshot->GetText("B3"_pos), "=A3")
+  ASSERT_EQUAL(*sheet.Snapshot()->GetText("B4"_pos), "=A4")
+}
+
+void TestRefIndex() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "=B2+C300");
+  sheet.SetCell("D5"_pos, "=E100");
+  auto a1 = static_cast<Cell *>(sheet.GetCell("A1"_pos));
+  auto d5 = static_cast<Cell *>(sheet.GetCell("D5"_pos));
+  auto spanning = [&sheet](ShiftType type, int first, int last) {
+    auto cells = sheet.GetRefIndex().Spanning(type, first, last);
+    std::sort(begin(cells), end(cells));
+    return cells;
+  };
+  auto both = std::vector<Cell *>{a1, d5};
+  std::sort(begin(both), end(both));
+
+  // An insertion crosses the spans over the edit point only: D5 moves
+  // together with E100, nothing is renamed by an insertion at the top.
+  ASSERT(spanning(ShiftType::kRows, 0, 0).empty())
+  ASSERT(spanning(ShiftType::kRows, 4, 4) == std::vector<Cell *>{a1})
+  ASSERT(spanning(ShiftType::kRows, 5, 5) == both)
+  ASSERT(spanning(ShiftType::kRows, 299, 299) == std::vector<Cell *>{a1})
+  ASSERT(spanning(ShiftType::kRows, 300, 300).empty())
+  // A deletion crosses the spans over a deleted row/col.
+  ASSERT(spanning(ShiftType::kRows, 99, 100) == both)
+  ASSERT(spanning(ShiftType::kRows, 100, 200) == std::vector<Cell *>{a1})
+  ASSERT(spanning(ShiftType::kCols, 4, 5) == std::vector<Cell *>{d5})
+  ASSERT(spanning(ShiftType::kCols, 5, Position::kMaxCols).empty())
+
+  sheet.InsertRows(50, 100);
+  ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B2+C400")
+  ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=E200")
+  ASSERT(spanning(ShiftType::kRows, 150, 150) == both)
+  ASSERT(spanning(ShiftType::kRows, 200, 200) == std::vector<Cell *>{a1})
+
+  // Untouched by the insertion, the spans move with the physical rows.
+  sheet.InsertRows(0, 1);
+  ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B3+C401")
+  ASSERT(spanning(ShiftType::kRows, 1, 1).empty())
+  ASSERT(spanning(ShiftType::kRows, 400, 400) == std::vector<Cell *>{a1})
+  ASSERT(spanning(ShiftType::kRows, 401, 401).empty())
+
+  sheet.SetCell("D6"_pos, "1");
+  ASSERT(spanning(ShiftType::kCols, 3, 5).empty())
+}
+
+void TestStructuralEditTouchesCrossingFormulas() {
+  Sheet sheet;
+  const int n = 2000;
+  for (int i = 0; i < n; ++i) {
+    sheet.SetCell({i, 0}, std::to_string(i));
+    sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+  }
+  sheet.SetCell("C1"_pos, "=A1+A2000");
+  auto before = sheet.Snapshot();
+
+  // Only C1 spans row 1000, the formulas below it move with their references.
+  ASSERT_EQUAL(sheet.GetRefIndex().Spanning(ShiftType::kRows, 1000, 1000)
+                   .size(), 1u)
+  ASSERT(sheet.GetRefIndex().Spanning(ShiftType::kRows, 0, 0).empty())
+  sheet.InsertRows(1000, 1);
+  ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+A2001")
+  ASSERT_EQUAL(sheet.GetCell("B1500"_pos)->GetText(), "=A1500*2")
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1500"_pos)->GetValue()), 2996)
+
+  // Only the tile of C1 is marked: the moved formulas print at their rows.
+  auto after = sheet.Snapshot();
+  ASSERT_EQUAL(after->BuiltTiles(), 1u)
+  ASSERT_EQUAL(*after->GetText("B1500"_pos), "=A1500*2")
+  ASSERT_EQUAL(*before->GetText("B1500"_pos), "=A1500*2")
+  ASSERT_EQUAL(*after->GetText("B2001"_pos), "=A2001*2")
+
+  sheet.DeleteRows(1, 1);
+  ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+A2000")
+  ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2*2")
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 4)
+}
+
+void TestDependenciesAfterShifts() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "1");
+  sheet->SetCell("B1"_pos, "=A1+1");
+  sheet->SetCell("C200"_pos, "=B1*2");
+  ASSERT_EQUAL(std::get<double>(sheet->GetCell("C200"_pos)->GetValue()), 4)
+
+  sheet->InsertRows(100, 2);
+  sheet->InsertCols(0, 1);
+  ASSERT_EQUAL(sheet->GetCell("D202"_pos)->GetText(), "=C1*2")
+  sheet->SetCell("B1"_pos, "5");
+  ASSERT_EQUAL(std::get<double>(sheet->GetCell("D202"_pos)->GetValue()), 12)
+
+  // The same text set again after a shift is a new formula.
+  sheet->SetCell("D202"_pos, "=B1*2");
+  ASSERT_EQUAL(std::get<double>(sheet->GetCell("D202"_pos)->GetValue()), 10)
+  sheet->SetCell("D202"_pos, "=C1*2");
+
+  sheet->DeleteCols(1, 1);
+  ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=#REF!+1")
+  ASSERT_EQUAL(sheet->GetCell("C202"_pos)->GetText(), "=B1*2")
+  ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("C202"_pos)->GetValue()),
+               FormulaError(FormulaError::Category::Ref))
+
+  sheet->SetCell("B1"_pos, "7");
+  sheet->ClearCell("B1"_pos);
+  ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "")
+  sheet->ClearCell("C202"_pos);
+  ASSERT(!sheet->GetCell("C202"_pos))
+}
+
+void TestAxisMap() {
+  AxisMap map(1000);
+  std::vector<int> expected(1000);
+  for (int i = 0; i < 1000; ++i) expected[i] = i;
+
+  std::mt19937 gen(7);
+  for (int step = 0; step < 500; ++step) {
+    int first = static_cast<int>(gen() % 1000);
+    int count = static_cast<int>(gen() % (1000 - first));
+    if (step % 2 == 0) {
+      map.Insert(first, count);
+      std::rotate(begin(expected) + first, end(expected) - count,
+                  end(expected));
+    } else {
+      auto ids = map.Erase(first, count);
+      ASSERT(std::equal(begin(ids), end(ids), begin(expected) + first,
+                        begin(expected) + first + count))
+      std::rotate(begin(expected) + first, begin(expected) + first + count,
+                  end(expected));
+    }
+  }
+  // Through the treap first, then through the tables the lookups paid for.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < 1000; ++i) {
+      ASSERT_EQUAL(map.ToPhysical(i), expected[i])
+      ASSERT_EQUAL(map.ToLogical(expected[i]), i)
+    }
+    map.BuildTables();
+  }
+
+  ASSERT_EQUAL(map.Extent(0), 0)
+  map.AddCount(expected[10], 0, 1);
+  map.AddCount(expected[500], 0, 2);
+  map.AddCount(expected[700], 1, 1);
+  ASSERT_EQUAL(map.Extent(0), 501)
+  ASSERT_EQUAL(map.Extent(1), 701)
+  map.Insert(0, 100);
+  ASSERT_EQUAL(map.Extent(0), 601)
+  // Erased entries keep their counters, the sheet clears them first.
+  map.Erase(550, 100);
+  ASSERT_EQUAL(map.Extent(0), 951)
+  map.AddCount(expected[500], 0, -2);
+  ASSERT_EQUAL(map.Extent(0), 111)
+  ASSERT_EQUAL(map.Count(expected[10], 0), 1)
+}
+
+void TestCellsStayInPlace() {
+  Sheet sheet;
+  sheet.SetCell("B2"_pos, "text");
+  sheet.SetCell("C3"_pos, "=B2");
+  sheet.SetCell("D400"_pos, "=C3+1");
+  auto b2 = sheet.GetCell("B2"_pos);
+  auto c3 = sheet.GetCell("C3"_pos);
+  auto d400 = sheet.GetCell("D400"_pos);
+
+  sheet.InsertRows(0, 3);
+  sheet.InsertCols(1, 2);
+  ASSERT_EQUAL(sheet.GetCell("D5"_pos), b2)
+  ASSERT_EQUAL(sheet.GetCell("E6"_pos), c3)
+  ASSERT_EQUAL(sheet.GetCell("F403"_pos), d400)
+  ASSERT_EQUAL(static_cast<Cell *>(c3)->GetPosition(), "E6"_pos)
+  ASSERT_EQUAL(c3->GetText(), "=D5")
+  ASSERT_EQUAL(d400->GetText(), "=E6+1")
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{403, 6}))
+
+  sheet.DeleteRows(1, 2);
+  sheet.DeleteCols(0, 1);
+  ASSERT_EQUAL(sheet.GetCell("C3"_pos), b2)
+  ASSERT_EQUAL(sheet.GetCell("D4"_pos), c3)
+  ASSERT_EQUAL(sheet.GetCell("E401"_pos), d400)
+  ASSERT_EQUAL(d400->GetText(), "=D4+1")
+
+  sheet.DeleteRows(3, 1);
+  ASSERT_EQUAL(d400->GetText(), "=#REF!+1")
+  ASSERT_EQUAL(sheet.GetCell("E400"_pos), d400)
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{400, 5}))
+}
+
+void TestSparseStorage() {
+  Sheet sheet;
+  const auto &storage = sheet.GetCellStorage();
+  sheet.SetCell("A1"_pos, "=ZZ16000");
+  // A1 and the empty ZZ16000 referenced by it.
+  ASSERT_EQUAL(storage.TileCount(), 2u)
+  sheet.SetCell("B2"_pos, "text");
+  sheet.SetCell("ZY15999"_pos, "1");
+  ASSERT_EQUAL(storage.TileCount(), 2u)
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{15999, 701}))
+
+  sheet.ClearCell("A1"_pos);
+  sheet.ClearCell("ZY15999"_pos);
+  sheet.ClearCell("ZZ16000"_pos);
+  ASSERT_EQUAL(storage.TileCount(), 1u)
+  ASSERT(!sheet.GetCell("ZZ16000"_pos))
+
+  // Cells of a deleted row are freed together with their tiles.
+  sheet.SetCell("C100"_pos, "1");
+  sheet.SetCell("D5000"_pos, "2");
+  sheet.DeleteRows(1, 1);
+  ASSERT_EQUAL(storage.TileCount(), 2u)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("C99"_pos)->GetValue()), 1)
+  sheet.DeleteCols(2, 2);
+  ASSERT_EQUAL(storage.TileCount(), 0u)
+  ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}))
+}
+
+void TestCellArenaAllocations() {
+  constexpr int kSide = 1000;
+  constexpr size_t kCells = kSide * kSide;
+
+  Sheet sheet;
+  auto before = heap_allocations.load();
+  for (int i = 0; i < kSide; ++i) {
+    for (int j = 0; j < kSide; ++j) {
+      sheet.SetCell({i, j}, std::to_string((i * kSide + j) % 9973));
+    }
+  }
+  auto heap = heap_allocations.load() - before;
+  auto stats = sheet.GetCellArena().GetStats();
+
+  // Without the arena every cell and its size monitor entries are separate
+  // heap allocations. Cell data is kept inline, a plain value gets no links
+  // block.
+  auto bytes_per_cell = stats.chunk_bytes / kCells;
+  std::cerr << "TestCellArenaAllocations: " << kCells << " cells, " << heap
+            << " heap allocations; arena served " << stats.objects
+            << " objects from " << stats.chunks << " chunks ("
+            << stats.chunk_bytes / (1 << 20) << " MiB, " << bytes_per_cell
+            << " bytes/cell)" << std::endl;
+  ASSERT_EQUAL(stats.objects, kCells)
+  ASSERT(heap < kCells / 100)
+  ASSERT(stats.chunks < kCells / 100)
+  ASSERT(bytes_per_cell <= sizeof(Cell) + sizeof(Cell) / 4)
+  // The arena rounds the cells up to its size class, 112 or 128 bytes.
+  ASSERT(sizeof(Cell) <= 112)
+  ASSERT_EQUAL(sheet.GetCell({kSide - 1, kSide - 1})->GetText(), "2699")
+}
+
+void TestRecalcDiamonds() {
+  constexpr int kLevels = 20;
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  // A(i+1) = B(i) + C(i), B(i) = C(i) = A(i): every level is a diamond.
+  for (int i = 0; i < kLevels; ++i) {
+    auto a = Position{i, 0}.ToString();
+    sheet.SetCell({i, 1}, "=" + a);
+    sheet.SetCell({i, 2}, "=" + a);
+    sheet.SetCell({i + 1, 0}, "=" + Position{i, 1}.ToString() + "+" +
+                                  Position{i, 2}.ToString());
+  }
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({kLevels, 0})->GetValue()),
+               1 << kLevels)
+
+  sheet.SetCell("A1"_pos, "2");
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), 3u * kLevels)
+  sheet.Recalculate();
+  auto stats = sheet.GetRecalcStats();
+  ASSERT_EQUAL(stats.touched, 3u * kLevels + 1)
+  ASSERT_EQUAL(stats.evaluated, 3u * kLevels)
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), 0u)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({kLevels, 0})->GetValue()),
+               1 << (kLevels + 1))
+
+  // Reading an outdated value recalculates implicitly.
+  sheet.SetCell({kLevels / 2, 0}, "1");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({kLevels, 0})->GetValue()),
+               1 << (kLevels / 2))
+  ASSERT_EQUAL(sheet.GetRecalcStats().evaluated, 3u * (kLevels / 2))
+
+  // A formula made dirty keeps the memo of its text: set again, it's neither
+  // parsed nor marked.
+  sheet.SetCell("A1"_pos, "3");
+  auto dirty = sheet.GetRecalcEngine().DirtyCount();
+  std::string text = "=A1";
+  auto before = heap_allocations.load();
+  sheet.SetCell("B1"_pos, std::move(text));
+  auto heap = heap_allocations.load() - before;
+  ASSERT_EQUAL(heap, 0u)
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), dirty)
+}
+
+void TestLongChain() {
+  constexpr int kLength = 1'000'000;
+  // A column holds kMaxRows cells, so the chain goes on at the top of the
+  // next one.
+  auto at = [](int i) {
+    return Position{i % Position::kMaxRows, i / Position::kMaxRows};
+  };
+
+  Sheet sheet;
+  sheet.SetCell(at(0), "1");
+  for (int i = 1; i < kLength; ++i) {
+    sheet.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+  }
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell(at(kLength - 1))->GetValue()),
+               kLength)
+  ASSERT_EQUAL(sheet.GetRecalcStats().evaluated, kLength - 1u)
+
+  sheet.SetCell(at(0), "2");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell(at(kLength - 1))->GetValue()),
+               kLength + 1)
+  ASSERT_EQUAL(sheet.GetRecalcStats().touched, static_cast<size_t>(kLength))
+
+  try {
+    sheet.SetCell(at(0), "=" + at(kLength - 1).ToString());
+    ASSERT(false)
+  } catch (const CircularDependencyException &) {
+  }
+
+  // Breaks the chain in every column, the tail gets #REF! through all of it.
+  sheet.DeleteRows(100, 1);
+  ASSERT_EQUAL(std::get<FormulaError>(
+                   sheet.GetCell({at(kLength - 1).row - 1,
+                                  at(kLength - 1).col})->GetValue()),
+               FormulaError(FormulaError::Category::Ref))
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({99, 0})->GetValue()), 101)
+}
+
+void TestWorkerPool() {
+  WorkerPool pool(4);
+  // A chain: every task pushes the next one, the other threads park.
+  constexpr size_t kTasks = 10000;
+  std::vector<int> runs(kTasks);
+  WorkerPool::Job chain = [&](size_t task, WorkerPool::Worker &worker) {
+    ++runs[task];
+    if (task + 1 < kTasks) {
+      worker.Push(task + 1);
+    }
+  };
+  pool.Run({0}, chain);
+  ASSERT(std::all_of(runs.begin(), runs.end(), [](int n) { return n == 1; }))
+
+  // A throwing task ends the run, the first exception reaches the caller.
+  std::vector<size_t> roots(1000);
+  std::iota(roots.begin(), roots.end(), 0);
+  std::atomic<size_t> ran = 0;
+  WorkerPool::Job failing = [&](size_t task, WorkerPool::Worker &) {
+    ++ran;
+    if (task % 100 == 5) {
+      throw std::runtime_error("task " + std::to_string(task));
+    }
+  };
+  auto throws = [](auto &&run) {
+    try {
+      run();
+    } catch (const std::runtime_error &e) {
+      return std::string(e.what()).substr(0, 5) == "task ";
+    }
+    return false;
+  };
+  ASSERT(throws([&] { pool.Run(roots, failing); }))
+  ASSERT(ran.load() <= roots.size())
+  ASSERT(throws([&] { pool.RunOnCaller(roots, failing); }))
+  pool.Start(roots, failing);
+  ASSERT(throws([&] { pool.Wait(); }))
+
+  // The pool goes on.
+  runs.assign(kTasks, 0);
+  pool.Run({0}, chain);
+  ASSERT(std::all_of(runs.begin(), runs.end(), [](int n) { return n == 1; }))
+  pool.Wait();
+}
+
+void TestParallelRecalc() {
+  constexpr int kRows = 2000;
+  constexpr int kCols = 20;
+  // Every column grows the previous one by the input in column A: kRows
+  // independent chains.
+  auto fill = [](Sheet &sheet) {
+    for (int i = 0; i < kRows; ++i) {
+      auto input = Position{i, 0}.ToString();
+      sheet.SetCell({i, 0}, std::to_string(i % 7));
+      for (int j = 1; j < kCols; ++j) {
+        sheet.SetCell({i, j}, "=" + Position{i, j - 1}.ToString() +
+                                  "*1.01+" + input + "/100");
+      }
+    }
+  };
+
+  Sheet sequential;
+  Sheet parallel;
+  parallel.SetRecalcThreads(4);
+  fill(sequential);
+  fill(parallel);
+  sequential.Recalculate();
+  parallel.Recalculate();
+  ASSERT_EQUAL(parallel.GetRecalcStats().evaluated, kRows * (kCols - 1u))
+  ASSERT_EQUAL(parallel.GetRecalcStats().levels, kCols - 1u)
+
+  for (int step = 0; step < 3; ++step) {
+    for (auto sheet : {&sequential, &parallel}) {
+      for (int i = step; i < kRows; i += 3) {
+        sheet->SetCell({i, 0}, std::to_string(step + 10));
+      }
+      sheet->Recalculate();
+    }
+    ASSERT_EQUAL(parallel.GetRecalcStats().evaluated,
+                 sequential.GetRecalcStats().evaluated)
+    ASSERT_EQUAL(parallel.GetRecalcStats().levels,
+                 sequential.GetRecalcStats().levels)
+    for (int i = 0; i < kRows; ++i) {
+      for (int j = 0; j < kCols; ++j) {
+        ASSERT(sequential.GetCell({i, j})->GetValue() ==
+               parallel.GetCell({i, j})->GetValue())
+      }
+    }
+  }
+}
+
+void TestSkewedRecalc() {
+  constexpr int kChain = 3000;
+  constexpr int kLeaves = 5000;
+  // A long chain in column A next to cheap leaves in columns B and C: with
+  // work stealing the leaves run alongside the chain.
+  auto fill = [](Sheet &sheet) {
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < kChain; ++i) {
+      sheet.SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "+1");
+    }
+    for (int i = 0; i < kLeaves; ++i) {
+      sheet.SetCell({i, 1}, "=A1*" + std::to_string(i));
+      sheet.SetCell({i, 2}, "=" + Position{i, 1}.ToString() + "-A1");
+    }
+  };
+
+  Sheet sequential;
+  Sheet parallel;
+  parallel.SetRecalcThreads(4);
+  ASSERT_EQUAL(parallel.GetRecalcEngine().GetThreads(), 4u)
+  fill(sequential);
+  fill(parallel);
+  for (int step = 2; step < 5; ++step) {
+    for (auto sheet : {&sequential, &parallel}) {
+      sheet->SetCell("A1"_pos, std::to_string(step));
+      sheet->Recalculate();
+      ASSERT_EQUAL(sheet->GetRecalcStats().evaluated,
+                   kChain - 1u + 2u * kLeaves)
+      ASSERT_EQUAL(sheet->GetRecalcStats().levels, kChain - 1u)
+    }
+    ASSERT_EQUAL(std::get<double>(parallel.GetCell({kChain - 1, 0})
+                                      ->GetValue()),
+                 kChain - 1 + step)
+    for (int i = 0; i < kLeaves; ++i) {
+      for (int j = 1; j < 3; ++j) {
+        ASSERT(sequential.GetCell({i, j})->GetValue() ==
+               parallel.GetCell({i, j})->GetValue())
+      }
+    }
+  }
+}
+
+void TestEarlyCutoff() {
+  constexpr int kChain = 1000;
+  for (size_t threads : {1, 4}) {
+    Sheet sheet;
+    sheet.SetRecalcThreads(threads);
+    // B1 doubles the input and D1 cancels it out, a chain follows each.
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("D1"_pos, "=A1-A1");
+    for (int i = 1; i < kChain; ++i) {
+      sheet.SetCell({i, 1}, "=" + Position{i - 1, 1}.ToString() + "+1");
+      sheet.SetCell({i, 3}, "=" + Position{i - 1, 3}.ToString() + "+1");
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 1})->GetValue()),
+                 10 + kChain - 1)
+
+    // Same value, other text: only the direct dependents are evaluated.
+    sheet.SetCell("A1"_pos, "5.0");
+    sheet.Recalculate();
+    auto stats = sheet.GetRecalcStats();
+    ASSERT_EQUAL(stats.touched, 2u * kChain + 1)
+    ASSERT_EQUAL(stats.evaluated, 2u)
+    ASSERT_EQUAL(stats.reused, 2u * (kChain - 1))
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 1})->GetValue()),
+                 10 + kChain - 1)
+
+    // The change goes through column B and stops at D1.
+    sheet.SetCell("A1"_pos, "6");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 1})->GetValue()),
+                 12 + kChain - 1)
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 3})->GetValue()),
+                 kChain - 1)
+    stats = sheet.GetRecalcStats();
+    ASSERT_EQUAL(stats.evaluated, kChain + 1u)
+    ASSERT_EQUAL(stats.reused, kChain - 1u)
+
+    // An edited formula is evaluated even if its references didn't change.
+    sheet.SetCell("D1"_pos, "=A1+A1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 3})->GetValue()),
+                 12 + kChain - 1)
+    ASSERT_EQUAL(sheet.GetRecalcStats().evaluated,
+                 static_cast<size_t>(kChain))
+  }
+}
+
+void TestIncrementalCycles() {
+  constexpr int kChain = 10'000;
+  Sheet sheet;
+  auto &order = sheet.GetTopoOrder();
+  sheet.SetCell("A1"_pos, "1");
+  for (int i = 1; i < kChain; ++i) {
+    sheet.SetCell({i, 0}, "=" + Position{i - 1, 0}.ToString() + "+1");
+  }
+  // Appending to a chain and editing its top agree with the order.
+  sheet.SetCell("A2"_pos, "=A1*2");
+  ASSERT_EQUAL(order.Visited(), 0u)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 0})->GetValue()),
+               kChain)
+
+  // A chain in column B is numbered above the one in column A, so A2
+  // referring to it renumbers.
+  sheet.SetCell("C1"_pos, "3");
+  sheet.SetCell("B1"_pos, "=C1");
+  for (int i = 1; i < 10; ++i) {
+    sheet.SetCell({i, 1}, "=" + Position{i - 1, 1}.ToString() + "+1");
+  }
+  sheet.SetCell("A2"_pos, "=B10+A1");
+  auto visited = order.Visited();
+  ASSERT(visited > 0)
+  try {
+    sheet.SetCell("C1"_pos, "=" + Position{kChain - 1, 0}.ToString());
+    ASSERT(false)
+  } catch (const CircularDependencyException &) {
+  }
+  visited = order.Visited();
+  sheet.SetCell("C1"_pos, "=D1");
+  ASSERT_EQUAL(order.Visited(), visited)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({kChain - 1, 0})->GetValue()),
+               kChain + 8)
+
+  // Random edits of a small sheet against a search over the references.
+  constexpr int kSide = 6;
+  std::mt19937 gen(16);
+  auto random_pos = [&gen] {
+    return Position{static_cast<int>(gen() % kSide),
+                    static_cast<int>(gen() % kSide)};
+  };
+  auto reaches = [](const Sheet &sheet, std::vector<Position> stack,
+                    Position target) {
+    std::vector<Position> visited;
+    while (!stack.empty()) {
+      auto pos = stack.back();
+      stack.pop_back();
+      if (pos == target) return true;
+      if (std::find(visited.begin(), visited.end(), pos) != visited.end()) {
+        continue;
+      }
+      visited.push_back(pos);
+      if (auto cell = sheet.GetCell(pos)) {
+        auto refs = cell->GetReferencedCells();
+        stack.insert(stack.end(), refs.begin(), refs.end());
+      }
+    }
+    return false;
+  };
+  Sheet small;
+  for (int i = 0; i < 5000; ++i) {
+    auto pos = random_pos();
+    std::vector<Position> refs;
+    std::string text = "=1";
+    for (auto count = gen() % 3; count > 0; --count) {
+      refs.push_back(random_pos());
+      text += "+" + refs.back().ToString();
+    }
+    auto cycle = reaches(small, refs, pos);
+    try {
+      small.SetCell(pos, text);
+      ASSERT(!cycle)
+    } catch (const CircularDependencyException &) {
+      ASSERT(cycle)
+    }
+  }
+}
+
+void TestApplyBatch() {
+  auto fails_with = [](const std::exception_ptr &error, auto exception) {
+    try {
+      std::rethrow_exception(error);
+    } catch (const decltype(exception) &) {
+      return true;
+    } catch (...) {
+      return false;
+    }
+  };
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "=A1+1");
+  sheet.SetCell("C1"_pos, "=B1*2");
+  std::vector<Sheet::Edit> edits = {
+      {"A1"_pos, "2"},
+      {"A2"_pos, "=C1+A1"},
+      {"A1"_pos, "=A2"}, // A cycle through the previous edit
+      {Position{-1, 0}, "1"},
+      {"D1"_pos, "=1+"},
+      {"D2"_pos, "=D3"}, // Forward reference set later in the batch
+      {"D3"_pos, "=A2*10"},
+      {"B1"_pos, "=A1+2"},
+  };
+  auto version = sheet.GetVersion();
+  auto errors = sheet.ApplyBatch(std::move(edits));
+  ASSERT_EQUAL(errors.size(), 8u)
+  // Every edit counts in the version, the failed ones too.
+  ASSERT_EQUAL(sheet.GetVersion(), version + 8)
+  for (size_t i : {0, 1, 5, 6, 7}) {
+    ASSERT(!errors[i])
+  }
+  ASSERT(fails_with(errors[2], CircularDependencyException("")))
+  ASSERT(fails_with(errors[3], InvalidPositionException("")))
+  ASSERT(fails_with(errors[4], FormulaException("")))
+
+  // The failed edits left the cells as they were.
+  ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2")
+  ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "")
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), 5u)
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()), 100)
+  ASSERT_EQUAL(sheet.GetRecalcStats().evaluated, 5u)
+
+  // The same edits one by one give the same values.
+  Sheet sequential;
+  for (auto [pos, text] : {std::pair{"A1"_pos, "1"}, {"B1"_pos, "=A1+1"},
+                           {"C1"_pos, "=B1*2"}, {"A1"_pos, "2"},
+                           {"A2"_pos, "=C1+A1"}, {"D2"_pos, "=D3"},
+                           {"D3"_pos, "=A2*10"}, {"B1"_pos, "=A1+2"}}) {
+    sequential.SetCell(pos, text);
+  }
+  for (auto pos : {"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos, "D2"_pos,
+                   "D3"_pos}) {
+    ASSERT(sheet.GetCell(pos)->GetValue() ==
+           sequential.GetCell(pos)->GetValue())
+  }
+}
+
+void TestTransactions() {
+  auto dump = [](Sheet &sheet) {
+    std::ostringstream out;
+    sheet.PrintTexts(out);
+    sheet.PrintValues(out);
+    auto size = sheet.GetPrintableSize();
+    out << size.rows << "x" << size.cols;
+    return out.str();
+  };
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("A2"_pos, "=A1+1");
+  sheet.SetCell("B3"_pos, "=A2*A1");
+  sheet.SetCell("C5"_pos, "text");
+  auto before = dump(sheet);
+
+  sheet.BeginTransaction();
+  ASSERT(sheet.InTransaction())
+  sheet.SetCell("A1"_pos, "5");
+  sheet.ApplyBatch({{"D1"_pos, "=B3"}, {"A1"_pos, "=D1"}, {"C5"_pos, "=Z100"}});
+  sheet.DeleteRows(0, 1);
+  sheet.InsertCols(0, 2);
+  sheet.ClearCell("E2"_pos);
+  ASSERT(dump(sheet) != before)
+  sheet.Rollback();
+  ASSERT(!sheet.InTransaction())
+  ASSERT_EQUAL(dump(sheet), before)
+  ASSERT(!sheet.GetCell("Z100"_pos))
+  // The dependency edges are back too.
+  sheet.SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 12)
+
+  sheet.BeginTransaction();
+  sheet.SetCell("A1"_pos, "4");
+  try {
+    sheet.BeginTransaction();
+    ASSERT(false)
+  } catch (const std::runtime_error &) {
+  }
+  sheet.Commit();
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 20)
+  try {
+    sheet.Rollback();
+    ASSERT(false)
+  } catch (const std::runtime_error &) {
+  }
+
+  // Values read inside the transaction don't outlive it.
+  Sheet chain;
+  chain.SetCell("A1"_pos, "1");
+  chain.SetCell("B1"_pos, "=A1");
+  chain.SetCell("C1"_pos, "=B1");
+  ASSERT_EQUAL(std::get<double>(chain.GetCell("C1"_pos)->GetValue()), 1)
+  chain.BeginTransaction();
+  chain.SetCell("B1"_pos, "5");
+  ASSERT_EQUAL(std::get<double>(chain.GetCell("C1"_pos)->GetValue()), 5)
+  chain.Rollback();
+  ASSERT_EQUAL(std::get<double>(chain.GetCell("C1"_pos)->GetValue()), 1)
+  chain.SetCell("A1"_pos, "2");
+  ASSERT_EQUAL(std::get<double>(chain.GetCell("C1"_pos)->GetValue()), 2)
+
+  Sheet deleted;
+  deleted.SetCell("C1"_pos, "=A2+D2");
+  deleted.SetCell("E1"_pos, "=C1");
+  ASSERT_EQUAL(std::get<double>(deleted.GetCell("E1"_pos)->GetValue()), 0)
+  deleted.BeginTransaction();
+  deleted.DeleteCols(3, 2);
+  ASSERT(deleted.GetCell("C1"_pos)->GetValue() ==
+         ICell::Value(FormulaError(FormulaError::Category::Ref)))
+  deleted.Rollback();
+  deleted.SetCell("A2"_pos, "7");
+  ASSERT_EQUAL(std::get<double>(deleted.GetCell("C1"_pos)->GetValue()), 7)
+  ASSERT_EQUAL(std::get<double>(deleted.GetCell("E1"_pos)->GetValue()), 7)
+  deleted.SetCell("D2"_pos, "1");
+  ASSERT_EQUAL(std::get<double>(deleted.GetCell("E1"_pos)->GetValue()), 8)
+
+  // Random edits of every kind, failing ones included, are undone.
+  constexpr int kSide = 8;
+  std::mt19937 gen(18);
+  auto random_pos = [&gen] {
+    return Position{static_cast<int>(gen() % kSide),
+                    static_cast<int>(gen() % kSide)};
+  };
+  auto random_text = [&] {
+    switch (gen() % 3) {
+      case 0:
+        return std::to_string(gen() % 10);
+      case 1:
+        return "=" + random_pos().ToString() + "+" + random_pos().ToString();
+      default:
+        return std::string();
+    }
+  };
+  Sheet random;
+  for (int i = 0; i < 40; ++i) {
+    try {
+      random.SetCell(random_pos(), random_text());
+    } catch (const CircularDependencyException &) {
+    }
+  }
+  // Whether the non-empty cells have the values of a sheet set up from the
+  // texts alone. Formulas with #REF! can't be set again and the dependents of
+  // deleted cells keep #REF! until set, they are left out together with
+  // their own dependents.
+  auto matches_rebuilt = [](const Sheet &sheet) {
+    auto size = sheet.GetPrintableSize();
+    auto for_each_cell = [&](auto f) {
+      for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+          if (auto cell = sheet.GetCell({row, col})) {
+            f(Position{row, col}, *cell);
+          }
+        }
+      }
+    };
+    std::unordered_set<Position, PositionHash> broken;
+    for (bool grown = true; grown;) {
+      grown = false;
+      for_each_cell([&](Position pos, const ICell &cell) {
+        auto refs = cell.GetReferencedCells();
+        if (!broken.count(pos) &&
+            (cell.GetText().find("#REF!") != std::string::npos ||
+             sheet.FindCell(pos)->State() == CellState::kRefError ||
+             std::any_of(refs.begin(), refs.end(),
+                         [&](Position ref) { return broken.count(ref); }))) {
+          broken.insert(pos);
+          grown = true;
+        }
+      });
+    }
+    Sheet fresh;
+    for_each_cell([&](Position pos, const ICell &cell) {
+      if (!broken.count(pos)) {
+        fresh.SetCell(pos, cell.GetText());
+      }
+    });
+    auto matches = true;
+    for_each_cell([&](Position pos, const ICell &cell) {
+      if (!broken.count(pos) && !cell.GetText().empty()) {
+        matches &= cell.GetValue() == fresh.GetCell(pos)->GetValue();
+      }
+    });
+    return matches;
+  };
+  for (int round = 0; round < 20; ++round) {
+    before = dump(random);
+    random.BeginTransaction();
+    for (int i = 0; i < 30; ++i) {
+      try {
+        switch (gen() % 6) {
+          case 0:
+            random.InsertRows(gen() % kSide, 1 + gen() % 2);
+            break;
+          case 1:
+            random.InsertCols(gen() % kSide, 1 + gen() % 2);
+            break;
+          case 2:
+            random.DeleteRows(gen() % kSide, 1 + gen() % 2);
+            break;
+          case 3:
+            random.DeleteCols(gen() % kSide, 1 + gen() % 2);
+            break;
+          case 4:
+            random.ClearCell(random_pos());
+            break;
+          default:
+            random.SetCell(random_pos(), random_text());
+        }
+      } catch (const CircularDependencyException &) {
+      }
+      if (gen() % 4 == 0) {
+        dump(random);
+      }
+    }
+    random.Rollback();
+    ASSERT_EQUAL(dump(random), before)
+    // The restored formulas follow the edits after the rollback.
+    random.SetCell(random_pos(), std::to_string(gen() % 10));
+    ASSERT(matches_rebuilt(random))
+  }
+}
+
+void TestEpochInvalidation() {
+  using Invalidation = RecalcEngine::Invalidation;
+  auto value = [](const Sheet &sheet, Position pos) {
+    return std::get<double>(sheet.GetCell(pos)->GetValue());
+  };
+
+  // A rate cell with a large fan-out: an edit touches none of the formulas,
+  // a read evaluates only the formula read.
+  constexpr int kRows = 1000;
+  constexpr int kCols = 100;
+  Sheet sheet;
+  sheet.SetInvalidation(Invalidation::kEpochs);
+  sheet.SetCell("A1"_pos, "1");
+  for (int i = 1; i <= kRows; ++i) {
+    for (int j = 1; j <= kCols; ++j) {
+      sheet.SetCell({i, j}, "=A1*" + std::to_string(j));
+    }
+  }
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), 0u)
+  sheet.SetCell("A1"_pos, "2");
+  ASSERT_EQUAL(sheet.GetRecalcEngine().DirtyCount(), 0u)
+  ASSERT_EQUAL(value(sheet, {kRows, kCols}), 2 * kCols)
+  auto stats = sheet.GetRecalcStats();
+  ASSERT_EQUAL(stats.touched, 1u)
+  ASSERT_EQUAL(stats.evaluated, 1u)
+  ASSERT_EQUAL(value(sheet, {1, 3}), 6)
+  ASSERT_EQUAL(sheet.GetRecalcStats().evaluated, 1u)
+
+  // A formula whose references keep their values isn't evaluated.
+  sheet.SetCell("A2"_pos, "=B2*0");
+  sheet.SetCell("A3"_pos, "=A2+1");
+  ASSERT_EQUAL(value(sheet, "A3"_pos), 1)
+  sheet.SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(value(sheet, "A3"_pos), 1)
+  stats = sheet.GetRecalcStats();
+  ASSERT_EQUAL(stats.evaluated, 2u) // B2 and A2
+  ASSERT_EQUAL(stats.reused, 1u)
+
+  // The cone of a read is walked without recursion.
+  constexpr int kLength = 100'000;
+  auto at = [](int i) {
+    return Position{i % Position::kMaxRows, i / Position::kMaxRows};
+  };
+  Sheet chain;
+  chain.SetInvalidation(Invalidation::kEpochs);
+  chain.SetCell(at(0), "1");
+  for (int i = 1; i < kLength; ++i) {
+    chain.SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+  }
+  ASSERT_EQUAL(value(chain, at(kLength - 1)), kLength)
+  chain.SetCell(at(0), "2");
+  ASSERT_EQUAL(value(chain, at(kLength - 1)), kLength + 1)
+  ASSERT_EQUAL(chain.GetRecalcStats().evaluated, kLength - 1u)
+
+  // Random edits and reads against a sheet invalidating eagerly, switching
+  // the mode on the way.
+  constexpr int kSide = 8;
+  std::mt19937 gen(21);
+  auto random_pos = [&gen] {
+    return Position{static_cast<int>(gen() % kSide),
+                    static_cast<int>(gen() % kSide)};
+  };
+  auto random_text = [&] {
+    if (gen() % 3 == 0) {
+      return std::to_string(gen() % 10);
+    }
+    std::string text = "=" + std::to_string(gen() % 5);
+    for (auto count = gen() % 3; count > 0; --count) {
+      text += (gen() % 2 ? "+" : "*") + random_pos().ToString();
+    }
+    return text;
+  };
+  auto print = [](const Sheet &sheet) {
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    return out.str();
+  };
+  Sheet eager;
+  Sheet lazy;
+  lazy.SetInvalidation(Invalidation::kEpochs);
+  for (int i = 0; i < 5000; ++i) {
+    auto op = gen() % 21;
+    if (op < 12) {
+      auto pos = random_pos();
+      auto text = random_text();
+      bool failed = false;
+      try {
+        eager.SetCell(pos, text);
+      } catch (const CircularDependencyException &) {
+        failed = true;
+      }
+      try {
+        lazy.SetCell(pos, text);
+        ASSERT(!failed)
+      } catch (const CircularDependencyException &) {
+        ASSERT(failed)
+      }
+    } else if (op < 17) {
+      auto pos = random_pos();
+      auto expected = eager.GetCell(pos);
+      auto actual = lazy.GetCell(pos);
+      ASSERT_EQUAL(!expected, !actual)
+      if (expected) {
+        ASSERT_EQUAL(actual->GetValue(), expected->GetValue())
+      }
+    } else if (op < 18) {
+      auto pos = random_pos();
+      eager.ClearCell(pos);
+      lazy.ClearCell(pos);
+    } else if (op < 19) {
+      std::vector<Sheet::Edit> edits;
+      for (int j = 0; j < 4; ++j) {
+        edits.push_back({random_pos(), random_text()});
+      }
+      auto expected = eager.ApplyBatch(edits);
+      auto actual = lazy.ApplyBatch(edits);
+      for (size_t j = 0; j < edits.size(); ++j) {
+        ASSERT_EQUAL(!expected[j], !actual[j])
+      }
+    } else if (op < 20) {
+      auto index = static_cast<int>(gen() % kSide);
+      if (gen() % 2) {
+        eager.InsertRows(index, 1);
+        lazy.InsertRows(index, 1);
+      } else {
+        eager.DeleteCols(index, 1);
+        lazy.DeleteCols(index, 1);
+      }
+    } else {
+      // kEager, kEpochs, kAdaptive in turn
+      auto next = (static_cast<int>(lazy.GetRecalcEngine().GetInvalidation()) +
+                   1) % 3;
+      lazy.SetInvalidation(static_cast<Invalidation>(next));
+    }
+  }
+  ASSERT_EQUAL(print(lazy), print(eager))
+}
+
+void TestAdaptivePolicy() {
+  using Invalidation = RecalcEngine::Invalidation;
+  using Policy = RecalcEngine::Policy;
+  auto value = [](const Sheet &sheet, Position pos) {
+    return std::get<double>(sheet.GetCell(pos)->GetValue());
+  };
+
+  // A1 feeds a dashboard total read after every edit and a report read once.
+  Sheet sheet;
+  sheet.SetInvalidation(Invalidation::kAdaptive);
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "=A1*2");
+  sheet.SetCell("C1"_pos, "=B1+1");
+  sheet.SetCell("D1"_pos, "=A1*10");
+  auto &engine = sheet.GetRecalcEngine();
+  for (int i = 2; i <= 4; ++i) {
+    ASSERT(sheet.GetRecalcPolicy("C1"_pos) == Policy::kLazy)
+    sheet.SetCell("A1"_pos, std::to_string(i));
+    ASSERT_EQUAL(value(sheet, "C1"_pos), 2 * i + 1)
+  }
+  ASSERT(sheet.GetRecalcPolicy("C1"_pos) == Policy::kEager)
+  ASSERT(sheet.GetRecalcPolicy("B1"_pos) == Policy::kLazy)
+  ASSERT(sheet.GetRecalcPolicy("D1"_pos) == Policy::kLazy)
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 1u)
+  ASSERT_EQUAL(engine.GetPolicyStats().promoted, 1u)
+
+  // The hot total is evaluated on a worker after the edit, its read then
+  // evaluates nothing.
+  auto before = engine.GetPolicyStats();
+  sheet.SetCell("A1"_pos, "10");
+  engine.WaitForRefresh();
+  auto after = engine.GetPolicyStats();
+  ASSERT_EQUAL(after.eager_evaluated - before.eager_evaluated, 2u)
+  ASSERT_EQUAL(value(sheet, "C1"_pos), 21)
+  ASSERT_EQUAL(engine.GetPolicyStats().lazy_evaluated, after.lazy_evaluated)
+  // The report is still evaluated on its read only.
+  ASSERT_EQUAL(value(sheet, "D1"_pos), 100)
+  ASSERT_EQUAL(engine.GetPolicyStats().lazy_evaluated,
+               after.lazy_evaluated + 1)
+
+  // A batch is one edit for the hot formulas too.
+  before = engine.GetPolicyStats();
+  sheet.ApplyBatch({{"A1"_pos, "1"}, {"A2"_pos, "5"}, {"A1"_pos, "2"}});
+  engine.WaitForRefresh();
+  ASSERT_EQUAL(engine.GetPolicyStats().eager_evaluated -
+                   before.eager_evaluated,
+               2u)
+  ASSERT_EQUAL(value(sheet, "C1"_pos), 5)
+
+  // A read racing the workers validates through the same claims: either
+  // evaluates each formula, once.
+  before = engine.GetPolicyStats();
+  sheet.SetCell("A1"_pos, "4");
+  ASSERT_EQUAL(value(sheet, "C1"_pos), 9)
+  engine.WaitForRefresh();
+  after = engine.GetPolicyStats();
+  ASSERT_EQUAL(after.eager_evaluated + after.lazy_evaluated -
+                   before.eager_evaluated - before.lazy_evaluated,
+               2u)
+
+  // Not read for more than kColdEpochs edits, the total turns lazy again.
+  for (uint64_t i = 0; i <= RecalcEngine::kColdEpochs; ++i) {
+    sheet.SetCell("A2"_pos, std::to_string(i));
+  }
+  ASSERT(sheet.GetRecalcPolicy("C1"_pos) == Policy::kLazy)
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 0u)
+  ASSERT_EQUAL(engine.GetPolicyStats().demoted, 1u)
+  before = engine.GetPolicyStats();
+  sheet.SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(engine.GetPolicyStats().eager_evaluated,
+               before.eager_evaluated)
+  ASSERT_EQUAL(value(sheet, "C1"_pos), 7)
+
+  // A single read of a hot formula doesn't demote it, the reads being rare
+  // does: heat drops by one per edit without a read.
+  Sheet rare;
+  rare.SetInvalidation(Invalidation::kAdaptive);
+  rare.SetCell("A1"_pos, "0");
+  rare.SetCell("B1"_pos, "=A1+1");
+  for (int i = 1; i <= 12; ++i) {
+    rare.SetCell("A1"_pos, std::to_string(i));
+    if (i % 3 == 0) {
+      ASSERT_EQUAL(value(rare, "B1"_pos), i + 1)
+    }
+  }
+  ASSERT_EQUAL(rare.GetRecalcEngine().GetPolicyStats().promoted, 0u)
+
+  // Leaving kAdaptive drops the hot set, clearing a hot formula forgets it.
+  for (int i = 0; i < RecalcEngine::kHotHeat; ++i) {
+    sheet.SetCell("A1"_pos, std::to_string(i));
+    value(sheet, "C1"_pos);
+  }
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 1u)
+  sheet.ClearCell("C1"_pos);
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 0u)
+  for (int i = 0; i < RecalcEngine::kHotHeat; ++i) {
+    sheet.SetCell("A1"_pos, std::to_string(i));
+    value(sheet, "B1"_pos);
+  }
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 1u)
+  sheet.SetInvalidation(Invalidation::kEager);
+  ASSERT_EQUAL(engine.GetPolicyStats().hot, 0u)
+  ASSERT(sheet.GetRecalcPolicy("B1"_pos) == Policy::kLazy)
+  sheet.SetCell("A1"_pos, "7");
+  ASSERT_EQUAL(value(sheet, "B1"_pos), 14)
+
+  // Operands read by the formulas aren't reads, also of the error cells.
+  Sheet errors;
+  errors.SetInvalidation(Invalidation::kAdaptive);
+  errors.SetCell("A1"_pos, "=Z1");
+  errors.SetCell("A2"_pos, "=A1");
+  errors.DeleteCols(25, 1);
+  // A1 and A2 keep #REF! until set again, B1 reads A2 as an operand.
+  errors.SetCell("B1"_pos, "=A2+C1");
+  for (int i = 0; i < 2 * RecalcEngine::kHotHeat; ++i) {
+    errors.SetCell("C1"_pos, std::to_string(i));
+    errors.GetCell("B1"_pos)->GetValue();
+  }
+  ASSERT(errors.GetRecalcPolicy("B1"_pos) == Policy::kEager)
+  ASSERT(errors.GetRecalcPolicy("A2"_pos) == Policy::kLazy)
+  ASSERT_EQUAL(errors.GetRecalcEngine().GetPolicyStats().hot, 1u)
+}
+
+void TestConcurrentReads() {
+  using Invalidation = RecalcEngine::Invalidation;
+  constexpr int kRows = 200;
+  constexpr int kReaders = 16;
+  constexpr int kReads = 400;
+
+  // B = A1*i, C chains down from A1, D = B + C: a reader holding the lock
+  // checks them against the A1 it reads.
+  for (auto invalidation : {Invalidation::kEager, Invalidation::kEpochs,
+                            Invalidation::kAdaptive}) {
+    Sheet sheet;
+    sheet.SetInvalidation(invalidation);
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i <= kRows; ++i) {
+      auto row = std::to_string(i + 1);
+      sheet.SetCell({i, 1}, "=A1*" + std::to_string(i));
+      sheet.SetCell({i, 2}, i == 1 ? "=A1" : "=C" + std::to_string(i) + "+1");
+      sheet.SetCell({i, 3}, "=B" + row + "+C" + row);
+    }
+    sheet.SetConcurrentReads(true);
+
+    std::shared_mutex mutex;
+    std::atomic<int> finished = 0;
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kReaders; ++t) {
+      readers.emplace_back([&, t] {
+        std::mt19937 gen(t);
+        for (int n = 0; n < kReads; ++n) {
+          std::shared_lock lock(mutex);
+          auto value = [&](Position pos) {
+            return std::get<double>(sheet.GetCell(pos)->GetValue());
+          };
+          auto rate = value("A1"_pos);
+          // The far end of the chain most of the time, so the readers
+          // validate the same cone at once.
+          int i = gen() % 4 ? kRows : 1 + static_cast<int>(gen() % kRows);
+          if (value({i, 1}) != rate * i || value({i, 2}) != rate + i - 1 ||
+              value({i, 3}) != rate * i + rate + i - 1) {
+            ++failures;
+          }
+        }
+        ++finished;
+      });
+    }
+    for (int edit = 2; finished < kReaders; ++edit) {
+      {
+        std::unique_lock lock(mutex);
+        if (edit % 5 == 0) {
+          // The readers look positions up through the treap until the tables
+          // are rebuilt.
+          sheet.InsertRows(kRows + 10, 1);
+        } else {
+          sheet.SetCell("A1"_pos, std::to_string(edit));
+        }
+      }
+      std::this_thread::yield();
+    }
+    for (auto &reader : readers) {
+      reader.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0)
+  }
+}
+
+void TestSheetSnapshot() {
+  using Invalidation = RecalcEngine::Invalidation;
+  auto print = [](const auto &sheet) {
+    std::ostringstream values;
+    std::ostringstream texts;
+    sheet.PrintValues(values);
+    sheet.PrintTexts(texts);
+    return values.str() + texts.str();
+  };
+
+  // A snapshot keeps the version it was taken at.
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "2");
+  sheet.SetCell("B1"_pos, "=A1*10");
+  sheet.SetCell("C1"_pos, "'=text");
+  auto first = sheet.Snapshot();
+  auto expected = print(sheet);
+  sheet.SetCell("A1"_pos, "3");
+  sheet.InsertRows(0, 2);
+  sheet.SetCell("D5"_pos, "=1/0");
+  ASSERT_EQUAL(print(*first), expected)
+  ASSERT_EQUAL(std::get<double>(*first->GetValue("B1"_pos)), 20)
+  ASSERT_EQUAL(std::get<std::string>(*first->GetValue("C1"_pos)), "=text")
+  ASSERT_EQUAL(*first->GetText("C1"_pos), "'=text")
+  ASSERT(!first->GetValue("D5"_pos))
+  ASSERT_EQUAL(first->GetVersion(), 3u)
+  auto second = sheet.Snapshot();
+  ASSERT_EQUAL(print(*second), print(sheet))
+  ASSERT_EQUAL(std::get<double>(*second->GetValue("B3"_pos)), 30)
+  ASSERT_EQUAL(std::get<FormulaError>(*second->GetValue("D5"_pos)),
+               FormulaError(FormulaError::Category::Div0))
+  ASSERT_EQUAL(second->GetVersion(), sheet.GetVersion())
+
+  // Only the tiles changed since the previous snapshot are built again, a
+  // dependent far away included.
+  constexpr int kFar = 3 * SheetSnapshot::kTileSize;
+  Sheet tiles;
+  tiles.SetCell("A1"_pos, "1");
+  tiles.SetCell({kFar, 0}, "5");
+  tiles.SetCell({0, kFar}, "=A1+1");
+  auto base = tiles.Snapshot();
+  ASSERT_EQUAL(base->TileCount(), 3u)
+  ASSERT_EQUAL(base->BuiltTiles(), 3u)
+  tiles.SetCell({kFar, 0}, "6");
+  auto next = tiles.Snapshot();
+  ASSERT_EQUAL(next->BuiltTiles(), 1u)
+  tiles.SetCell("A1"_pos, "2");
+  next = tiles.Snapshot();
+  ASSERT_EQUAL(next->BuiltTiles(), 2u)
+  ASSERT_EQUAL(std::get<double>(*next->GetValue({0, kFar})), 3)
+  ASSERT_EQUAL(std::get<double>(*base->GetValue({0, kFar})), 2)
+  next = tiles.Snapshot();
+  ASSERT_EQUAL(next->BuiltTiles(), 0u)
+  // An older version goes with its last handle. The sheet keeps the last one,
+  // the next snapshot builds the changed tiles only, also once it's dropped.
+  std::weak_ptr<const SheetSnapshot> dropped = base;
+  base.reset();
+  ASSERT(dropped.expired())
+  next.reset();
+  tiles.SetCell({kFar, 0}, "7");
+  ASSERT_EQUAL(tiles.Snapshot()->BuiltTiles(), 1u)
+
+  // With the lazy modes a snapshot validates only the dependents of the
+  // edits since the previous one.
+  for (auto invalidation : {Invalidation::kEpochs, Invalidation::kAdaptive}) {
+    Sheet lazy;
+    lazy.SetInvalidation(invalidation);
+    for (int i = 0; i < 1000; ++i) {
+      lazy.SetCell({i, 0}, std::to_string(i));
+      lazy.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+    }
+    auto first = lazy.Snapshot();
+    ASSERT_EQUAL(std::get<double>(*first->GetValue({999, 1})), 1998)
+    first.reset();
+    // A new tile, only its own formulas depend on the edits.
+    lazy.SetCell({2000, 0}, "1");
+    lazy.SetCell({2001, 0}, "=A2001+1");
+    lazy.SetCell({2000, 1}, "=A2001*2");
+    lazy.SetCell({2001, 1}, "=A2002*2");
+    auto after = lazy.Snapshot();
+    ASSERT_EQUAL(lazy.GetRecalcStats().touched, 3u)
+    ASSERT_EQUAL(after->BuiltTiles(), 1u)
+    ASSERT_EQUAL(std::get<double>(*after->GetValue({2000, 1})), 2)
+    ASSERT_EQUAL(std::get<double>(*after->GetValue({2001, 1})), 4)
+    lazy.SetCell({999, 0}, "5");
+    after = lazy.Snapshot();
+    ASSERT_EQUAL(after->BuiltTiles(), 1u)
+    ASSERT_EQUAL(std::get<double>(*after->GetValue({999, 1})), 10)
+    ASSERT_EQUAL(std::get<double>(*after->GetValue({998, 1})), 1996)
+  }
+
+  // Random edits in every mode against the prints taken with the snapshots.
+  constexpr int kSide = 8;
+  std::mt19937 gen(24);
+  auto random_pos = [&gen] {
+    return Position{static_cast<int>(gen() % kSide),
+                    static_cast<int>(gen() % kSide)};
+  };
+  for (auto invalidation : {Invalidation::kEager, Invalidation::kEpochs,
+                            Invalidation::kAdaptive}) {
+    Sheet random;
+    random.SetInvalidation(invalidation);
+    std::vector<std::pair<std::shared_ptr<const SheetSnapshot>, std::string>>
+        taken;
+    for (int i = 0; i < 2000; ++i) {
+      auto op = gen() % 20;
+      try {
+        if (op < 12) {
+          auto text = gen() % 3 ? "=" + random_pos().ToString() + "+1"
+                                : std::to_string(gen() % 10);
+          random.SetCell(random_pos(), text);
+        } else if (op < 14) {
+          random.ClearCell(random_pos());
+        } else if (op < 15) {
+          random.InsertRows(static_cast<int>(gen() % kSide), 1);
+        } else if (op < 16) {
+          random.DeleteCols(static_cast<int>(gen() % kSide), 1);
+        } else if (op < 18) {
+          auto pos = random_pos();
+          if (auto cell = random.GetCell(pos)) {
+            cell->GetValue();
+          }
+        } else {
+          // Taken before the print, which would validate every formula.
+          auto snapshot = random.Snapshot();
+          taken.emplace_back(snapshot, print(random));
+          if (gen() % 2) {
+            // Every other base is gone by the next snapshot.
+            taken.pop_back();
+          }
+        }
+      } catch (const CircularDependencyException &) {
+      }
+    }
+    for (const auto &[snapshot, printed] : taken) {
+      ASSERT_EQUAL(print(*snapshot), printed)
+    }
+  }
+
+  // Readers print a snapshot while the writer goes on.
+  Sheet live;
+  for (int i = 0; i < 100; ++i) {
+    live.SetCell({i, 0}, std::to_string(i));
+    live.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+  }
+  auto shared = live.Snapshot();
+  auto printed = print(*shared);
+  std::atomic<int> failures = 0;
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&] {
+      for (int n = 0; n < 20; ++n) {
+        failures += print(*shared) != printed;
+      }
+    });
+  }
+  for (int i = 0; i < 200; ++i) {
+    live.SetCell({i % 100, 0}, std::to_string(i));
+    if (i % 50 == 0) {
+      live.InsertRows(0, 1);
+      live.Snapshot();
+    }
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQUAL(failures.load(), 0)
+}
+
+void TestAsyncSheet() {
+  using Invalidation = RecalcEngine::Invalidation;
+  auto value = [](const Sheet &sheet, Position pos) {
+    return std::get<double>(sheet.GetCell(pos)->GetValue());
+  };
+
+  for (auto invalidation : {Invalidation::kEager, Invalidation::kEpochs}) {
+    AsyncSheet sheet(invalidation);
+    auto first = sheet.SetCellAsync("A1"_pos, "1");
+    sheet.SetCellAsync("B1"_pos, "=A1*2");
+    auto last = sheet.SetCellAsync("C1"_pos, "=B1+A1");
+    ASSERT_EQUAL(first.version, 1u)
+    ASSERT_EQUAL(last.version, 3u)
+    // Read-your-writes.
+    sheet.WaitForVersion(last);
+    ASSERT(sheet.GetVersion() >= 3u)
+    ASSERT(sheet.Snapshot()->GetVersion() >= last.version)
+    ASSERT_EQUAL(sheet.Read([&](const Sheet &s) { return value(s, "C1"_pos); }),
+                 3)
+
+    // A failed edit reports through its ticket, the others still apply.
+    auto cycle = sheet.SetCellAsync("A1"_pos, "=C1");
+    auto invalid = sheet.SetCellAsync(Position{-1, 0}, "1");
+    auto fine = sheet.SetCellAsync("A1"_pos, "5");
+    try {
+      cycle.done.get();
+      ASSERT(false)
+    } catch (const CircularDependencyException &) {
+    }
+    try {
+      invalid.done.get();
+      ASSERT(false)
+    } catch (const InvalidPositionException &) {
+    }
+    fine.done.get();
+    ASSERT_EQUAL(sheet.Read([&](const Sheet &s) { return value(s, "C1"_pos); }),
+                 15)
+
+    // The edits queued while the editing thread waits for the readers are
+    // applied as one batch.
+    auto batches = sheet.GetBatchCount();
+    AsyncSheet::Ticket ticket;
+    sheet.Read([&](const Sheet &) {
+      for (int i = 1; i <= 100; ++i) {
+        ticket = sheet.SetCellAsync("A1"_pos, std::to_string(i));
+      }
+      return 0;
+    });
+    sheet.WaitForVersion(ticket);
+    ASSERT(sheet.GetBatchCount() - batches <= 2u)
+    ASSERT_EQUAL(sheet.Read([&](const Sheet &s) { return value(s, "C1"_pos); }),
+                 300)
+    // A coalesced batch counts every edit, the versions of the tickets and
+    // of the snapshots agree.
+    auto snapshot = sheet.Snapshot();
+    ASSERT_EQUAL(snapshot->GetVersion(), ticket.version)
+    ASSERT_EQUAL(sheet.GetVersion(), ticket.version)
+    ASSERT_EQUAL(std::get<double>(*snapshot->GetValue("B1"_pos)), 200)
+  }
+
+  // Readers on several threads while the edits stream in.
+  AsyncSheet sheet;
+  sheet.SetCellAsync("A1"_pos, "0");
+  for (int i = 1; i < 50; ++i) {
+    sheet.SetCellAsync({i, 0}, "=A" + std::to_string(i) + "+1");
+  }
+  std::atomic<bool> done = false;
+  std::atomic<int> failures = 0;
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&] {
+      while (!done) {
+        sheet.Read([&](const Sheet &s) {
+          auto base = s.GetCell("A1"_pos);
+          auto end = s.GetCell({49, 0});
+          if (base && end && value(s, {49, 0}) != value(s, "A1"_pos) + 49) {
+            ++failures;
+          }
+          return 0;
+        });
+      }
+    });
+  }
+  AsyncSheet::Ticket ticket;
+  for (int i = 1; i <= 200; ++i) {
+    ticket = sheet.SetCellAsync("A1"_pos, std::to_string(i));
+  }
+  sheet.WaitForVersion(ticket);
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQUAL(failures.load(), 0)
+  ASSERT_EQUAL(sheet.Read([&](const Sheet &s) { return value(s, {49, 0}); }),
+               249)
+}
+
+void TestApplyBatchFailure() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "=A1*2");
+  auto version = sheet.GetVersion();
+
+  constexpr size_t kEdits = 12345;
+  std::vector<Sheet::Edit> edits;
+  for (size_t i = 0; i < kEdits; ++i) {
+    edits.push_back({Position{static_cast<int>(i), 2}, "1"});
+  }
+  // The error list fails to allocate once the batch has begun.
+  failing_allocation_size = kEdits * sizeof(std::exception_ptr);
+  try {
+    sheet.ApplyBatch(std::move(edits));
+    ASSERT(false)
+  } catch (const std::bad_alloc &) {
+  }
+  ASSERT_EQUAL(failing_allocation_size.load(), 0u)
+  // Every edit counts, the versions the callers number them with stay valid.
+  ASSERT_EQUAL(sheet.GetVersion(), version + kEdits)
+
+  // The batch has ended: an edit reaches the dependents right away.
+  sheet.SetCell("A1"_pos, "5");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 10)
+}
+
+void TestExprParserStatus() {
+  using expr_parser::Status;
+  auto status = [](std::string_view expr) {
+    FormulaAst ast;
+    return expr_parser::Parse(expr, ast);
+  };
+
+  ASSERT(status(" -(A1 + 2.5e-3) * .5 ").status == Status::kOk)
+  ASSERT(status("").status == Status::kUnexpectedEnd)
+  ASSERT(status("1 +").status == Status::kUnexpectedEnd)
+  ASSERT(status("1 + $").status == Status::kUnexpectedChar)
+  ASSERT(status("1.").status == Status::kBadNumber)
+  ASSERT(status("2e+").status == Status::kBadNumber)
+  ASSERT(status("A0").status == Status::kBadCell)
+  ASSERT(status("B01").status == Status::kBadCell)
+  ASSERT(status("A16385").status == Status::kBadCell)
+
+  auto result = status("(1 + 2");
+  ASSERT(result.status == Status::kUnbalancedParens)
+  ASSERT_EQUAL(result.offset, 0u)
+  result = status("1 + 2 3");
+  ASSERT(result.status == Status::kTrailingInput)
+  ASSERT_EQUAL(result.offset, 6u)
+}
+
+// The hand-written parser and the ANTLR one either both reject an expression
+// or build equal trees.
+void TestExprParserMatchesAntlr() {
+  auto check = [](const std::string &expr) {
+    std::optional<FormulaAst> expected;
+    try {
+      expected = ParseFormulaAstWithAntlr(expr);
+    } catch (const FormulaException &) {
+    }
+    FormulaAst ast;
+    auto result = expr_parser::Parse(expr, ast);
+    AssertEqual(result.status == expr_parser::Status::kOk,
+                expected.has_value(), expr);
+    if (!expected) return;
+
+    Assert(ast == *expected, expr);
+    for (const auto &node : ast.Nodes()) {
+      if (node.type == FormulaAst::NodeType::kLiteral) {
+        Assert(ast.GetLiteral(node.operand).value ==
+                   expected->GetLiteral(node.operand).value, expr);
+      }
+    }
+  };
+
+  for (std::string expr : {"1", "1+2*3", "(1+2)*3", "1-2-3", "8/4/2", "-1*2",
+                           "--+1", "-(1)", "A1*-B2", " 1 +\t2\n", "1e5",
+                           "1E-5", ".5", "0.25e+2", "1e400", "1e-400",
+                           "00012", "ZZ99", "XFD16384", "XFE1", "A16385",
+                           "AAAAAAA1", "B01", "A0", "a1", "A", "1.", "1e",
+                           "1E1E1", "1 2", "()", "(1", "1)", "+", "1++2",
+                           "1+-2", "A1B1", "1A1", "1 . 5", ""}) {
+    check(expr);
+  }
+
+  std::mt19937 gen(2024);
+  auto pick = [&gen](const auto &items) {
+    return items[std::uniform_int_distribution<size_t>(
+        0, items.size() - 1)(gen)];
+  };
+
+  // Random well-formed expressions, sometimes with invalid tokens.
+  const std::vector<std::string> operands = {
+      "0", "12", "1.5", ".25", "3e2", "4E-1", "1e400", "A1", "ZZ99",
+      "XFD16384", "B01", "A16385", "AAAA1"};
+  const std::vector<std::string> binary_ops = {"+", "-", "*", "/"};
+  const std::vector<std::string> spaces = {"", "", "", " ", "\t"};
+  std::function<std::string(int)> random_expr = [&](int depth) {
+    auto kind = std::uniform_int_distribution<int>(0, 3)(gen);
+    if (depth == 0 || kind == 0) {
+      return pick(spaces) + pick(operands) + pick(spaces);
+    }
+    if (kind == 1) {
+      return pick(std::vector<std::string>{"-", "+"}) + random_expr(depth - 1);
+    }
+    if (kind == 2) {
+      return "(" + random_expr(depth - 1) + ")";
+    }
+    return random_expr(depth - 1) + pick(binary_ops) + random_expr(depth - 1);
+  };
+  for (int i = 0; i < 2000; ++i) {
+    check(random_expr(5));
+  }
+
+  // Random character soup, mostly malformed.
+  const std::string chars = "0123456789.eE+-*/() AZ";
+  for (int i = 0; i < 2000; ++i) {
+    std::string expr(std::uniform_int_distribution<int>(1, 10)(gen), ' ');
+    for (auto &ch : expr) {
+      ch = pick(chars);
+    }
+    check(expr);
+  }
 }
 
 void TestFormulaReferencedCells() {
@@ -1054,6 +2895,36 @@ int main() {
   RUN_TEST(tr, TestFormulaArithmetic);
   RUN_TEST(tr, TestFormulaReferences);
   RUN_TEST(tr, TestFormulaExpressionFormatting);
+  RUN_TEST(tr, TestFormulaNestedParensFormatting);
+  RUN_TEST(tr, TestFormulaProgram);
+  RUN_TEST(tr, TestCellValue);
+  RUN_TEST(tr, TestFormulaPool);
+  RUN_TEST(tr, TestFormulaShiftKeepsShape);
+  RUN_TEST(tr, TestMovedFormulaSetAgain);
+  RUN_TEST(tr, TestRefIndex);
+  RUN_TEST(tr, TestStructuralEditTouchesCrossingFormulas);
+  RUN_TEST(tr, TestDependenciesAfterShifts);
+  RUN_TEST(tr, TestAxisMap);
+  RUN_TEST(tr, TestCellsStayInPlace);
+  RUN_TEST(tr, TestSparseStorage);
+  RUN_TEST(tr, TestCellArenaAllocations);
+  RUN_TEST(tr, TestRecalcDiamonds);
+  RUN_TEST(tr, TestLongChain);
+  RUN_TEST(tr, TestWorkerPool);
+  RUN_TEST(tr, TestParallelRecalc);
+  RUN_TEST(tr, TestSkewedRecalc);
+  RUN_TEST(tr, TestEarlyCutoff);
+  RUN_TEST(tr, TestIncrementalCycles);
+  RUN_TEST(tr, TestApplyBatch);
+  RUN_TEST(tr, TestTransactions);
+  RUN_TEST(tr, TestEpochInvalidation);
+  RUN_TEST(tr, TestAdaptivePolicy);
+  RUN_TEST(tr, TestConcurrentReads);
+  RUN_TEST(tr, TestSheetSnapshot);
+  RUN_TEST(tr, TestAsyncSheet);
+  RUN_TEST(tr, TestApplyBatchFailure);
+  RUN_TEST(tr, TestExprParserStatus);
+  RUN_TEST(tr, TestExprParserMatchesAntlr);
   RUN_TEST(tr, TestFormulaReferencedCells);
   RUN_TEST(tr, TestFormulaHandleInsertion);
   RUN_TEST(tr, TestInsertionOverflow);
@@ -7,26 +7,23 @@
 #include <vector>
 
 #include "common.h"
-#include "expr_shrink_listener.h"
-#include "referenced_cells_listener.h"
-#include "tree_shape_listener.h"
-#include "shifted_formula_listener.h"
-#include "error_handle_listener.h"
+#include "expr_parser.h"
 #include "utils.h"
 
 // -----Formula-----------------------------------------------------------------
 
-Formula::Formula(std::string expr) {
-  auto refs = ReadRefs(expr);
-  info_ = {
-      .expr = std::move(expr),
-      .referenced_cells = std::move(refs)};
+namespace {
+std::shared_ptr<const FormulaShape> MakeShape(FormulaAst ast) {
+  auto hash = ast.Hash();
+  return std::make_shared<const FormulaShape>(std::move(ast), hash);
+}
+}
+
+Formula::Formula(std::string expr) : shape_(MakeShape(ParseFormulaAst(expr))) {
 }
 
 Formula::Value Formula::Evaluate(const ISheet &sheet) const {
-  FormulaEvaluatorListener l(sheet);
-  listener_utils::Run(info_.expr, &l); // O(N), N - expr.size
-  auto result = l.GetResult();
+  auto result = shape_->program.Execute(sheet, {});
   if (std::holds_alternative<double>(result)) {
     auto value = std::get<double>(result);
     if (!std::isfinite(value)) {
@@ -40,75 +37,39 @@ Formula::Value Formula::Evaluate(const ISheet &sheet) const {
 }
 
 std::string Formula::GetExpression() const {
-  if (!shrank_expr_) {
-    shrank_expr_ = ShrinkExpr(info_.expr, ShrinkMode::kPrintErrors);
-  }
-  return *shrank_expr_;
-}
-
-std::string Formula::GetShrankExpr() const {
-  if (!shrank_expr_) {
-    shrank_expr_ = ShrinkExpr(info_.expr, ShrinkMode::kSimple);
-  }
-  return *shrank_expr_;
+  return shape_->ast.ToString({});
 }
 
 std::vector<Position> Formula::GetReferencedCells() const {
-  return info_.referenced_cells;
+  return shape_->ast.ReferencedCells({});
 }
 
 IFormula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
-  auto listener = CreateShiftedListener(info_.expr,
-                                        OpType::kAddition,
-                                        ShiftType::kRows,
-                                        before,
-                                        count);
-  auto [res, info] = listener.ReleaseShiftResult();
-  info_ = std::move(info);
-  ResetShrankExpr(res);
-  return res;
+  return Shift(OpType::kAddition, ShiftType::kRows, before, count);
 }
 
 IFormula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
-  auto listener = CreateShiftedListener(info_.expr,
-                                        OpType::kAddition,
-                                        ShiftType::kCols,
-                                        before,
-                                        count);
-  auto [res, info] = listener.ReleaseShiftResult();
-  info_ = std::move(info);
-  ResetShrankExpr(res);
-  return res;
+  return Shift(OpType::kAddition, ShiftType::kCols, before, count);
 }
 
 IFormula::HandlingResult Formula::HandleDeletedRows(int first, int count) {
-  auto listener = CreateShiftedListener(info_.expr,
-                                        OpType::kDeletion,
-                                        ShiftType::kRows,
-                                        first,
-                                        count);
-  auto [res, info] = listener.ReleaseShiftResult();
-  info_ = std::move(info);
-  ResetShrankExpr(res);
-  return res;
+  return Shift(OpType::kDeletion, ShiftType::kRows, first, count);
 }
 
 IFormula::HandlingResult Formula::HandleDeletedCols(int first, int count) {
-  auto listener = CreateShiftedListener(info_.expr,
-                                        OpType::kDeletion,
-                                        ShiftType::kCols,
-                                        first,
-                                        count);
-  auto [res, info] = listener.ReleaseShiftResult();
-  info_ = std::move(info);
-  ResetShrankExpr(res);
-  return res;
+  return Shift(OpType::kDeletion, ShiftType::kCols, first, count);
 }
 
-void Formula::ResetShrankExpr(IFormula::HandlingResult res) {
-  if (res != IFormula::HandlingResult::NothingChanged) {
-    shrank_expr_.reset();
+IFormula::HandlingResult Formula::Shift(OpType op_type, ShiftType shift_type,
+                                        int first_idx, int count) {
+  auto check = shape_->ast.CheckShift({}, {}, op_type, shift_type, first_idx,
+                                      count);
+  if (check.offsets_changed) {
+    auto ast = shape_->ast;
+    ast.Shift({}, {}, op_type, shift_type, first_idx, count);
+    shape_ = MakeShape(std::move(ast));
   }
+  return check.result;
 }
 
 std::unique_ptr<IFormula> ParseFormula(std::string expression) {
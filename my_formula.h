@@ -1,39 +1,41 @@
 #ifndef SPREADSHEET__MY_FORMULA_H_
 #define SPREADSHEET__MY_FORMULA_H_
 
-#include <optional>
-#include <set>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "cell_value.h"
 #include "formula.h"
-#include "tree_shape_listener.h"
+#include "formula_pool.h"
 #include "utils.h"
 
-#include "FormulaBaseListener.h"
-
+// Standalone formula. Its references are relative to A1 and it doesn't move
+// on rows/cols insertion or deletion. The cells of a sheet keep their
+// formulas as cell_data::Formula instead, anchored at the cell.
 class Formula : public IFormula {
  public:
   explicit Formula(std::string expr); // O(N), N - expr.size
-  Value Evaluate(const ISheet &sheet) const override; // O(N), N - expr.size
-  std::string GetExpression() const override; // O(N), N - expr.size
-  std::string GetShrankExpr() const; // O(N), N - expr.size
-  // O(1)
+
+  Value Evaluate(const ISheet &sheet) const override; // O(N), N - code.size
+  std::string GetExpression() const override; // O(N), N - ast.size
+  // O(NlogN), N - ast.size
   std::vector<Position> GetReferencedCells() const override;
-  // O(N), N - expr.size
+  // O(N), N - ast.size
   HandlingResult HandleInsertedRows(int before, int count) override;
-  // O(N), N - expr.size
+  // O(N), N - ast.size
   HandlingResult HandleInsertedCols(int before, int count) override;
-  // O(N), N - expr.size
+  // O(N), N - ast.size
   HandlingResult HandleDeletedRows(int first, int count) override;
-  // O(N), N - expr.size
+  // O(N), N - ast.size
   HandlingResult HandleDeletedCols(int first, int count) override;
 
  private:
-  void ResetShrankExpr(IFormula::HandlingResult res); // O(1)
+  // O(N), N - ast.size
+  HandlingResult Shift(OpType op_type, ShiftType shift_type,
+                       int first_idx, int count);
 
-  FormulaInfo info_;
-  mutable std::optional<std::string> shrank_expr_;
+  std::shared_ptr<const FormulaShape> shape_;
 };
 
 #endif // SPREADSHEET__MY_FORMULA_H_
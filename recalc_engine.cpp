@@ -0,0 +1,487 @@
+#include "recalc_engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "cell.h"
+#include "cell_data.h"
+
+void RecalcEngine::MarkDirty(Cell &cell) {
+  if (batch_) {
+    batch_sources_.push_back(&cell);
+    return;
+  }
+  if (invalidation_ != Invalidation::kEager) {
+    ++epoch_;
+    Stamp(cell);
+    return;
+  }
+  Invalidate(cell);
+  MarkSource(cell);
+}
+
+void RecalcEngine::Forget(Cell *cell) {
+  dirty_.erase(cell);
+  hot_.erase(cell);
+  edited_.erase(cell);
+  if (batch_) {
+    batch_sources_.erase(std::remove(batch_sources_.begin(),
+                                     batch_sources_.end(), cell),
+                         batch_sources_.end());
+  }
+}
+
+void RecalcEngine::BeginBatch() {
+  batch_ = true;
+}
+
+void RecalcEngine::EndBatch() {
+  batch_ = false;
+  if (invalidation_ != Invalidation::kEager) {
+    // The whole batch is one epoch.
+    ++epoch_;
+    for (auto cell : batch_sources_) {
+      Stamp(*cell);
+    }
+    batch_sources_.clear();
+    return;
+  }
+  dirty_.reserve(dirty_.size() + batch_sources_.size());
+  // The cones of the edited cells overlap, each cell is reset once.
+  for (auto cell : batch_sources_) {
+    Invalidate(*cell);
+  }
+  for (auto cell : batch_sources_) {
+    MarkSource(*cell);
+  }
+  batch_sources_.clear();
+}
+
+RecalcEngine::Batch::Batch(RecalcEngine &engine) : engine_(&engine) {
+  engine_->BeginBatch();
+}
+
+RecalcEngine::Batch::~Batch() {
+  if (!engine_) {
+    return;
+  }
+  try {
+    engine_->EndBatch();
+  } catch (...) {
+    // Unwinding already: the exception in flight is the one reported. The
+    // batch is left in any case, EndBatch clears it first.
+  }
+}
+
+void RecalcEngine::Batch::End() {
+  std::exchange(engine_, nullptr)->EndBatch();
+}
+
+void RecalcEngine::Invalidate(Cell &cell) {
+  auto &st = stack_;
+  st.push_back(&cell);
+  while (!st.empty()) {
+    auto current = st.back();
+    st.pop_back();
+    if (dirty_.count(current)) continue;
+    ++touched_;
+    current->ResetCache();
+    // Values without formulas are up to date right away, only the
+    // dependents of such a cell, the edited one, are dirty.
+    if (!current->IsCached()) {
+      dirty_.emplace(current, false);
+    }
+    for (auto dependent : current->GetReferencingCells()) {
+      st.push_back(dependent);
+    }
+  }
+}
+
+void RecalcEngine::MarkSource(Cell &cell) {
+  // Evaluated even if the references keep their values: the edited formula,
+  // or the formulas referring to the edited value.
+  if (auto it = dirty_.find(&cell); it != dirty_.end()) {
+    it->second = true;
+  } else {
+    for (auto dependent : cell.GetReferencingCells()) {
+      dirty_[dependent] = true;
+    }
+  }
+}
+
+void RecalcEngine::Stamp(Cell &cell) {
+  if (track_edits_) {
+    edited_.insert(&cell);
+  }
+  cell.ResetCache();
+  // A formula stamps itself once evaluated, if its value changes. Nobody
+  // reads the epoch of a cell without dependents.
+  if (cell.IsCached() && cell.links_) {
+    cell.links_->changed_at.store(epoch_, std::memory_order_relaxed);
+  }
+}
+
+bool RecalcEngine::IsStale(const Cell &cell) const {
+  return std::holds_alternative<cell_data::Formula>(cell.GetPayload()) &&
+      (cell.links_->verified_at.load(std::memory_order_acquire) != epoch_ ||
+       !cell.IsCached());
+}
+
+void RecalcEngine::Validate(const Cell &cell) {
+  if (invalidation_ == Invalidation::kEager || !IsStale(cell)) {
+    return;
+  }
+  Stats stats;
+  Validate(cell, stats);
+  RecordValidation(stats);
+}
+
+void RecalcEngine::ValidateEdited() {
+  track_edits_ = true;
+  if (invalidation_ == Invalidation::kEager) {
+    edited_.clear();
+    return;
+  }
+  // Only the dependents of the edited cells may have other values, each one
+  // is collected once.
+  std::unordered_set<const Cell *> cone;
+  std::vector<const Cell *> st(edited_.begin(), edited_.end());
+  edited_.clear();
+  while (!st.empty()) {
+    auto current = st.back();
+    st.pop_back();
+    if (!cone.insert(current).second) continue;
+    for (auto dependent : current->GetReferencingCells()) {
+      st.push_back(dependent);
+    }
+  }
+  Stats stats;
+  for (auto cell : cone) {
+    if (IsStale(*cell)) {
+      Validate(*cell, stats);
+    }
+  }
+  RecordValidation(stats);
+}
+
+void RecalcEngine::Validate(const Cell &cell, Stats &stats) {
+  // Post-order over the stale formulas of the cone, so the references of a
+  // formula are current when it is checked. An explicit stack: the cone may
+  // be a chain of any length. Formulas with whether their references are
+  // pushed, per thread for the concurrent readers.
+  thread_local std::vector<std::pair<const Cell *, bool>> st;
+  st.push_back({&cell, false});
+  while (!st.empty()) {
+    auto [current, expanded] = st.back();
+    if (!IsStale(*current)) {
+      st.pop_back();
+      continue;
+    }
+    if (!expanded) {
+      st.back().second = true;
+      for (auto ref : current->GetPrecedents()) {
+        if (IsStale(*ref)) {
+          st.push_back({ref, false});
+        }
+      }
+      continue;
+    }
+    // The references are current, so the reader holding the claim finishes
+    // without waiting for anybody.
+    auto &links = *current->links_;
+    auto verified_at = links.verified_at.load(std::memory_order_acquire);
+    if (verified_at == kClaimed ||
+        !links.verified_at.compare_exchange_strong(
+            verified_at, kClaimed, std::memory_order_acquire)) {
+      std::this_thread::yield();
+      continue;
+    }
+    st.pop_back();
+    ++stats.touched;
+
+    // An edited formula is outdated, the others keep their value unless a
+    // reference has changed since they were verified.
+    auto evaluate = !current->IsCached();
+    for (auto ref : current->GetPrecedents()) {
+      if (evaluate) break;
+      evaluate = ref->links_->changed_at.load(std::memory_order_relaxed) >
+          verified_at;
+    }
+    bool changed;
+    try {
+      changed = current->Refresh(evaluate);
+    } catch (...) {
+      // Hands the claim back, the formula stays stale for the next reader.
+      links.verified_at.store(verified_at, std::memory_order_release);
+      st.clear();
+      throw;
+    }
+    ++(evaluate ? stats.evaluated : stats.reused);
+    if (changed) {
+      links.changed_at.store(epoch_, std::memory_order_relaxed);
+    }
+    // Publishes the value and the stamp to the readers acquiring the epoch.
+    links.verified_at.store(epoch_, std::memory_order_release);
+  }
+}
+
+void RecalcEngine::RecordValidation(const Stats &stats) {
+  if (!concurrent_reads_) {
+    stats_ = stats;
+    policy_stats_.lazy_evaluated += stats.evaluated;
+  }
+}
+
+void RecalcEngine::NoteRead(const Cell &cell) {
+  if (invalidation_ != Invalidation::kAdaptive || !cell.links_ ||
+      !std::holds_alternative<cell_data::Formula>(cell.GetPayload())) {
+    // A formula without links refers to nothing and never changes.
+    return;
+  }
+  // Of the readers of an epoch, the one moving read_at to it counts the read.
+  auto &links = *cell.links_;
+  auto read_at = links.read_at.load(std::memory_order_relaxed);
+  if (read_at == epoch_ ||
+      !links.read_at.compare_exchange_strong(read_at, epoch_,
+                                             std::memory_order_relaxed)) {
+    return;
+  }
+  auto unread = static_cast<int64_t>(epoch_ - read_at) - 1;
+  auto heat = static_cast<int32_t>(
+      std::max<int64_t>(links.heat.load(std::memory_order_relaxed) -
+                            std::max<int64_t>(unread, 0),
+                        0) +
+      1);
+  links.heat.store(heat, std::memory_order_relaxed);
+  if (heat >= kHotHeat &&
+      !links.hot.exchange(true, std::memory_order_relaxed)) {
+    std::lock_guard lock(hot_mutex_);
+    hot_.insert(const_cast<Cell *>(&cell));
+    ++policy_stats_.promoted;
+  }
+}
+
+RecalcEngine::Policy RecalcEngine::GetPolicy(const Cell &cell) const {
+  return cell.links_ && cell.links_->hot.load(std::memory_order_relaxed)
+      ? Policy::kEager
+      : Policy::kLazy;
+}
+
+RecalcEngine::PolicyStats RecalcEngine::GetPolicyStats() const {
+  std::lock_guard lock(hot_mutex_);
+  auto stats = policy_stats_;
+  stats.hot = hot_.size();
+  stats.eager_evaluated = eager_evaluated_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void RecalcEngine::RefreshHot() {
+  WaitForRefresh();
+  if (invalidation_ != Invalidation::kAdaptive || hot_.empty()) {
+    return;
+  }
+  std::vector<Cell *> cold;
+  refreshed_.clear();
+  for (auto cell : hot_) {
+    auto read_at = cell->links_->read_at.load(std::memory_order_relaxed);
+    if (epoch_ - read_at > kColdEpochs ||
+        !std::holds_alternative<cell_data::Formula>(cell->GetPayload())) {
+      cold.push_back(cell);
+    } else if (IsStale(*cell)) {
+      refreshed_.push_back(cell);
+    }
+  }
+  for (auto cell : cold) {
+    Demote(*cell);
+  }
+  if (refreshed_.empty()) {
+    return;
+  }
+
+  if (pool_->Size() > 1) {
+    refreshing_ = pool_.get();
+  } else {
+    if (!refresh_pool_) {
+      refresh_pool_ = std::make_unique<WorkerPool>(2);
+    }
+    refreshing_ = refresh_pool_.get();
+  }
+  std::vector<size_t> tasks(refreshed_.size());
+  std::iota(tasks.begin(), tasks.end(), 0);
+  // The workers validate like concurrent readers: through the claims, with
+  // the stats of their own.
+  refreshing_->Start(tasks, [this](size_t task, WorkerPool::Worker &) {
+    Stats stats;
+    Validate(*refreshed_[task], stats);
+    eager_evaluated_.fetch_add(stats.evaluated, std::memory_order_relaxed);
+  });
+}
+
+void RecalcEngine::WaitForRefresh() {
+  if (!refreshing_) {
+    return;
+  }
+  try {
+    std::exchange(refreshing_, nullptr)->Wait();
+  } catch (...) {
+    // The formulas left stale are validated by their readers.
+  }
+}
+
+RecalcEngine::~RecalcEngine() {
+  WaitForRefresh();
+}
+
+void RecalcEngine::Demote(Cell &cell) {
+  hot_.erase(&cell);
+  cell.links_->hot.store(false, std::memory_order_relaxed);
+  cell.links_->heat.store(0, std::memory_order_relaxed);
+  ++policy_stats_.demoted;
+  cell.ReleaseLinks();
+}
+
+void RecalcEngine::SetInvalidation(Invalidation invalidation) {
+  WaitForRefresh();
+  // A new epoch: every formula is validated once before it's trusted.
+  ++epoch_;
+  invalidation_ = invalidation;
+  if (invalidation_ != Invalidation::kAdaptive) {
+    while (!hot_.empty()) {
+      Demote(**hot_.begin());
+    }
+  }
+}
+
+RecalcEngine::Invalidation RecalcEngine::GetInvalidation() const {
+  return invalidation_;
+}
+
+void RecalcEngine::SetConcurrentReads(bool enabled) {
+  concurrent_reads_ = enabled;
+}
+
+bool RecalcEngine::GetConcurrentReads() const {
+  return concurrent_reads_;
+}
+
+void RecalcEngine::Recalculate() {
+  if (running_ || dirty_.empty()) {
+    return;
+  }
+  running_ = true;
+  stats_ = {.touched = touched_};
+  touched_ = 0;
+
+  // Kahn's algorithm over the dirty subgraph: a formula is ready once all its
+  // dirty references are evaluated. The thread finishing the last reference
+  // pushes it, there is no barrier between the steps.
+  std::vector<Node> nodes(dirty_.size());
+  std::unordered_map<Cell *, size_t> index;
+  index.reserve(nodes.size());
+  for (auto [cell, source] : dirty_) {
+    auto i = index.size();
+    nodes[i].cell = cell;
+    nodes[i].source = source;
+    index.emplace(cell, i);
+  }
+  std::vector<size_t> roots;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    size_t count = 0;
+    for (auto ref : nodes[i].cell->GetPrecedents()) {
+      count += dirty_.count(ref);
+    }
+    nodes[i].pending.store(count, std::memory_order_relaxed);
+    if (count == 0) {
+      roots.push_back(i);
+    }
+  }
+
+  // Every formula writes only its own cache and reads the caches of the
+  // formulas finished before it was pushed, so the result doesn't depend on
+  // the schedule. The index and the graph are only read meanwhile.
+  std::vector<WorkerStats> worker_stats(pool_->Size());
+  auto refresh = [&](size_t task, WorkerPool::Worker &worker) {
+    auto &node = nodes[task];
+    auto &local = worker_stats[worker.Index()];
+    // The value of a formula whose references kept their values stays.
+    auto evaluate =
+        node.source || node.inputs_changed.load(std::memory_order_relaxed);
+    auto changed = node.cell->Refresh(evaluate);
+    ++(evaluate ? local.evaluated : local.reused);
+    auto depth = node.depth.load(std::memory_order_relaxed) + 1;
+    local.levels = std::max(local.levels, depth);
+    for (auto dependent : node.cell->GetReferencingCells()) {
+      auto it = index.find(dependent);
+      if (it == index.end()) continue;
+      auto &next = nodes[it->second];
+      if (changed) {
+        next.inputs_changed.store(true, std::memory_order_relaxed);
+      }
+      auto next_depth = next.depth.load(std::memory_order_relaxed);
+      while (next_depth < depth &&
+             !next.depth.compare_exchange_weak(next_depth, depth,
+                                               std::memory_order_relaxed)) {
+      }
+      if (next.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        worker.Push(it->second);
+      }
+    }
+  };
+  try {
+    if (nodes.size() < kMinParallelWork) {
+      pool_->RunOnCaller(roots, refresh);
+    } else {
+      pool_->Run(roots, refresh);
+    }
+  } catch (...) {
+    // Everything stays dirty for the next run, evaluated in any case: which
+    // references changed is lost.
+    for (auto &entry : dirty_) {
+      entry.second = true;
+    }
+    running_ = false;
+    throw;
+  }
+
+  for (const auto &local : worker_stats) {
+    stats_.evaluated += local.evaluated;
+    stats_.reused += local.reused;
+    stats_.levels = std::max(stats_.levels, local.levels);
+  }
+  dirty_.clear();
+  running_ = false;
+}
+
+void RecalcEngine::SetThreads(size_t threads) {
+  WaitForRefresh();
+  threads = std::max<size_t>(threads, 1);
+  if (threads == GetThreads()) {
+    return;
+  }
+  pool_ = std::make_unique<WorkerPool>(threads);
+}
+
+size_t RecalcEngine::GetThreads() const {
+  return pool_->Size();
+}
+
+bool RecalcEngine::IsRecalculating() const {
+  return running_;
+}
+
+size_t RecalcEngine::DirtyCount() const {
+  return dirty_.size();
+}
+
+RecalcEngine::Stats RecalcEngine::GetStats() const {
+  return stats_;
+}
@@ -0,0 +1,254 @@
+#ifndef SPREADSHEET_RECALC_ENGINE_H_
+#define SPREADSHEET_RECALC_ENGINE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "worker_pool.h"
+
+class Cell;
+
+// Recalculation of the formulas after edits. An edit marks the changed cell
+// and everything depending on it dirty, each cell once; Recalculate then
+// evaluates the dirty formulas in topological order, so every formula reads
+// cached values of its references and is evaluated once per edit. A dirty
+// formula none of whose references changed its value keeps the previous
+// value without evaluation (early cutoff), so an edit that doesn't change the
+// results stops at the first formulas.
+// A formula is ready once its dirty references are evaluated; the ready ones
+// run on a work-stealing WorkerPool, so a long chain doesn't hold up the
+// independent formulas next to it. Everything the formulas read must stay
+// unchanged meanwhile.
+// With Invalidation::kEpochs an edit touches no dependents at all, see
+// Validate; kAdaptive keeps only the formulas read after nearly every edit
+// current eagerly.
+class RecalcEngine {
+ public:
+  ~RecalcEngine(); // Same as WaitForRefresh
+  // How an edit reaches the formulas depending on the edited cell.
+  enum class Invalidation {
+    // The dependents are marked dirty right away and evaluated together by
+    // Recalculate. Reads are O(1).
+    kEager,
+    // The edited cell only gets a new epoch, O(1); a read validates the
+    // formula against the epochs of its precedents. Formulas not read after
+    // an edit cost nothing, which suits a cell referenced by millions of
+    // formulas only a few of which are ever read.
+    kEpochs,
+    // kEpochs for most formulas, while the formulas read after nearly every
+    // edit become hot and are validated on the workers once each edit is
+    // published, see RefreshHot, so their readers find them current. A hot
+    // formula goes back to lazy once it's not read for kColdEpochs edits.
+    kAdaptive,
+  };
+
+  // How a formula is kept up to date with kAdaptive.
+  enum class Policy {
+    kLazy, // Validated when read
+    kEager, // Validated after every edit
+  };
+
+  struct PolicyStats {
+    size_t hot = 0; // Formulas with kEager now
+    size_t promoted = 0; // Switches to kEager so far
+    size_t demoted = 0; // Switches back to kLazy so far
+    size_t eager_evaluated = 0; // Evaluations after edits
+    size_t lazy_evaluated = 0; // Evaluations on reads
+  };
+
+  struct Stats {
+    size_t touched = 0; // Cells marked dirty
+    size_t evaluated = 0; // Formulas evaluated
+    size_t reused = 0; // Dirty formulas kept, their references unchanged
+    size_t levels = 0; // Formulas on the longest dirty dependency chain
+  };
+
+  // Resets the caches of cell and its dependents, skipping the formulas
+  // dirty already. O(N + E), N - newly dirty cells, E - their dependency edges
+  // With kEpochs stamps the cell with a new epoch instead. O(1)
+  void MarkDirty(Cell &cell);
+  // The cell is about to be destroyed. O(1), in a batch O(N), N - cells edited
+  void Forget(Cell *cell);
+
+  // Until EndBatch, MarkDirty only records the edited cells. O(1)
+  void BeginBatch();
+  // Marks the cells edited since BeginBatch and their dependents dirty in one
+  // pass, each cell once. O(N + E), N - newly dirty cells, E - their edges
+  // With kEpochs and kAdaptive the batch is one epoch.
+  void EndBatch();
+
+  // BeginBatch for a scope. End calls EndBatch, the destructor does if End
+  // wasn't called, i.e. when an exception leaves the scope, so the engine
+  // doesn't go on only recording the later edits.
+  class Batch {
+   public:
+    explicit Batch(RecalcEngine &engine); // O(1)
+    ~Batch(); // Same as End unless ended
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+
+    void End(); // Same as EndBatch
+
+   private:
+    // Null once ended
+    RecalcEngine *engine_;
+  };
+
+  // Evaluates the dirty formulas, references first. Does nothing if called
+  // while running. If an evaluation throws (e.g. std::bad_alloc), every
+  // formula stays dirty and the exception is rethrown. O(N + E + V), N - dirty
+  // cells, E - their edges, V - evaluation cost
+  void Recalculate();
+  bool IsRecalculating() const; // O(1)
+
+  // Makes the value of cell current with kEpochs: the formulas of its
+  // precedent cone not verified in this epoch are checked references first,
+  // each once per epoch, and evaluated only if a reference changed its value
+  // since the formula was verified or the formula itself was edited. Runs on
+  // the calling thread. Does nothing with kEager.
+  // Readers may validate overlapping cones at once: a reader claims a formula
+  // whose references are current through its verified_at word, the others
+  // wait for the claimed one to be published instead of evaluating it again.
+  // O(N + E + V), N - formulas not verified yet, E - their edges,
+  // V - evaluation cost
+  void Validate(const Cell &cell);
+  // From the first call on, the lazy modes record the edited cells. Validates
+  // the formulas depending on the cells edited since the previous call, the
+  // others keep their values. Does nothing with kEager.
+  // O(N + E + V), N - formulas depending on the edits, E - their edges,
+  // V - evaluation cost
+  void ValidateEdited();
+
+  // Switching from kEager requires no dirty cells, switching to kEager every
+  // formula validated; Sheet::SetInvalidation takes care of both.
+  // O(1), leaving kAdaptive O(H), H - hot formulas
+  void SetInvalidation(Invalidation invalidation);
+  Invalidation GetInvalidation() const; // O(1)
+
+  // Counts a read of the value of cell through ICell::GetValue towards its
+  // policy with kAdaptive: the heat of a formula grows by one for an epoch
+  // it's read in and cools by one for every epoch passing unread, the
+  // formula is hot from kHotHeat on. Reads within an epoch count once, also
+  // on concurrent readers. O(1)
+  void NoteRead(const Cell &cell);
+  Policy GetPolicy(const Cell &cell) const; // O(1)
+  PolicyStats GetPolicyStats() const; // O(1)
+
+  // With kAdaptive, starts validating the hot formulas on the workers and
+  // demotes the ones not read lately. The sheet calls it once an edit is
+  // published, readers meanwhile validate what they read as with kEpochs,
+  // waiting only for the formulas a worker has claimed. O(H), H - hot formulas
+  void RefreshHot();
+  // Returns when the formulas RefreshHot started on are validated. Needed
+  // before the next edit, the sheet calls it first. A refresh failing (e.g.
+  // std::bad_alloc) leaves the formulas it didn't validate to the readers.
+  // O(1) if they are, else O(V), V - validation cost left
+  void WaitForRefresh();
+
+  // Heat of a formula read after every edit for this many edits
+  static constexpr int32_t kHotHeat = 3;
+  static constexpr uint64_t kColdEpochs = 4;
+
+  // Threads evaluating the formulas, the calling one included; 1 evaluates on
+  // the calling thread only. O(N), N - threads
+  void SetThreads(size_t threads);
+  size_t GetThreads() const; // O(1)
+  size_t DirtyCount() const; // O(1)
+
+  // Of the last Recalculate or ValidateEdited, or of the last Validate doing
+  // any work outside concurrent reads. O(1)
+  Stats GetStats() const;
+
+  // Whether the readers of the values may run on several threads at once,
+  // between the edits: reads keep the engine's bookkeeping to the per-cell
+  // atomics then and record no stats. O(1)
+  void SetConcurrentReads(bool enabled);
+  bool GetConcurrentReads() const; // O(1)
+
+ private:
+  // A formula of the dirty subgraph.
+  struct Node {
+    Cell *cell = nullptr;
+    // Evaluated even if the references keep their values
+    bool source = false;
+    // Set by the references whose value has changed
+    std::atomic<bool> inputs_changed{false};
+    // Dirty references not evaluated yet, the last one to finish makes the
+    // formula ready.
+    std::atomic<size_t> pending{0};
+    // Formulas on the longest chain ending here, the formula excluded
+    std::atomic<size_t> depth{0};
+  };
+
+  // Per thread, no sharing while running.
+  struct alignas(64) WorkerStats {
+    size_t evaluated = 0;
+    size_t reused = 0;
+    size_t levels = 0;
+  };
+
+  // Resets the caches of cell and its dependents. O(N + E), N - newly dirty
+  // cells, E - their dependency edges
+  void Invalidate(Cell &cell);
+  // Makes the edited cell, or the formulas referring to it if it holds a
+  // value, evaluated in any case. O(N), N - referring formulas
+  void MarkSource(Cell &cell);
+  // Records the edit of cell in the current epoch: a value changes in it, a
+  // formula is evaluated on the next validation. O(1)
+  void Stamp(Cell &cell);
+  // Whether a formula needs validation in the current epoch. O(1)
+  bool IsStale(const Cell &cell) const;
+  // Validate adding to stats. Same cost as Validate
+  void Validate(const Cell &cell, Stats &stats);
+  // Keeps the stats of a validation, unless the reads are concurrent. O(1)
+  void RecordValidation(const Stats &stats);
+  void Demote(Cell &cell); // O(1)
+
+  // verified_at of a formula being validated by a concurrent reader
+  static constexpr uint64_t kClaimed = UINT64_MAX;
+  // Fewer formulas aren't worth waking the workers up.
+  static constexpr size_t kMinParallelWork = 512;
+
+  // Formulas waiting for evaluation, mapped to whether they are sources:
+  // edited themselves or referring to an edited value.
+  std::unordered_map<Cell *, bool> dirty_;
+  // Reused by Invalidate, an edit of a plain value doesn't allocate.
+  std::vector<Cell *> stack_;
+  // Edited cells waiting for EndBatch
+  std::vector<Cell *> batch_sources_;
+  // Cells edited with the lazy modes since the last ValidateEdited
+  std::unordered_set<Cell *> edited_;
+  bool track_edits_ = false;
+  bool batch_ = false;
+  size_t touched_ = 0;
+  Stats stats_;
+  bool running_ = false;
+  std::unique_ptr<WorkerPool> pool_ = std::make_unique<WorkerPool>(1);
+
+  Invalidation invalidation_ = Invalidation::kEager;
+  // Counts the edits made with kEpochs
+  uint64_t epoch_ = 0;
+  // Formulas with Policy::kEager
+  // Written by concurrent readers promoting a formula, under hot_mutex_
+  std::unordered_set<Cell *> hot_;
+  PolicyStats policy_stats_;
+  mutable std::mutex hot_mutex_;
+  // Counted by the workers of RefreshHot
+  std::atomic<size_t> eager_evaluated_{0};
+  // Formulas RefreshHot validates, indexed by the tasks
+  std::vector<Cell *> refreshed_;
+  // Runs RefreshHot if pool_ has no workers, started on the first refresh
+  std::unique_ptr<WorkerPool> refresh_pool_;
+  // Pool running RefreshHot until WaitForRefresh
+  WorkerPool *refreshing_ = nullptr;
+  bool concurrent_reads_ = false;
+};
+
+#endif // SPREADSHEET_RECALC_ENGINE_H_
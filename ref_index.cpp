@@ -0,0 +1,116 @@
+#include "ref_index.h"
+
+#include <algorithm>
+#include <vector>
+
+RefIndex::RefIndex(const AxisMap &rows, const AxisMap &cols)
+    : rows_(rows), cols_(cols) {}
+
+void RefIndex::Add(Cell *cell, Position pos, const std::vector<Position> &refs) {
+  Remove(cell);
+  Position lo = pos;
+  Position hi = pos;
+  bool referencing = false;
+  for (auto ref : refs) {
+    if (!ref.IsValid()) continue;
+    referencing = true;
+    lo = {std::min(lo.row, ref.row), std::min(lo.col, ref.col)};
+    hi = {std::max(hi.row, ref.row), std::max(hi.col, ref.col)};
+  }
+  if (!referencing) {
+    return;
+  }
+
+  auto &spans = spans_[cell];
+  spans[0] = {rows_.ToPhysical(lo.row), hi.row - lo.row};
+  spans[1] = {cols_.ToPhysical(lo.col), hi.col - lo.col};
+  for (int axis = 0; axis < 2; ++axis) {
+    Insert(axis, cell, spans[axis]);
+  }
+}
+
+void RefIndex::Remove(Cell *cell) {
+  auto it = spans_.find(cell);
+  if (it == spans_.end()) {
+    return;
+  }
+  for (int axis = 0; axis < 2; ++axis) {
+    Erase(axis, it->second[axis]);
+  }
+  spans_.erase(it);
+}
+
+std::vector<Cell *> RefIndex::Spanning(ShiftType type, int first,
+                                       int last) const {
+  int axis = type == ShiftType::kRows ? 0 : 1;
+  const auto &map = axis == 0 ? rows_ : cols_;
+  std::vector<Cell *> cells;
+  auto collect = [&](const Bucket &bucket, int start) {
+    for (auto [cell, length] : bucket) {
+      if (start + length >= first) {
+        cells.push_back(cell);
+      }
+    }
+  };
+
+  for (int k = 0; k < kClasses; ++k) {
+    const auto &buckets = buckets_[axis][k];
+    if (buckets.empty()) continue;
+    // A span of this class starting before from can't reach first.
+    int from = std::max(first - (2 << k) + 1, 0);
+    int to = std::min(last, map.Size());
+    if (from >= to) continue;
+    // Walks whichever is shorter: the starts in range or the kept ones.
+    if (static_cast<size_t>(to - from) <= buckets.size()) {
+      for (int start = from; start < to; ++start) {
+        auto it = buckets.find(map.ToPhysical(start));
+        if (it != buckets.end()) {
+          collect(it->second, start);
+        }
+      }
+    } else {
+      for (const auto &[physical, bucket] : buckets) {
+        int start = map.ToLogical(physical);
+        if (start >= from && start < to) {
+          collect(bucket, start);
+        }
+      }
+    }
+  }
+  return cells;
+}
+
+int RefIndex::ClassOf(int length) {
+  int k = 0;
+  while (length >>= 1) {
+    ++k;
+  }
+  return k;
+}
+
+void RefIndex::Insert(int axis, Cell *cell, Span &span) {
+  if (span.length == 0) {
+    return;
+  }
+  auto &bucket = buckets_[axis][ClassOf(span.length)][span.start];
+  span.slot = bucket.size();
+  bucket.emplace_back(cell, span.length);
+}
+
+void RefIndex::Erase(int axis, const Span &span) {
+  if (span.length == 0) {
+    return;
+  }
+  auto &buckets = buckets_[axis][ClassOf(span.length)];
+  auto it = buckets.find(span.start);
+  auto &bucket = it->second;
+  // The last cell of the bucket takes the slot.
+  if (span.slot + 1 != bucket.size()) {
+    bucket[span.slot] = bucket.back();
+    spans_.find(bucket.back().first)->second[axis].slot = span.slot;
+  }
+  bucket.pop_back();
+  if (bucket.empty()) {
+    buckets.erase(it);
+  }
+}
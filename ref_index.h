@@ -0,0 +1,75 @@
+#ifndef SPREADSHEET_REF_INDEX_H_
+#define SPREADSHEET_REF_INDEX_H_
+
+#include <array>
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "axis_map.h"
+#include "common.h"
+#include "utils.h"
+
+class Cell;
+
+// Span index of the formula cells. On each axis a formula spans the rows
+// (cols) from the lowest to the highest of its own position and its
+// references. A structural edit changes the offsets of a formula only if
+// the edit point falls inside its span, so structural operations look up
+// these formulas instead of every one after the edit point.
+// Spans are kept by the physical id of their first row (col) and their
+// length. Both stay the same for a formula the edit doesn't cross, so only
+// the formulas found are indexed again.
+class RefIndex {
+ public:
+  // rows/cols map the logical indexes of the sheet to physical ids
+  RefIndex(const AxisMap &rows, const AxisMap &cols); // O(1)
+
+  // Indexes cell at pos with refs, the positions it references; invalid ones
+  // are ignored, a cell without references isn't indexed. Replaces what the
+  // cell was indexed with. O(N), N - refs.size
+  void Add(Cell *cell, Position pos, const std::vector<Position> &refs);
+  void Remove(Cell *cell); // O(1) on average
+
+  // Cells whose span on the axis of type starts before last and ends at
+  // first or later: the formulas which an insertion before first (last ==
+  // first) or a deletion of [first, last) renames. Lists every cell once.
+  // O(M + sum(min(2^k + L, B_k))), M - cells found, L - last - first, B_k -
+  // span starts of length class k
+  std::vector<Cell *> Spanning(ShiftType type, int first, int last) const;
+
+ private:
+  // Length classes of the spans up to kMaxRows - 1 long
+  static constexpr int kClasses = 14;
+  static_assert((1 << kClasses) >= Position::kMaxRows &&
+                (1 << kClasses) >= Position::kMaxCols);
+
+  // Physical id of the first row (col) and length of a span, and where the
+  // cell is in its bucket
+  struct Span {
+    int start = 0;
+    int length = 0;
+    size_t slot = 0;
+  };
+
+  // Cells with their span length, by span start
+  using Bucket = std::vector<std::pair<Cell *, int>>;
+  // Length class k holds lengths in [2^k, 2^(k+1)). Spans of length 0 don't
+  // cross any edit point and aren't kept.
+  using Buckets = std::array<std::unordered_map<int, Bucket>, kClasses>;
+
+  static int ClassOf(int length); // O(logN), N - length
+
+  // Both O(1) on average
+  void Insert(int axis, Cell *cell, Span &span);
+  void Erase(int axis, const Span &span);
+
+  const AxisMap &rows_;
+  const AxisMap &cols_;
+  std::array<Buckets, 2> buckets_; // Rows, then cols
+  // Spans each cell is indexed with, rows then cols
+  std::unordered_map<Cell *, std::array<Span, 2>> spans_;
+};
+
+#endif // SPREADSHEET_REF_INDEX_H_
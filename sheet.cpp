@@ -1,158 +1,252 @@
 #include "sheet.h"
 
 #include <algorithm>
-#include <iterator>
+#include <exception>
 #include <memory>
 #include <ostream>
 #include <stack>
 #include <stdexcept>
 #include <string>
 #include <unordered_set>
+#include <variant>
 #include <vector>
 
 #include "cell.h"
 #include "common.h"
 #include "utils.h"
 
-void Sheet::ForceInitializeCell(Position pos) {
+Sheet::~Sheet() {
+  // The refresh reads the cells, which go first.
+  BeginEdit();
+}
+
+Cell &Sheet::ForceInitializeCell(Position pos) {
   if (!pos.IsValid())
     throw InvalidPositionException{"Invalid position"};
+  BeginEdit();
 
-  if (IsValid(pos) && cells_[pos.row][pos.col]) {
-    return;
+  auto physical = ToPhysical(pos);
+  if (auto cell = cells_.Get(physical)) {
+    return *cell;
   }
 
-  auto cell = std::make_unique<Cell>(*this, pos); // O(1)
-  ExpandToFit(pos);
-
-  if (!IsValid(pos)) {
-    throw std::runtime_error("Sheet::SetCell : sheet must have been expanded");
-  }
-  empty_cells_.insert(cell.get());
-  size_monitor_.Add(pos);
-  cells_[pos.row][pos.col] = std::move(cell);
+  RecordCell(pos);
+  auto &cell = cells_.Put(physical, arena_.Make<Cell>(*this, physical));
+  empty_cells_.insert(&cell);
+  size_monitor_.Add(physical);
+  return cell;
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
+  BeginEdit();
+  StoreCell(pos, std::move(text));
+  FinishEdit();
+}
+
+void Sheet::StoreCell(Position pos, std::string text) {
   if (!pos.IsValid())
     throw InvalidPositionException{"Invalid position"};
-
-  if (IsValid(pos)) {
-    if (auto &cell = cells_[pos.row][pos.col]) {
-      auto old_state = cell->State();
-      cell->Set(std::move(text));
-      auto new_state = cell->State();
-      if (old_state == CellState::kEmpty && new_state != CellState::kEmpty) {
-        empty_cells_.erase(cell.get());
-        printable_size_monitor_.Add(pos);
-      }
-      if (old_state != CellState::kEmpty && new_state == CellState::kEmpty &&
-          !cell->GetReferencingCells().empty()) {
-        empty_cells_.insert(cell.get());
-        printable_size_monitor_.Remove(pos);
-      }
-      return;
+  RecordCell(pos);
+
+  auto physical = ToPhysical(pos);
+  if (auto cell = cells_.Get(physical)) {
+    auto old_state = cell->State();
+    cell->Set(std::move(text));
+    auto new_state = cell->State();
+    if (old_state == CellState::kEmpty && new_state != CellState::kEmpty) {
+      empty_cells_.erase(cell);
+      printable_size_monitor_.Add(physical);
     }
+    if (old_state != CellState::kEmpty && new_state == CellState::kEmpty &&
+        !cell->GetReferencingCells().empty()) {
+      empty_cells_.insert(cell);
+      printable_size_monitor_.Remove(physical);
+    }
+    return;
   }
 
   if (text == "") {
     return;
   }
 
-  ExpandToFit(pos);
-  if (!IsValid(pos)) {
-    throw std::runtime_error("Sheet::SetCell : sheet must have been expanded");
+  // Stored before Set, which looks the cell up for circular dependencies.
+  auto &cell = cells_.Put(physical, arena_.Make<Cell>(*this, physical));
+  try {
+    cell.Set(std::move(text));
+  } catch (...) {
+    // Kept as an empty cell.
+    empty_cells_.insert(&cell);
+    size_monitor_.Add(physical);
+    throw;
   }
+  printable_size_monitor_.Add(physical);
+  size_monitor_.Add(physical);
+}
 
-  auto &cell = cells_[pos.row][pos.col];
-  if (!cell) {
-    cell = std::make_unique<Cell>(*this, pos);
+std::vector<std::exception_ptr> Sheet::ApplyBatch(std::vector<Edit> edits) {
+  BeginEdit();
+  std::vector<std::exception_ptr> errors;
+  try {
+    RecalcEngine::Batch batch(recalc_);
+    errors.resize(edits.size());
+    for (size_t i = 0; i < edits.size(); ++i) {
+      try {
+        StoreCell(edits[i].pos, std::move(edits[i].text));
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+    batch.End();
+  } catch (...) {
+    // The edits count in the version even so, the callers number them.
+    FinishEdit(edits.size());
+    throw;
   }
-  cell->Set(std::move(text));
-  printable_size_monitor_.Add(pos);
-  size_monitor_.Add(pos);
-  cells_[pos.row][pos.col] = std::move(cell);
+  FinishEdit(edits.size());
+  return errors;
 }
 
 const ICell *Sheet::GetCell(Position pos) const {
   if (!pos.IsValid())
     throw InvalidPositionException{"Invalid position"};
 
-  if (!IsValid(pos)) {
-    return nullptr;
-  }
-  return cells_[pos.row][pos.col].get();
+  return cells_.Get(ToPhysical(pos));
 }
 
 ICell *Sheet::GetCell(Position pos) {
   if (!pos.IsValid())
     throw InvalidPositionException{"Invalid position"};
 
-  if (!IsValid(pos)) {
-    return nullptr;
+  return cells_.Get(ToPhysical(pos));
+}
+
+Cell *Sheet::FindCell(Position pos) {
+  return cells_.Get(ToPhysical(pos));
+}
+
+const Cell *Sheet::FindCell(Position pos) const {
+  return cells_.Get(ToPhysical(pos));
+}
+
+CellValue Sheet::GetOperand(Position pos) const {
+  if (!pos.IsValid()) {
+    return CellValue::Error(FormulaError::Category::Ref);
   }
-  return cells_[pos.row][pos.col].get();
+  auto cell = FindCell(pos);
+  return cell ? cell->GetOperand() : CellValue{};
 }
 
 void Sheet::ClearCell(Position pos) {
   if (!pos.IsValid())
     throw InvalidPositionException{"Invalid position"};
+  BeginEdit();
 
-  if (!IsValid(pos)) {
+  auto physical = ToPhysical(pos);
+  auto cell = cells_.Get(physical);
+  if (!cell) {
     return;
   }
-  printable_size_monitor_.Remove(pos);
-  size_monitor_.Remove(pos);
-  cells_[pos.row][pos.col].reset();
+  RecordCell(pos);
+  if (!cell->GetReferencingCells().empty()) {
+    // Stays as an empty cell, other formulas refer to it.
+    StoreCell(pos, "");
+  } else {
+    cell->Detach();
+    EraseCell(*cell);
+  }
+  FinishEdit();
+}
+
+void Sheet::BeginTransaction() {
+  if (journal_.IsOpen()) {
+    throw std::runtime_error("Sheet::BeginTransaction : a transaction is "
+                             "open already");
+  }
+  journal_.Open();
+}
+
+void Sheet::Commit() {
+  if (!journal_.IsOpen()) {
+    throw std::runtime_error("Sheet::Commit : no transaction is open");
+  }
+  journal_.Close();
+}
+
+void Sheet::Rollback() {
+  if (!journal_.IsOpen()) {
+    throw std::runtime_error("Sheet::Rollback : no transaction is open");
+  }
+  BeginEdit();
+  auto entries = journal_.Close();
+
+  // Cells created by the transaction may be referenced until the older
+  // entries are undone, they are erased before the geometry changes again.
+  std::unordered_set<Position, PositionHash> absent;
+  RecalcEngine::Batch batch(recalc_);
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    if (auto image = std::get_if<UndoJournal::CellImage>(&*it)) {
+      RestoreCell(*image, absent);
+      continue;
+    }
+    EraseAbsent(absent);
+    auto &edit = std::get<UndoJournal::AxisEdit>(*it);
+    if (edit.op == OpType::kAddition) {
+      DeleteItems(edit.type, edit.first, edit.count);
+    } else {
+      InsertItems(edit.type, edit.first, edit.count);
+    }
+  }
+  EraseAbsent(absent);
+  batch.End();
+  FinishEdit();
+}
+
+bool Sheet::InTransaction() const {
+  return journal_.IsOpen();
 }
 
 void Sheet::InsertRows(int before, int count) {
+  BeginEdit();
   before = std::min(16384, std::max(before, 0));
   count = std::min(16384, std::max(count, 0));
   ValidateExpand(before, count, TableItem::kRows);
-  UpdateCellsAfterRowAddition(before, count);
-  printable_size_monitor_.UpdateAfterRowAddition(before, count);
-  size_monitor_.UpdateAfterRowAddition(before, count);
-  ExpandTable(before, count, TableItem::kRows);
+  RecalcEngine::Batch batch(recalc_);
+  InsertItems(ShiftType::kRows, before, count);
+  batch.End();
+  FinishEdit();
 }
 void Sheet::InsertCols(int before, int count) {
+  BeginEdit();
   before = std::min(16384, std::max(before, 0));
   count = std::min(16384, std::max(count, 0));
   ValidateExpand(before, count, TableItem::kCols);
-  UpdateCellsAfterColAddition(before, count);
-  printable_size_monitor_.UpdateAfterColAddition(before, count);
-  size_monitor_.UpdateAfterColAddition(before, count);
-  ExpandTable(before, count, TableItem::kCols);
+  RecalcEngine::Batch batch(recalc_);
+  InsertItems(ShiftType::kCols, before, count);
+  batch.End();
+  FinishEdit();
 }
 
 void Sheet::DeleteRows(int first, int count) {
+  BeginEdit();
   first = std::min(16384, std::max(first, 0));
   count = std::min(16384 - first, std::max(count, 0));
   if (count == 0) return;
-  InvalidateCells(ShiftType::kRows, first, count);
-  UpdateCellsAfterRowDeletion(first, count);
+  RecalcEngine::Batch batch(recalc_);
+  DeleteItems(ShiftType::kRows, first, count);
   UpdateEmptyCells();
-  printable_size_monitor_.UpdateAfterRowDeletion(first, count);
-  size_monitor_.UpdateAfterRowDeletion(first, count);
-  cells_.erase(
-      begin(cells_) + std::min(static_cast<int>(cells_.size()), first),
-      begin(cells_) + std::min(static_cast<int>(cells_.size()), first + count));
+  batch.End();
+  FinishEdit();
 }
 void Sheet::DeleteCols(int first, int count) {
+  BeginEdit();
   first = std::min(16384, std::max(first, 0));
   count = std::min(16384 - first, std::max(count, 0));
   if (count == 0) return;
-  InvalidateCells(ShiftType::kCols, first, count);
-  UpdateCellsAfterColDeletion(first, count);
+  RecalcEngine::Batch batch(recalc_);
+  DeleteItems(ShiftType::kCols, first, count);
   UpdateEmptyCells();
-  printable_size_monitor_.UpdateAfterColDeletion(first, count);
-  size_monitor_.UpdateAfterColDeletion(first, count);
-  for (auto &row : cells_) {
-    row.erase(
-        begin(row) + std::min(static_cast<int>(row.size()), first),
-        begin(row) +
-            std::min(static_cast<int>(row.size()), first + count));
-  }
+  batch.End();
+  FinishEdit();
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -166,15 +260,183 @@ void Sheet::PrintTexts(std::ostream &out) const {
   PrintCells(out, PrintSettings::kTexts);
 }
 
+FormulaPool &Sheet::GetFormulaPool() {
+  return formula_pool_;
+}
+const FormulaPool &Sheet::GetFormulaPool() const {
+  return formula_pool_;
+}
+
+RefIndex &Sheet::GetRefIndex() {
+  return ref_index_;
+}
+
+const CellStorage &Sheet::GetCellStorage() const {
+  return cells_;
+}
+
+RecalcEngine &Sheet::GetRecalcEngine() {
+  return recalc_;
+}
+
+TopoOrder &Sheet::GetTopoOrder() {
+  return topo_order_;
+}
+
+void Sheet::Recalculate() {
+  BeginEdit();
+  BuildTables();
+  recalc_.Recalculate();
+}
+
+void Sheet::SetRecalcThreads(size_t threads) {
+  recalc_.SetThreads(threads);
+}
+
+void Sheet::SetInvalidation(RecalcEngine::Invalidation invalidation) {
+  BeginEdit();
+  if (invalidation == recalc_.GetInvalidation()) {
+    return;
+  }
+  if (recalc_.GetInvalidation() == RecalcEngine::Invalidation::kEager) {
+    Recalculate();
+  } else if (invalidation == RecalcEngine::Invalidation::kEager) {
+    // Eager reads trust every cached value.
+    cells_.ForEach([this](Cell &cell) { recalc_.Validate(cell); });
+  }
+  recalc_.SetInvalidation(invalidation);
+}
+
+void Sheet::SetConcurrentReads(bool enabled) {
+  recalc_.SetConcurrentReads(enabled);
+  if (enabled) {
+    Recalculate();
+  }
+}
+
+uint64_t Sheet::GetVersion() const {
+  return version_;
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot() {
+  BeginEdit();
+  // The values are brought up to date first, their changes mark the tiles.
+  // With the lazy modes only the formulas depending on the edits since the
+  // previous snapshot may be outdated, the first one validates every formula.
+  if (recalc_.GetInvalidation() == RecalcEngine::Invalidation::kEager) {
+    Recalculate();
+  } else if (!last_snapshot_) {
+    cells_.ForEach([this](Cell &cell) { recalc_.Validate(cell); });
+  }
+  recalc_.ValidateEdited();
+
+  // Shares what is unchanged since the previous snapshot.
+  using AxisTable = SheetSnapshot::AxisTable;
+  const auto &base = last_snapshot_;
+  auto snapshot = std::make_shared<SheetSnapshot>();
+  snapshot->version_ = version_;
+  snapshot->printable_size_ = GetPrintableSize();
+  // The lookups of the rows/cols holding cells
+  auto extent = size_monitor_.GetSize();
+  auto table = [&](const AxisMap &axis, int size,
+                   std::shared_ptr<const AxisTable> base_table) {
+    if (base_table && !axes_changed_ &&
+        base_table->size() >= static_cast<size_t>(size)) {
+      return base_table;
+    }
+    auto table = std::make_shared<AxisTable>(size);
+    for (int i = 0; i < size; ++i) {
+      (*table)[i] = axis.ToPhysical(i);
+    }
+    return std::shared_ptr<const AxisTable>(std::move(table));
+  };
+  snapshot->rows_ = table(rows_, extent.rows, base ? base->rows_ : nullptr);
+  snapshot->cols_ = table(cols_, extent.cols, base ? base->cols_ : nullptr);
+  axes_changed_ = false;
+
+  auto &grid = snapshot->tiles_;
+  cells_.CollectChanges([&](size_t tile_row, size_t tile_col,
+                            const auto &cells, bool changed) {
+    if (grid.size() <= tile_row) {
+      grid.resize(tile_row + 1);
+    }
+    if (grid[tile_row].size() <= tile_col) {
+      grid[tile_row].resize(tile_col + 1);
+    }
+    auto &tile = grid[tile_row][tile_col];
+    if (!changed && base && tile_row < base->tiles_.size() &&
+        tile_col < base->tiles_[tile_row].size()) {
+      tile = base->tiles_[tile_row][tile_col];
+    }
+    if (!tile) {
+      tile = SheetSnapshot::MakeTile(cells);
+      ++snapshot->built_tiles_;
+    }
+  });
+  last_snapshot_ = snapshot;
+  return snapshot;
+}
+
+void Sheet::BeginEdit() {
+  recalc_.WaitForRefresh();
+}
+
+void Sheet::FinishEdit(uint64_t count) {
+  version_ += count;
+  BuildTables();
+  if (recalc_.GetConcurrentReads()) {
+    // The readers don't recalculate: with kEager every value is current
+    // after an edit.
+    Recalculate();
+  }
+  // Published: the hot formulas are validated meanwhile.
+  recalc_.RefreshHot();
+}
+
+RecalcEngine::Policy Sheet::GetRecalcPolicy(Position pos) const {
+  auto cell = FindCell(pos);
+  return cell ? recalc_.GetPolicy(*cell) : RecalcEngine::Policy::kLazy;
+}
+
+RecalcEngine::Stats Sheet::GetRecalcStats() const {
+  return recalc_.GetStats();
+}
+
+CellArena &Sheet::GetCellArena() {
+  return arena_;
+}
+const CellArena &Sheet::GetCellArena() const {
+  return arena_;
+}
+
+void Sheet::BuildTables() {
+  rows_.BuildTables();
+  cols_.BuildTables();
+}
+
+Position Sheet::ToPhysical(Position pos) const {
+  return {rows_.ToPhysical(pos.row), cols_.ToPhysical(pos.col)};
+}
+
+Position Sheet::ToLogical(Position physical) const {
+  return {rows_.ToLogical(physical.row), cols_.ToLogical(physical.col)};
+}
+
 void Sheet::PrintCells(std::ostream &out, PrintSettings print_settings) const {
   Size size = GetPrintableSize();
+  std::vector<int> cols(size.cols);
+  for (int j = 0; j < size.cols; ++j) {
+    cols[j] = cols_.ToPhysical(j);
+  }
+
   for (int i = 0; i < size.rows; ++i) {
+    int row = rows_.ToPhysical(i);
     for (int j = 0; j < size.cols; ++j) {
       if (j > 0) {
         out << "\t";
       }
 
-      auto cell = GetCell(Position{i, j});
+      auto cell = cells_.Get({row, cols[j]});
       if (!cell) continue;
 
       switch (print_settings) {
@@ -192,10 +454,98 @@ void Sheet::PrintCells(std::ostream &out, PrintSettings print_settings) const {
   }
 }
 
-bool Sheet::IsValid(Position pos) const {
-  if (pos.row >= cells_.size() || pos.col >= cells_[pos.row].size())
-    return false;
-  return true;
+void Sheet::InsertItems(ShiftType type, int before, int count) {
+  axes_changed_ = true;
+  auto renamed = UpdateCells(OpType::kAddition, type, before, count);
+  // The last count rows/cols are empty after the validation, or after the
+  // deletion being undone.
+  (type == ShiftType::kRows ? rows_ : cols_).Insert(before, count);
+  IndexCells(renamed);
+  if (count > 0) {
+    journal_.Record(UndoJournal::AxisEdit{
+        .op = OpType::kAddition, .type = type, .first = before,
+        .count = count});
+  }
+}
+
+void Sheet::DeleteItems(ShiftType type, int first, int count) {
+  axes_changed_ = true;
+  InvalidateCells(type, first, count);
+  RemoveCells(type, first, count);
+  auto renamed = UpdateCells(OpType::kDeletion, type, first, count);
+  (type == ShiftType::kRows ? rows_ : cols_).Erase(first, count);
+  IndexCells(renamed);
+  // The cells recorded before are in the geometry before the deletion, the
+  // ones recorded later after it.
+  journal_.Record(UndoJournal::AxisEdit{
+      .op = OpType::kDeletion, .type = type, .first = first, .count = count});
+}
+
+void Sheet::RecordCell(Position pos) {
+  if (!journal_.IsOpen()) {
+    return;
+  }
+  auto cell = FindCell(pos);
+  journal_.Record(UndoJournal::CellImage{
+      .pos = pos,
+      .data = cell ? cell->GetPayload() : cell_data::Empty{},
+      .state = cell ? cell->State() : CellState::kEmpty,
+      .absent = !cell,
+      .listed_empty = cell && empty_cells_.count(cell),
+      .printable = cell && printable_size_monitor_.Contains(
+                               cell->GetPhysicalPosition())});
+}
+
+void Sheet::RecordCell(const Cell &cell) {
+  if (journal_.IsOpen()) {
+    RecordCell(cell.GetPosition());
+  }
+}
+
+void Sheet::RestoreCell(const UndoJournal::CellImage &image,
+                        std::unordered_set<Position, PositionHash> &absent) {
+  if (image.absent) {
+    if (FindCell(image.pos)) {
+      StoreCell(image.pos, "");
+      absent.insert(image.pos);
+    }
+    return;
+  }
+  absent.erase(image.pos);
+  auto &cell = ForceInitializeCell(image.pos);
+  cell.Restore(image.data, image.state);
+  auto physical = cell.GetPhysicalPosition();
+  if (image.listed_empty) {
+    empty_cells_.insert(&cell);
+  } else {
+    empty_cells_.erase(&cell);
+  }
+  if (image.printable) {
+    printable_size_monitor_.Add(physical);
+  } else {
+    printable_size_monitor_.Remove(physical);
+  }
+}
+
+void Sheet::EraseAbsent(std::unordered_set<Position, PositionHash> &absent) {
+  for (auto pos : absent) {
+    auto cell = FindCell(pos);
+    if (cell && cell->State() == CellState::kEmpty &&
+        cell->GetReferencingCells().empty()) {
+      cell->Detach();
+      EraseCell(*cell);
+    }
+  }
+  absent.clear();
+}
+
+void Sheet::EraseCell(Cell &cell) {
+  auto physical = cell.GetPhysicalPosition();
+  empty_cells_.erase(&cell);
+  recalc_.Forget(&cell);
+  printable_size_monitor_.Remove(physical);
+  size_monitor_.Remove(physical);
+  cells_.Erase(physical);
 }
 
 void Sheet::UpdateEmptyCells() {
@@ -212,18 +562,8 @@ void Sheet::UpdateEmptyCells() {
   }
 
   for (Cell *cell : cells_to_delete) {
-    empty_cells_.erase(cell);
-    auto [x, y] = cell->GetPosition();
-    cells_[x][y].reset();
-  }
-}
-
-void Sheet::ExpandToFit(Position pos) {
-  if (pos.row >= cells_.size()) {
-    cells_.resize(static_cast<size_t>(pos.row) + 1);
-  }
-  if (pos.col >= cells_[pos.row].size()) {
-    cells_[pos.row].resize(static_cast<size_t>(pos.col) + 1);
+    RecordCell(*cell);
+    EraseCell(*cell);
   }
 }
 
@@ -242,92 +582,29 @@ void Sheet::ValidateExpand(int before, int count, TableItem item) {
   }
 }
 
-void Sheet::ExpandTable(int before, int count, TableItem item) {
-  if (item == TableItem::kRows) {
-    if (before >= cells_.size()) return;
-    std::vector<std::vector<std::unique_ptr<Cell>>> vec(count);
-    cells_.insert(begin(cells_) + before,
-                  std::make_move_iterator(begin(vec)),
-                  std::make_move_iterator(end(vec)));
-  }
-  if (item == TableItem::kCols) {
-    for (int i = 0; i < printable_size_monitor_.GetSize().rows; ++i) {
-      if (before >= cells_[i].size()) continue;
-      std::vector<std::unique_ptr<Cell>> vec(count);
-      cells_[i].insert(begin(cells_[i]) + before,
-                       std::make_move_iterator(begin(vec)),
-                       std::make_move_iterator(end(vec)));
-    }
-
-    std::vector<int> cols_to_expand;
-    for (auto cell : empty_cells_) {
-      auto row = cell->GetPosition().row;
-      if (row >= printable_size_monitor_.GetSize().rows) {
-        cols_to_expand.push_back(row);
-      }
-    }
-    for (int row : cols_to_expand) {
-      if (before >= cells_[row].size()) continue;
-      std::vector<std::unique_ptr<Cell>> vec(count);
-      cells_[row].insert(begin(cells_[row]) + before,
-                         std::make_move_iterator(begin(vec)),
-                         std::make_move_iterator(end(vec)));
-    }
-  }
-}
-
 void Sheet::InvalidateCells(ShiftType type, int first, int count) {
-  std::stack<Position> st;
-  switch (type) {
-    case ShiftType::kRows: {
-      auto rows = printable_size_monitor_.GetSize().rows;
-      size_t begin = std::min<size_t>(std::max(first, 0), rows);
-      size_t end = std::min<size_t>(std::max(first + count, 0), rows);
-
-      for (auto i = begin; i < end; ++i) {
-        for (auto &cell : cells_[i]) {
-          if (!cell) continue;
-          cell->SetState(CellState::kRefError);
-          for (auto ref : cell->GetReferencingCells()) {
-            st.push(ref);
-          }
-        }
-      }
-      break;
-    }
-    case ShiftType::kCols: {
-      for (int i = 0; i < printable_size_monitor_.GetSize().rows; ++i) {
-        size_t begin = std::min<size_t>(std::max(first, 0), cells_[i].size());
-        size_t end = std::min<size_t>(std::max(first + count, 0),
-                                      cells_[i].size());
-
-        for (auto j = begin; j < end; ++j) {
-          auto &cell = cells_[i][j];
-          if (!cell) continue;
-          cell->SetState(CellState::kRefError);
-          for (auto ref : cell->GetReferencingCells()) {
-            st.push(ref);
-          }
-        }
-      }
-      break;
+  auto in_range = [&](Position pos) {
+    int idx = type == ShiftType::kRows ? pos.row : pos.col;
+    return idx >= first && idx < first + count;
+  };
+
+  std::stack<Cell *> st;
+  for (auto cell : ref_index_.Spanning(type, first, first + count)) {
+    auto refs = cell->GetReferencedCells();
+    if (std::any_of(begin(refs), end(refs), in_range)) {
+      st.push(cell);
     }
-    default:
-      throw std::runtime_error("Unexpected shift type");
   }
 
-  std::unordered_set < Position, PositionHash > visited;
+  std::unordered_set<Cell *> visited;
 
   while (!st.empty()) {
-    auto pos = st.top();
+    auto cell = st.top();
     st.pop();
 
-    auto cell = dynamic_cast<Cell *>(GetCell(pos));
-    if (!cell) {
-      throw std::runtime_error("InvalidateCells: null cell: failed precondition");
-    }
-    if (!visited.insert(pos).second || cell->State() == CellState::kRefError)
+    if (!visited.insert(cell).second || cell->State() == CellState::kRefError)
       continue;
+    RecordCell(*cell);
     cell->SetState(CellState::kRefError);
 
     for (auto ref : cell->GetReferencingCells()) {
@@ -336,43 +613,51 @@ void Sheet::InvalidateCells(ShiftType type, int first, int count) {
   }
 }
 
-void Sheet::UpdateCellsAfterRowAddition(int first_idx, int count) {
-  auto size = printable_size_monitor_.GetSize();
-  for (int i = 0; i < size.rows; ++i) {
-    for (int j = 0; j < size.cols; ++j) {
-      if (!IsValid({i, j}) || !cells_[i][j]) continue;
-      cells_[i][j]->HandleInsertedRows(first_idx, count);
+void Sheet::RemoveCells(ShiftType type, int first, int count) {
+  std::vector<Cell *> removed;
+  auto collect = [&removed](Cell &cell) { removed.push_back(&cell); };
+  for (int idx = first; idx < first + count; ++idx) {
+    if (type == ShiftType::kRows) {
+      cells_.ForEachInRow(rows_.ToPhysical(idx), collect);
+    } else {
+      cells_.ForEachInCol(cols_.ToPhysical(idx), collect);
     }
   }
-}
 
-void Sheet::UpdateCellsAfterColAddition(int first_idx, int count) {
-  auto size = printable_size_monitor_.GetSize();
-  for (int i = 0; i < size.rows; ++i) {
-    for (int j = 0; j < size.cols; ++j) {
-      if (!IsValid({i, j}) || !cells_[i][j]) continue;
-      cells_[i][j]->HandleInsertedCols(first_idx, count);
-    }
+  for (auto cell : removed) {
+    RecordCell(*cell);
+  }
+  for (auto cell : removed) {
+    // Edges to the other deleted cells are dropped by the first of the pair.
+    cell->Detach();
+    EraseCell(*cell);
   }
 }
 
-void Sheet::UpdateCellsAfterRowDeletion(int first_idx, int count) {
-  auto size = printable_size_monitor_.GetSize();
-  for (int i = 0; i < size.rows; ++i) {
-    for (int j = 0; j < size.cols; ++j) {
-      if (!IsValid({i, j}) || !cells_[i][j]) continue;
-      cells_[i][j]->HandleDeletedRows(first_idx, count);
+std::vector<Cell *> Sheet::UpdateCells(OpType op_type, ShiftType shift_type,
+                                       int first_idx, int count) {
+  // An insertion crosses the spans over the edit point, a deletion the spans
+  // over a deleted row/col. The cells inside the deleted ones are gone.
+  auto renamed = ref_index_.Spanning(
+      shift_type, first_idx,
+      op_type == OpType::kAddition ? first_idx : first_idx + count);
+  for (auto cell : renamed) {
+    ref_index_.Remove(cell);
+    RecordCell(*cell);
+    if (op_type == OpType::kAddition) {
+      shift_type == ShiftType::kRows ? cell->HandleInsertedRows(first_idx, count)
+                                     : cell->HandleInsertedCols(first_idx, count);
+    } else {
+      shift_type == ShiftType::kRows ? cell->HandleDeletedRows(first_idx, count)
+                                     : cell->HandleDeletedCols(first_idx, count);
     }
   }
+  return renamed;
 }
 
-void Sheet::UpdateCellsAfterColDeletion(int first_idx, int count) {
-  auto size = printable_size_monitor_.GetSize();
-  for (int i = 0; i < size.rows; ++i) {
-    for (int j = 0; j < size.cols; ++j) {
-      if (!IsValid({i, j}) || !cells_[i][j]) continue;
-      cells_[i][j]->HandleDeletedCols(first_idx, count);
-    }
+void Sheet::IndexCells(const std::vector<Cell *> &cells) {
+  for (auto cell : cells) {
+    ref_index_.Add(cell, cell->GetPosition(), cell->GetReferencedCells());
   }
 }
 
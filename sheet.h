@@ -1,20 +1,30 @@
 #ifndef SPREADSHEET_SRC_SHEET_H_
 #define SPREADSHEET_SRC_SHEET_H_
 
+#include <cstdint>
+#include <exception>
 #include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
 #include <unordered_set>
 
+#include "axis_map.h"
+#include "cell_arena.h"
+#include "cell_storage.h"
+#include "cell_value.h"
 #include "common.h"
+#include "formula_pool.h"
+#include "recalc_engine.h"
+#include "ref_index.h"
 #include "sheet_size_monitor.h"
+#include "sheet_snapshot.h"
+#include "topo_order.h"
+#include "undo_journal.h"
 #include "utils.h"
 
 class Cell;
 
-using Cells = std::vector<std::vector<std::unique_ptr<Cell>>>;
-
 enum class TableItem {
   kRows,
   kCols,
@@ -25,22 +35,62 @@ enum class PrintSettings {
   kTexts,
 };
 
-class Sheet final : public ISheet {
+class Sheet final : public ISheet, public IOperandSource {
  public:
-  ~Sheet() = default;
+  struct Edit {
+    Position pos;
+    std::string text;
+  };
+
+  ~Sheet(); // Same as BeginEdit
 
-  // O(max(N, M, logK); N – pos.row, M – pos.col, K – non_empty_cells.size
-  void ForceInitializeCell(Position pos);
+  // Returns the cell at pos, creating an empty one if there is none.
+  // O(logK), K – rows/cols count
+  Cell &ForceInitializeCell(Position pos);
   void SetCell(Position pos, std::string text) override;
+  // Applies the edits in order as SetCell does, each one checked for cycles
+  // against the previous ones, and marks the edited cells with their
+  // dependents dirty once for the whole batch. A failed edit leaves its cell
+  // as it was and doesn't stop the others; returns for every edit the
+  // exception it failed with, or nullptr. If an exception escapes (e.g.
+  // std::bad_alloc), the edits applied so far stay, are marked dirty and all
+  // the edits count in the version.
+  // O(N + D), N - SetCell cost of the edits, D - cells made dirty
+  std::vector<std::exception_ptr> ApplyBatch(std::vector<Edit> edits);
 
   const ICell *GetCell(Position pos) const override;
   ICell *GetCell(Position pos) override;
+  // Same as GetCell without the virtual call and the cast back to Cell, for
+  // the sheet internals. pos must be valid. O(1) amortized
+  Cell *FindCell(Position pos);
+  const Cell *FindCell(Position pos) const;
+  // Operand of the cell at pos for the formulas of the sheet, see
+  // Cell::GetOperand. O(1) amortized if the cell is up to date
+  CellValue GetOperand(Position pos) const override;
 
   void ClearCell(Position pos) override;
 
+  // Starts recording the edits of the sheet, Rollback undoes them.
+  // Transactions don't nest. O(1)
+  void BeginTransaction();
+  // Keeps the edits since BeginTransaction. O(N), N - recorded edits
+  void Commit();
+  // Undoes the edits since BeginTransaction, newest first: cell contents,
+  // dependency edges, inserted or deleted rows/cols and the sheet size are as
+  // they were before it. O(N), N - cost of the recorded edits
+  void Rollback();
+  bool InTransaction() const; // O(1)
+
+  // No cell moves and only the formulas whose span of position and
+  // references crosses the edit point are renamed, and journaled in a
+  // transaction. Position lookups go through the axis treap until the tables
+  // are rebuilt, see ToPhysical. O(N + S), N - such formulas, S - cost of
+  // RefIndex::Spanning
   void InsertRows(int before, int count) override;
   void InsertCols(int before, int count) override;
 
+  // Same as the insertion, plus O(M + E), M - cells in the deleted rows/cols
+  // and their dependents, E - empty cells kept for references
   void DeleteRows(int first, int count) override;
   void DeleteCols(int first, int count) override;
 
@@ -49,37 +99,164 @@ class Sheet final : public ISheet {
   void PrintValues(std::ostream &out) const override;
   void PrintTexts(std::ostream &out) const override;
 
+  // Compiled formula shapes shared by the cells of this sheet. O(1)
+  FormulaPool &GetFormulaPool();
+  const FormulaPool &GetFormulaPool() const;
+
+  // Formula cells by the rows/cols they reference. O(1)
+  RefIndex &GetRefIndex();
+
+  const CellStorage &GetCellStorage() const; // O(1)
+
+  // Dirty cells of the sheet. O(1)
+  RecalcEngine &GetRecalcEngine();
+  // Evaluates the formulas dirty after the edits, each one once. Reading an
+  // outdated value calls it implicitly. O(N + E), N - dirty cells,
+  // E - their dependency edges
+  void Recalculate();
+  // Threads evaluating independent formulas of a recalculation, 1 by default.
+  // Results don't depend on it. O(N), N - threads
+  void SetRecalcThreads(size_t threads);
+  // Cells touched and formulas evaluated by the last recalculation. O(1)
+  RecalcEngine::Stats GetRecalcStats() const;
+  // How an edit reaches the formulas depending on the edited cell, kEager by
+  // default, see RecalcEngine::Invalidation. Brings the values up to date
+  // first: leaving kEager recalculates the dirty formulas, switching back
+  // validates every formula. O(N + V), N - cells, V - evaluation cost
+  void SetInvalidation(RecalcEngine::Invalidation invalidation);
+  // Whether the formula at pos is kept current after every edit, with
+  // kAdaptive only the frequently read ones are. O(1)
+  RecalcEngine::Policy GetRecalcPolicy(Position pos) const;
+  // Lets the const reads of the sheet (GetCell, the ICell getters, Print*,
+  // GetPrintableSize, GetOperand) run on any number of threads at once. The
+  // edits still need exclusive access, e.g. a std::shared_mutex held shared
+  // by the readers. Position lookups only read, and with kEager every edit
+  // ends with the values recalculated; with the lazy modes the readers
+  // validate the formulas themselves, in parallel. Off by default.
+  // O(N + V) when turned on, N - dirty cells, V - evaluation cost
+  void SetConcurrentReads(bool enabled);
+
+  // Number of the edits made so far, each public edit counting once and each
+  // edit of ApplyBatch too, applied or failed. O(1)
+  uint64_t GetVersion() const;
+  // Immutable view of the texts and values at the current version, for
+  // readers on other threads while the edits go on; see SheetSnapshot.
+  // Needs the same exclusive access as an edit. Brings the values up to date
+  // first, then materializes only the tiles changed since the previous
+  // snapshot; the rest is shared with it. The sheet keeps the last snapshot,
+  // so the next one is as cheap also once the readers drop it.
+  // O(D + T + C), D - cost of bringing the values up to date (with the lazy
+  // modes the formulas depending on the edits since the previous snapshot
+  // are validated, the first time every formula), T - tiles, C - cells of
+  // the changed tiles
+  std::shared_ptr<const SheetSnapshot> Snapshot();
+
+  // Topological order of the cells checking new references for cycles. O(1)
+  TopoOrder &GetTopoOrder();
+
+  // Memory of the cells and their data. O(1)
+  CellArena &GetCellArena();
+  const CellArena &GetCellArena() const;
+
+  // Cells are stored by physical rows/cols, which don't change on rows/cols
+  // insertion or deletion, so a structural edit moves no cells. O(1) through
+  // the axis tables, O(logN) after a structural edit until the tables are
+  // rebuilt, N - kMaxRows. See AxisMap::BuildTables
+  Position ToPhysical(Position pos) const;
+  Position ToLogical(Position physical) const;
+
  private:
-  bool IsValid(Position pos) const; // O(1)
+  // Counters of the axis maps used by the size monitors.
+  static constexpr int kPrintableCounter = 0;
+  static constexpr int kAllocatedCounter = 1;
+
+  // SetCell without BeginEdit and FinishEdit, for the edits made of several.
+  // Same cost as SetCell
+  void StoreCell(Position pos, std::string text);
+  // Starts an edit: waits for the hot formulas the previous one left to
+  // validate, see RecalcEngine::RefreshHot. O(1) if they are, else O(V),
+  // V - validation cost left
+  void BeginEdit();
+  // Ends an edit made of count: counts them in the version, readies the
+  // sheet for concurrent reads, if they are on, and starts the hot formulas
+  // validating. O(H), H - hot formulas, with concurrent reads also O(N + V),
+  // N - dirty cells, V - evaluation cost
+  void FinishEdit(uint64_t count = 1);
+  // AxisMap::BuildTables of both axes, between edits. O(N) if rebuilding,
+  // N - kMaxRows, O(1) otherwise
+  void BuildTables();
+
+  // Destroys the cell, which must be detached. O(logN), N - rows/cols count
+  void EraseCell(Cell &cell);
+
+  // O(N), N – empty_cells_count
+  void UpdateEmptyCells();
 
-  void UpdateEmptyCells(); // O(N), N – empty_cells_count
+  void ValidateExpand(int before, int count, TableItem item); // O(logN)
 
-  void ExpandToFit(Position pos); // O(max(N, M); N – pos.row, M – pos.col
+  // Insertion and deletion of validated rows/cols. The deletion leaves the
+  // unreferenced empty cells to UpdateEmptyCells, which Rollback doesn't call.
+  // O(N + S), N - formulas the edit crosses, S - cost of RefIndex::Spanning
+  void InsertItems(ShiftType type, int before, int count);
+  // O(N + M + S), M - cells in the deleted rows/cols
+  void DeleteItems(ShiftType type, int first, int count);
 
-  void ValidateExpand(int before, int count, TableItem item); // O(1)
+  // Journal the content of the cell at pos before an edit if a transaction
+  // is open. O(N), N - text size
+  void RecordCell(Position pos);
+  void RecordCell(const Cell &cell);
+  // Puts the content back. Cells which were absent are cleared and collected
+  // into absent for EraseAbsent, an older image of the position takes it
+  // out again. O(N), N - SetCell cost
+  void RestoreCell(const UndoJournal::CellImage &image,
+                   std::unordered_set<Position, PositionHash> &absent);
+  // Erases the cells at the positions left empty and unreferenced.
+  // O(N), N - positions
+  void EraseAbsent(std::unordered_set<Position, PositionHash> &absent);
 
-  // O(empty_cells.size)????
-  void ExpandTable(int before, int count, TableItem item);
+  // Before rows/cols deletion invalidates cells, which refer to deleted
+  // cells, and the cells referring to the invalidated ones.
+  // O(N + S), N - dependent cells count, S - cost of RefIndex::Spanning
+  void InvalidateCells(ShiftType type, int first, int count);
 
-  // After rows/cols deletion invalidates cells, which refer to
-  // deleted/invalidated cells.
-  void InvalidateCells(ShiftType type, int first, int second);
+  // Drops the edges of the cells in the deleted rows/cols and destroys them.
+  // O(N), N - cells in the deleted rows/cols
+  void RemoveCells(ShiftType type, int first, int count);
 
-  // O(N), N - formula_expr.size
-  void UpdateCellsAfterRowAddition(int first_idx, int count);
-  // O(N), N - formula_expr.size
-  void UpdateCellsAfterColAddition(int first_idx, int count);
-  // O(N), N - formula_expr.size
-  void UpdateCellsAfterRowDeletion(int first_idx, int count);
-  // O(N), N - formula_expr.size
-  void UpdateCellsAfterColDeletion(int first_idx, int count);
+  // Renames the references of the formulas the edit crosses, found through
+  // ref_index_, and journals each of them. Other formulas keep their offsets
+  // and their index entries. Returns the renamed cells, taken out of the
+  // index until the rows/cols move, see IndexCells.
+  // O(N + S), N - such formulas, S - cost of RefIndex::Spanning
+  std::vector<Cell *> UpdateCells(OpType op_type, ShiftType shift_type,
+                                  int first_idx, int count);
+  // Indexes the cells at their current positions. O(N), N - their references
+  void IndexCells(const std::vector<Cell *> &cells);
 
   void PrintCells(std::ostream &out, PrintSettings print_settings) const;
 
-  SheetSizeMonitor printable_size_monitor_;
-  SheetSizeMonitor size_monitor_;
+  // Declared first, it must outlive everything allocated from it.
+  CellArena arena_;
+  AxisMap rows_{Position::kMaxRows};
+  AxisMap cols_{Position::kMaxCols};
+  SheetSizeMonitor printable_size_monitor_{rows_, cols_, kPrintableCounter,
+                                           arena_.Resource()};
+  SheetSizeMonitor size_monitor_{rows_, cols_, kAllocatedCounter,
+                                 arena_.Resource()};
   std::unordered_set<Cell *> empty_cells_;
-  Cells cells_;
+  // Declared before cells_, whose formulas keep a pointer to the pool.
+  FormulaPool formula_pool_;
+  RefIndex ref_index_{rows_, cols_};
+  RecalcEngine recalc_;
+  TopoOrder topo_order_;
+  UndoJournal journal_;
+  // Indexed by physical position, see ToPhysical.
+  CellStorage cells_{arena_};
+  uint64_t version_ = 0;
+  // The last snapshot, the base of the next one
+  std::shared_ptr<const SheetSnapshot> last_snapshot_;
+  // Rows/cols inserted or deleted since the last snapshot
+  bool axes_changed_ = true;
 };
 
 #endif // SPREADSHEET_SRC_SHEET_H_
@@ -1,84 +1,53 @@
 #include "sheet_size_monitor.h"
 
-void SheetSizeMonitor::Add(Position pos) {
-  non_empty_cells_.insert(pos);
-  if (max_col_.has_value()) {
-    max_col_ = std::max(*max_col_, pos.col);
-  } else {
-    max_col_ = pos.col;
-  }
-}
-
-void SheetSizeMonitor::Remove(Position pos) {
-  non_empty_cells_.erase(pos);
-  max_col_.reset();
+SheetSizeMonitor::SheetSizeMonitor(AxisMap &rows, AxisMap &cols, int counter,
+                                   std::pmr::memory_resource *resource)
+    : rows_(rows), cols_(cols), counter_(counter), tiles_(resource) {}
+
+void SheetSizeMonitor::Add(Position physical) {
+  auto &tile = tiles_[TileOf(physical)];
+  auto &word = tile.rows[physical.row % kTileSize];
+  if (word & BitOf(physical)) {
+    return;
+  }
+  word |= BitOf(physical);
+  ++tile.count;
+  rows_.AddCount(physical.row, counter_, 1);
+  cols_.AddCount(physical.col, counter_, 1);
 }
 
-Size SheetSizeMonitor::GetSize() const {
-  if (non_empty_cells_.empty()) {
-    return {0, 0};
+void SheetSizeMonitor::Remove(Position physical) {
+  auto it = tiles_.find(TileOf(physical));
+  if (it == tiles_.end()) {
+    return;
   }
-
-  auto row = prev(non_empty_cells_.end())->row;
-  if (max_col_) {
-    return {row + 1, *max_col_ + 1};
+  auto &word = it->second.rows[physical.row % kTileSize];
+  if (!(word & BitOf(physical))) {
+    return;
   }
-
-  max_col_ = 0;
-  for (auto pos : non_empty_cells_) {
-    max_col_ = std::max(*max_col_, pos.col);
+  word &= ~BitOf(physical);
+  if (--it->second.count == 0) {
+    tiles_.erase(it);
   }
-
-  return {row + 1, *max_col_ + 1};
+  rows_.AddCount(physical.row, counter_, -1);
+  cols_.AddCount(physical.col, counter_, -1);
 }
 
-void SheetSizeMonitor::UpdateAfterRowAddition(int first_idx, int count) {
-  for (auto &pos : non_empty_cells_) {
-    if (pos.row < first_idx) continue;
-    const_cast<Position &>(pos).row = pos.row + count;
-  }
+bool SheetSizeMonitor::Contains(Position physical) const {
+  auto it = tiles_.find(TileOf(physical));
+  return it != tiles_.end() &&
+      (it->second.rows[physical.row % kTileSize] & BitOf(physical)) != 0;
 }
 
-void SheetSizeMonitor::UpdateAfterColAddition(int first_idx, int count) {
-  for (auto &pos : non_empty_cells_) {
-    if (pos.col < first_idx) continue;
-    const_cast<Position &>(pos).col = pos.col + count;
-  }
-  max_col_.reset();
+Size SheetSizeMonitor::GetSize() const {
+  return {rows_.Extent(counter_), cols_.Extent(counter_)};
 }
 
-void SheetSizeMonitor::UpdateAfterRowDeletion(int first_idx, int count) {
-  for (auto it = begin(non_empty_cells_);
-       it != non_empty_cells_.end();) {
-    if (it->row >= first_idx && it->row < first_idx + count) {
-      it = non_empty_cells_.erase(it);
-    } else {
-      it = next(it);
-    }
-  }
-
-  for (auto &pos : non_empty_cells_) {
-    if (pos.row >= first_idx + count) {
-      const_cast<Position &>(pos).row = pos.row - count;
-    }
-  }
-  max_col_.reset();
+int64_t SheetSizeMonitor::TileOf(Position physical) {
+  constexpr int64_t kTilesPerRow = Position::kMaxCols / kTileSize + 1;
+  return physical.row / kTileSize * kTilesPerRow + physical.col / kTileSize;
 }
 
-void SheetSizeMonitor::UpdateAfterColDeletion(int first_idx, int count) {
-  for (auto it = begin(non_empty_cells_);
-       it != non_empty_cells_.end();) {
-    if (it->col >= first_idx && it->col < first_idx + count) {
-      it = non_empty_cells_.erase(it);
-    } else {
-      it = next(it);
-    }
-  }
-
-  for (auto &pos : non_empty_cells_) {
-    if (pos.col >= first_idx + count) {
-      const_cast<Position &>(pos).col = pos.col - count;
-    }
-  }
-  max_col_.reset();
+uint64_t SheetSizeMonitor::BitOf(Position physical) {
+  return uint64_t{1} << (physical.col % kTileSize);
 }
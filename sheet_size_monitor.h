@@ -1,24 +1,49 @@
 #ifndef SPREADSHEET__SHEET_SIZE_MONITOR_H_
 #define SPREADSHEET__SHEET_SIZE_MONITOR_H_
 
-#include <set>
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <unordered_map>
 
+#include "axis_map.h"
 #include "common.h"
+#include "utils.h"
 
+// Size of the minimal rectangle holding the tracked cells. Cells are tracked
+// by physical position, the row/col counters live in the axis maps, so
+// structural edits of the sheet don't touch the monitor. Membership is a bit
+// per cell in tiles of kTileSize x kTileSize, allocated with the first
+// tracked cell of the tile.
 class SheetSizeMonitor {
  public:
-  void Add(Position pos); // O(logN); N – non_empty_cells.size
-  void Remove(Position pos); // O(logN); N – non_empty_cells.size
-  Size GetSize() const; // O(N); N – non_empty_cells.size
+  static constexpr int kTileSize = 64;
 
-  void UpdateAfterRowAddition(int first_idx, int count); // O(N)
-  void UpdateAfterColAddition(int first_idx, int count); // O(N)
-  void UpdateAfterRowDeletion(int first_idx, int count); // O(N)
-  void UpdateAfterColDeletion(int first_idx, int count); // O(N)
+  // counter - the axis maps counter owned by this monitor, resource - memory
+  // of the tiles. O(1)
+  SheetSizeMonitor(AxisMap &rows, AxisMap &cols, int counter,
+                   std::pmr::memory_resource *resource =
+                       std::pmr::get_default_resource());
+
+  void Add(Position physical); // O(logN); N – rows/cols count
+  void Remove(Position physical); // O(logN); N – rows/cols count
+  bool Contains(Position physical) const; // O(1) amortized
+  Size GetSize() const; // O(logN); N – rows/cols count
 
  private:
-  std::set<Position> non_empty_cells_;
-  mutable std::optional<int> max_col_;
+  struct Tile {
+    // Row-major, a word per row of the tile
+    std::array<uint64_t, kTileSize> rows{};
+    int count = 0;
+  };
+
+  static int64_t TileOf(Position physical); // O(1)
+  static uint64_t BitOf(Position physical); // O(1)
+
+  AxisMap &rows_;
+  AxisMap &cols_;
+  int counter_;
+  std::pmr::unordered_map<int64_t, Tile> tiles_;
 };
 
 #endif //SPREADSHEET__SHEET_SIZE_MONITOR_H_
@@ -0,0 +1,146 @@
+#include "sheet_snapshot.h"
+
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <variant>
+
+#include "cell.h"
+#include "utils.h"
+
+uint64_t SheetSnapshot::GetVersion() const {
+  return version_;
+}
+
+std::optional<ICell::Value> SheetSnapshot::GetValue(Position pos) const {
+  auto entry = Find(pos);
+  if (!entry) {
+    return std::nullopt;
+  }
+  return ToValue(*entry);
+}
+
+std::optional<std::string> SheetSnapshot::GetText(Position pos) const {
+  auto entry = Find(pos);
+  if (!entry) {
+    return std::nullopt;
+  }
+  return ToText(*entry, pos);
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+  return printable_size_;
+}
+
+template <typename F>
+void SheetSnapshot::Print(std::ostream &out, F print) const {
+  for (int i = 0; i < printable_size_.rows; ++i) {
+    for (int j = 0; j < printable_size_.cols; ++j) {
+      if (j > 0) {
+        out << "\t";
+      }
+      if (auto entry = Find({i, j})) {
+        print(*entry, Position{i, j});
+      }
+    }
+    out << "\n";
+  }
+}
+
+void SheetSnapshot::PrintValues(std::ostream &out) const {
+  Print(out, [&out](const Tile::Entry &entry, Position) {
+    out << ToValue(entry);
+  });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream &out) const {
+  Print(out, [&out](const Tile::Entry &entry, Position pos) {
+    out << ToText(entry, pos);
+  });
+}
+
+size_t SheetSnapshot::TileCount() const {
+  size_t count = 0;
+  for (const auto &tile_row : tiles_) {
+    for (const auto &tile : tile_row) {
+      count += tile != nullptr;
+    }
+  }
+  return count;
+}
+
+size_t SheetSnapshot::BuiltTiles() const {
+  return built_tiles_;
+}
+
+std::shared_ptr<const SheetSnapshot::Tile> SheetSnapshot::MakeTile(
+    const std::array<Cell *, kTileSize * kTileSize> &cells) {
+  auto tile = std::make_shared<Tile>();
+  for (size_t slot = 0; slot < cells.size(); ++slot) {
+    auto cell = cells[slot];
+    if (!cell) {
+      tile->slots[slot] = Tile::kNoCell;
+      continue;
+    }
+    tile->slots[slot] = static_cast<int16_t>(tile->entries.size());
+    auto &entry = tile->entries.emplace_back();
+    if (auto formula =
+            std::get_if<cell_data::Formula>(&cell->GetPayload())) {
+      entry.formula = formula->GetShape();
+    } else {
+      entry.text = cell->GetText();
+    }
+    auto value = cell->PeekValue();
+    if (auto number = std::get_if<double>(&value)) {
+      entry.value = CellValue::Number(*number);
+    } else if (auto error = std::get_if<FormulaError>(&value)) {
+      entry.value = CellValue::Error(error->GetCategory());
+    } else {
+      // The value of a text cell is the text, without the escape sign.
+      entry.value = CellValue::Text();
+      entry.text_offset = static_cast<uint8_t>(
+          entry.text.size() - std::get<std::string>(value).size());
+    }
+  }
+  return tile;
+}
+
+ICell::Value SheetSnapshot::ToValue(const Tile::Entry &entry) {
+  switch (entry.value.GetKind()) {
+    case CellValue::Kind::kText:
+      return entry.text.substr(entry.text_offset);
+    case CellValue::Kind::kError:
+      return entry.value.GetError();
+    default:
+      return entry.value.GetNumber();
+  }
+}
+
+std::string SheetSnapshot::ToText(const Tile::Entry &entry, Position pos) {
+  if (entry.formula) {
+    return kFormulaSign + entry.formula->ast.ToString(pos);
+  }
+  return entry.text;
+}
+
+const SheetSnapshot::Tile::Entry *SheetSnapshot::Find(Position pos) const {
+  if (!pos.IsValid()) {
+    throw InvalidPositionException{"Invalid position"};
+  }
+  if (static_cast<size_t>(pos.row) >= rows_->size() ||
+      static_cast<size_t>(pos.col) >= cols_->size()) {
+    return nullptr;
+  }
+  Position physical{(*rows_)[pos.row], (*cols_)[pos.col]};
+  auto tile_row = static_cast<size_t>(physical.row / kTileSize);
+  auto tile_col = static_cast<size_t>(physical.col / kTileSize);
+  if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size() ||
+      !tiles_[tile_row][tile_col]) {
+    return nullptr;
+  }
+  const auto &tile = *tiles_[tile_row][tile_col];
+  auto index = tile.slots[(physical.row % kTileSize) * kTileSize +
+                          physical.col % kTileSize];
+  return index == Tile::kNoCell ? nullptr : &tile.entries[index];
+}
@@ -0,0 +1,100 @@
+#ifndef SPREADSHEET_SHEET_SNAPSHOT_H_
+#define SPREADSHEET_SHEET_SNAPSHOT_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "cell_storage.h"
+#include "cell_value.h"
+#include "common.h"
+#include "formula_pool.h"
+
+class Cell;
+
+// Immutable view of the texts and values of a sheet at one version, taken by
+// Sheet::Snapshot. Readers on any thread use it while the sheet keeps being
+// edited: nothing here points into the sheet. The view mirrors the tiles of
+// CellStorage, each one materialized once and shared with the following
+// snapshots until a cell of it changes (copy-on-write by tiles), so taking a
+// snapshot costs the tiles changed since the previous one. The sheet keeps
+// the last version as the base of the next snapshot, the memory of an older
+// one goes with the last snapshot holding it.
+class SheetSnapshot {
+ public:
+  static constexpr int kTileSize = CellStorage::kTileSize;
+
+  // Sheet::GetVersion at the time of the snapshot. O(1)
+  uint64_t GetVersion() const;
+
+  // Value and text of the cell at pos, nullopt if there was no cell. Throws
+  // InvalidPositionException for an invalid pos. O(N), N - text.size
+  std::optional<ICell::Value> GetValue(Position pos) const;
+  std::optional<std::string> GetText(Position pos) const;
+
+  // Same as the ISheet methods at the time of the snapshot.
+  Size GetPrintableSize() const; // O(1)
+  // O(N), N - printable cells count
+  void PrintValues(std::ostream &out) const;
+  void PrintTexts(std::ostream &out) const;
+
+  size_t TileCount() const; // O(T), T - tiles count
+  // Tiles materialized for this snapshot, the others are shared with the
+  // previous one. O(1)
+  size_t BuiltTiles() const;
+
+ private:
+  friend class Sheet;
+
+  struct Tile {
+    struct Entry {
+      // Empty for a formula, printed from its shape at the position read:
+      // a structural edit moves a formula without changing its tile.
+      std::string text;
+      std::shared_ptr<const FormulaShape> formula;
+      // kText stands for the text from text_offset on
+      CellValue value;
+      uint8_t text_offset = 0;
+    };
+
+    static constexpr int16_t kNoCell = -1;
+
+    // Entry of every slot, row-major as in CellStorage
+    std::array<int16_t, kTileSize * kTileSize> slots;
+    std::vector<Entry> entries;
+  };
+
+  // Axis map lookups of the rows (cols) holding cells, logical to physical
+  using AxisTable = std::vector<int>;
+  using TileGrid = std::vector<std::vector<std::shared_ptr<const Tile>>>;
+
+  // Reads the cells through Cell::PeekValue, their values must be current.
+  // O(N), N - cells of the tile
+  static std::shared_ptr<const Tile> MakeTile(
+      const std::array<Cell *, kTileSize * kTileSize> &cells);
+
+  static ICell::Value ToValue(const Tile::Entry &entry); // O(N), N - text.size
+  // Text of the entry at logical pos. O(N), N - text.size
+  static std::string ToText(const Tile::Entry &entry, Position pos);
+  // The entry at logical pos, if any. O(1)
+  const Tile::Entry *Find(Position pos) const;
+
+  // O(N), N - printable cells count
+  template <typename F>
+  void Print(std::ostream &out, F print) const;
+
+  uint64_t version_ = 0;
+  Size printable_size_;
+  std::shared_ptr<const AxisTable> rows_;
+  std::shared_ptr<const AxisTable> cols_;
+  // Indexed by physical tile row and col
+  TileGrid tiles_;
+  size_t built_tiles_ = 0;
+};
+
+#endif // SPREADSHEET_SHEET_SNAPSHOT_H_
@@ -0,0 +1,105 @@
+#include "topo_order.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "cell.h"
+
+int64_t TopoOrder::NewCell() {
+  return --lowest_;
+}
+
+bool TopoOrder::AddEdge(Cell &precedent, Cell &dependent) {
+  if (precedent.order_ < dependent.order_) {
+    return true;
+  }
+  // A cell without references goes below everything and a cell nobody refers
+  // to goes above, both keep the order of their other edges. Values and the
+  // formulas appended to a chain end here.
+  if (precedent.GetPrecedents().empty()) {
+    precedent.order_ = --lowest_;
+    return true;
+  }
+  if (dependent.GetReferencingCells().empty()) {
+    dependent.order_ = ++highest_;
+    return true;
+  }
+
+  // Only the cells numbered between the ends can be on a cycle or out of
+  // order after the edge is added.
+  forward_.clear();
+  backward_.clear();
+  visited_.clear();
+  if (!SearchForward(dependent, precedent, precedent.order_)) {
+    return false;
+  }
+  SearchBackward(precedent, dependent.order_);
+  Reorder();
+  return true;
+}
+
+size_t TopoOrder::Visited() const {
+  return visited_count_;
+}
+
+bool TopoOrder::SearchForward(Cell &dependent, const Cell &precedent,
+                              int64_t upper) {
+  stack_.assign(1, &dependent);
+  visited_.insert(&dependent);
+  while (!stack_.empty()) {
+    auto cell = stack_.back();
+    stack_.pop_back();
+    forward_.push_back(cell);
+    ++visited_count_;
+    for (auto next : cell->GetReferencingCells()) {
+      if (next == &precedent) {
+        return false;
+      }
+      if (next->order_ < upper && visited_.insert(next).second) {
+        stack_.push_back(next);
+      }
+    }
+  }
+  return true;
+}
+
+void TopoOrder::SearchBackward(Cell &precedent, int64_t lower) {
+  // Disjoint with the forward search, a common cell would be on a cycle.
+  stack_.assign(1, &precedent);
+  visited_.insert(&precedent);
+  while (!stack_.empty()) {
+    auto cell = stack_.back();
+    stack_.pop_back();
+    backward_.push_back(cell);
+    ++visited_count_;
+    for (auto next : cell->GetPrecedents()) {
+      if (next->order_ > lower && visited_.insert(next).second) {
+        stack_.push_back(next);
+      }
+    }
+  }
+}
+
+void TopoOrder::Reorder() {
+  auto by_order = [](const Cell *lhs, const Cell *rhs) {
+    return lhs->order_ < rhs->order_;
+  };
+  std::sort(backward_.begin(), backward_.end(), by_order);
+  std::sort(forward_.begin(), forward_.end(), by_order);
+
+  numbers_.clear();
+  for (auto cells : {&backward_, &forward_}) {
+    for (auto cell : *cells) {
+      numbers_.push_back(cell->order_);
+    }
+  }
+  std::sort(numbers_.begin(), numbers_.end());
+
+  auto number = numbers_.begin();
+  for (auto cells : {&backward_, &forward_}) {
+    for (auto cell : *cells) {
+      cell->order_ = *number++;
+    }
+  }
+}
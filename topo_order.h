@@ -0,0 +1,53 @@
+#ifndef SPREADSHEET_TOPO_ORDER_H_
+#define SPREADSHEET_TOPO_ORDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+class Cell;
+
+// Topological order of the cells kept up to date across edits (Pearce–Kelly):
+// every cell has a number greater than the numbers of the cells it refers to.
+// An edge the order allows already is accepted in O(1), otherwise only the
+// cells between its ends in the order are searched and renumbered. Removing
+// an edge never breaks the order.
+class TopoOrder {
+ public:
+  // Number of a new cell without edges, below every other one. O(1)
+  int64_t NewCell();
+
+  // Renumbers the cells so that the order allows the edge from precedent to
+  // dependent, returns false if the edge closes a cycle, the order stays
+  // valid then. O(1) if allowed already or either end can move freely,
+  // otherwise O(KlogK), K - cells between the ends in the order, which are
+  // reachable from them
+  bool AddEdge(Cell &precedent, Cell &dependent);
+
+  // Cells visited by the searches so far. O(1)
+  size_t Visited() const;
+
+ private:
+  // Cells reachable from dependent through the referring cells, with numbers
+  // below upper. Returns false if precedent is reached. O(K), K - such cells
+  bool SearchForward(Cell &dependent, const Cell &precedent, int64_t upper);
+  // Cells reaching precedent, with numbers above lower. O(K), K - such cells
+  void SearchBackward(Cell &precedent, int64_t lower);
+  // Gives the numbers of the found cells to backward_ first, then to
+  // forward_, keeping the order within each. O(KlogK), K - found cells
+  void Reorder();
+
+  int64_t lowest_ = 0;
+  int64_t highest_ = 0;
+  size_t visited_count_ = 0;
+
+  // Reused by the searches
+  std::vector<Cell *> forward_;
+  std::vector<Cell *> backward_;
+  std::vector<Cell *> stack_;
+  std::vector<int64_t> numbers_;
+  std::unordered_set<const Cell *> visited_;
+};
+
+#endif // SPREADSHEET_TOPO_ORDER_H_
@@ -0,0 +1,24 @@
+#include "undo_journal.h"
+
+#include <utility>
+#include <vector>
+
+void UndoJournal::Open() {
+  entries_.clear();
+  open_ = true;
+}
+
+bool UndoJournal::IsOpen() const {
+  return open_;
+}
+
+void UndoJournal::Record(Entry entry) {
+  if (open_) {
+    entries_.push_back(std::move(entry));
+  }
+}
+
+std::vector<UndoJournal::Entry> UndoJournal::Close() {
+  open_ = false;
+  return std::exchange(entries_, {});
+}
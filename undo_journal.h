@@ -0,0 +1,54 @@
+#ifndef SPREADSHEET_UNDO_JOURNAL_H_
+#define SPREADSHEET_UNDO_JOURNAL_H_
+
+#include <variant>
+#include <vector>
+
+#include "cell.h"
+#include "cell_data.h"
+#include "common.h"
+#include "utils.h"
+
+// Edits of an open sheet transaction in the order they were made. The sheet
+// undoes them newest first, so every entry is replayed in the geometry it was
+// recorded in. Rolling back costs as much as the recorded edits, not the
+// sheet.
+class UndoJournal {
+ public:
+  // Content of a cell before an edit. A formula keeps its compiled shape, so
+  // even one with #REF! in the text is put back as it was.
+  struct CellImage {
+    Position pos;
+    cell_data::Payload data;
+    CellState state = CellState::kEmpty;
+    // There was no cell at pos
+    bool absent = false;
+    // Memberships of the cell in the sheet's bookkeeping: kept as an empty
+    // cell until unreferenced, counted in the printable size.
+    bool listed_empty = false;
+    bool printable = false;
+  };
+
+  // Rows/cols inserted or deleted at [first, first + count).
+  struct AxisEdit {
+    OpType op = OpType::kNone;
+    ShiftType type = ShiftType::kNone;
+    int first = 0;
+    int count = 0;
+  };
+
+  using Entry = std::variant<CellImage, AxisEdit>;
+
+  void Open(); // O(1)
+  bool IsOpen() const; // O(1)
+  // Ignored if closed. O(1) amortized
+  void Record(Entry entry);
+  // Returns the entries, oldest first. O(1)
+  std::vector<Entry> Close();
+
+ private:
+  std::vector<Entry> entries_;
+  bool open_ = false;
+};
+
+#endif // SPREADSHEET_UNDO_JOURNAL_H_
@@ -1,18 +1,47 @@
 #include "utils.h"
 
+#include <charconv>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <system_error>
 
-#include "antlr4-runtime.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-#include "bail_error_listener.h"
 #include "common.h"
 
 size_t PositionHash::operator()(Position pos) const {
-  return pos.row + pos.col * 10007;
+  return static_cast<size_t>(pos.row) + static_cast<size_t>(pos.col) * 10007;
+}
+
+Position ToOffset(Position pos, Position anchor) {
+  return {pos.row - anchor.row, pos.col - anchor.col};
+}
+
+Position FromOffset(Position offset, Position anchor) {
+  return {offset.row + anchor.row, offset.col + anchor.col};
+}
+
+Position ShiftPosition(Position pos, OpType op_type, ShiftType shift_type,
+                       int first_idx, int count) {
+  int &idx = shift_type == ShiftType::kRows ? pos.row : pos.col;
+  if (op_type == OpType::kAddition && idx >= first_idx) {
+    idx += count;
+  } else if (op_type == OpType::kDeletion && idx >= first_idx + count) {
+    idx -= count;
+  }
+  return pos;
 }
 
 std::optional<double> ToDouble(const std::string str) {
+  // Plain numbers skip the string stream, which allocates on every call.
+  if (!str.empty() &&
+      str.find_first_not_of("0123456789.eE-") == std::string::npos) {
+    double num = 0.0;
+    auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), num);
+    if (ec == std::errc() && end == str.data() + str.size()) {
+      return num;
+    }
+  }
+
   std::optional<double> res;
   std::istringstream in(str);
   double num = 0.0;
@@ -23,30 +52,3 @@ std::optional<double> ToDouble(const std::string str) {
   }
   return res;
 }
-
-namespace listener_utils {
-void Run(const std::string &expr,
-         antlr4::tree::ParseTreeListener *listener) {
-  antlr4::ANTLRInputStream input(expr);
-
-  FormulaLexer lexer(&input);
-  BailErrorListener error_listener;
-  lexer.removeErrorListeners();
-  lexer.addErrorListener(&error_listener);
-
-  antlr4::CommonTokenStream tokens(&lexer);
-
-  FormulaParser parser(&tokens);
-  auto error_handler = std::make_shared<antlr4::BailErrorStrategy>();
-  parser.setErrorHandler(error_handler);
-  parser.removeErrorListeners();
-
-  antlr4::tree::ParseTree *tree;
-  try {
-    tree = parser.main();
-  } catch (...) {
-    throw FormulaException("Wrong formula format");
-  }
-  antlr4::tree::ParseTreeWalker::DEFAULT.walk(listener, tree);
-}
-}
\ No newline at end of file
@@ -1,13 +1,12 @@
 #ifndef SPREADSHEET__UTILS_H_
 #define SPREADSHEET__UTILS_H_
 
+#include <optional>
 #include <ostream>
 #include <string>
 #include <vector>
 #include <variant>
 
-#include "antlr4-runtime.h"
-
 #include "common.h"
 
 enum class ShiftType {
@@ -26,19 +25,19 @@ static std::string kInvalidPosStr = "A16385";
 
 std::ostream &operator<<(std::ostream &out, const ICell::Value &val);
 
-struct FormulaInfo {
-  std::string expr;
-  std::vector<Position> referenced_cells;
-};
-
 std::optional<double> ToDouble(const std::string str);
 
 struct PositionHash {
   size_t operator()(Position pos) const;
 };
 
-namespace listener_utils {
-void Run(const std::string &expr, antlr4::tree::ParseTreeListener *listener);
-}
+// Offset of pos from anchor and back. O(1)
+Position ToOffset(Position pos, Position anchor);
+Position FromOffset(Position offset, Position anchor);
+
+// Where the cell at pos moves after rows/cols insertion or deletion. Cells in
+// the deleted range keep their position. O(1)
+Position ShiftPosition(Position pos, OpType op_type, ShiftType shift_type,
+                       int first_idx, int count);
 
 #endif //SPREADSHEET__UTILS_H_
@@ -0,0 +1,218 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+WorkerPool::Worker::Worker(WorkerPool &pool, size_t index)
+    : pool_(pool), index_(index) {}
+
+void WorkerPool::Worker::Push(size_t task) {
+  pool_.Push(index_, task);
+}
+
+size_t WorkerPool::Worker::Index() const {
+  return index_;
+}
+
+WorkerPool::WorkerPool(size_t threads)
+    : queues_(std::max<size_t>(threads, 1)) {
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    workers_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t WorkerPool::Size() const {
+  return queues_.size();
+}
+
+void WorkerPool::Run(const std::vector<size_t> &roots, const Job &job) {
+  if (workers_.empty() || roots.empty()) {
+    RunOnCaller(roots, job);
+    return;
+  }
+  Launch(roots, job);
+  RunTasks(0);
+  Wait();
+}
+
+void WorkerPool::Start(const std::vector<size_t> &roots, Job job) {
+  started_ = std::move(job);
+  Launch(roots, started_);
+}
+
+void WorkerPool::Wait() {
+  {
+    std::unique_lock lock(mutex_);
+    done_cv_.wait(lock, [this] { return active_ == 0; });
+    job_ = nullptr;
+  }
+  Rethrow();
+}
+
+void WorkerPool::Rethrow() {
+  failed_.store(false, std::memory_order_relaxed);
+  std::exception_ptr error;
+  {
+    std::lock_guard lock(mutex_);
+    error = std::exchange(error_, nullptr);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void WorkerPool::Launch(const std::vector<size_t> &roots, const Job &job) {
+  // The workers aren't running, the queues are free to fill.
+  for (size_t i = 0; i < roots.size(); ++i) {
+    queues_[i % queues_.size()].tasks.push_back(roots[i]);
+  }
+  outstanding_.store(roots.size(), std::memory_order_relaxed);
+  {
+    std::lock_guard lock(mutex_);
+    job_ = &job;
+    active_ = workers_.size();
+    ++generation_;
+  }
+  start_cv_.notify_all();
+}
+
+void WorkerPool::RunOnCaller(const std::vector<size_t> &roots,
+                             const Job &job) {
+  auto &tasks = queues_[0].tasks;
+  tasks.insert(tasks.end(), roots.begin(), roots.end());
+  outstanding_.store(roots.size(), std::memory_order_relaxed);
+  job_ = &job;
+  RunTasks(0);
+  job_ = nullptr;
+  Rethrow();
+}
+
+void WorkerPool::WorkerLoop(size_t index) {
+  size_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock lock(mutex_);
+      start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) {
+        return;
+      }
+      seen = generation_;
+    }
+    RunTasks(index);
+    {
+      std::lock_guard lock(mutex_);
+      if (--active_ == 0) {
+        done_cv_.notify_one();
+      }
+    }
+  }
+}
+
+void WorkerPool::RunTasks(size_t index) {
+  Worker worker(*this, index);
+  size_t task;
+  int idle = 0;
+  // A task pushes its followers before it is finished, so outstanding_ is 0
+  // only when nothing is left to run.
+  while (outstanding_.load(std::memory_order_acquire) != 0) {
+    if (Pop(index, task) || Steal(index, task)) {
+      idle = 0;
+      Execute(task, worker);
+    } else if (++idle < kSpins) {
+      std::this_thread::yield();
+    } else {
+      // Counted before the queues are checked: a task pushed after the check
+      // finds the thread parked and notifies under park_mutex_.
+      std::unique_lock lock(park_mutex_);
+      parked_.fetch_add(1, std::memory_order_seq_cst);
+      park_cv_.wait(lock, [this] {
+        return outstanding_.load(std::memory_order_acquire) == 0 ||
+            HasTasks();
+      });
+      parked_.fetch_sub(1, std::memory_order_relaxed);
+      idle = 0;
+    }
+  }
+}
+
+void WorkerPool::Execute(size_t task, Worker &worker) {
+  // After a failure the tasks left are only counted off.
+  if (!failed_.load(std::memory_order_relaxed)) {
+    try {
+      (*job_)(task, worker);
+    } catch (...) {
+      std::lock_guard lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+      failed_.store(true, std::memory_order_relaxed);
+    }
+  }
+  if (outstanding_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    std::lock_guard lock(park_mutex_);
+    park_cv_.notify_all();
+  }
+}
+
+bool WorkerPool::HasTasks() {
+  for (auto &queue : queues_) {
+    std::lock_guard lock(queue.mutex);
+    if (queue.head < queue.tasks.size()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkerPool::Pop(size_t index, size_t &task) {
+  auto &queue = queues_[index];
+  std::lock_guard lock(queue.mutex);
+  if (queue.head == queue.tasks.size()) {
+    return false;
+  }
+  task = queue.tasks.back();
+  queue.tasks.pop_back();
+  if (queue.head == queue.tasks.size()) {
+    queue.tasks.clear();
+    queue.head = 0;
+  }
+  return true;
+}
+
+bool WorkerPool::Steal(size_t index, size_t &task) {
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    auto &queue = queues_[(index + i) % queues_.size()];
+    std::lock_guard lock(queue.mutex);
+    if (queue.head < queue.tasks.size()) {
+      task = queue.tasks[queue.head++];
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::Push(size_t index, size_t task) {
+  outstanding_.fetch_add(1, std::memory_order_relaxed);
+  {
+    auto &queue = queues_[index];
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(task);
+  }
+  if (parked_.load(std::memory_order_seq_cst) != 0) {
+    std::lock_guard lock(park_mutex_);
+    park_cv_.notify_one();
+  }
+}
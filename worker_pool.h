@@ -0,0 +1,110 @@
+#ifndef SPREADSHEET_WORKER_POOL_H_
+#define SPREADSHEET_WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running task graphs with work stealing. The calling
+// thread takes part in every run, so a pool of size N starts N - 1 workers.
+// Each thread keeps its own deque of ready tasks: it takes the newest one of
+// its own and, when out of them, steals the oldest one of another thread.
+class WorkerPool {
+ public:
+  // Handle of the thread running a task.
+  class Worker {
+   public:
+    // Makes task ready, it runs on this thread unless stolen. O(1) amortized
+    void Push(size_t task);
+    // In [0, Size()), 0 is the calling thread. O(1)
+    size_t Index() const;
+
+   private:
+    friend class WorkerPool;
+    Worker(WorkerPool &pool, size_t index);
+
+    WorkerPool &pool_;
+    size_t index_;
+  };
+
+  // Runs a task, may push the tasks it makes ready.
+  using Job = std::function<void(size_t task, Worker &worker)>;
+
+  explicit WorkerPool(size_t threads); // O(N), N - threads
+  ~WorkerPool(); // O(N), N - threads
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  size_t Size() const; // O(1)
+
+  // Runs job on the roots and on every task pushed meanwhile, returns when no
+  // task is left. Once job throws, the tasks left are dropped and the first
+  // exception is rethrown here. Not reentrant. O(T), T - tasks
+  void Run(const std::vector<size_t> &roots, const Job &job);
+  // Same, on the calling thread only.
+  void RunOnCaller(const std::vector<size_t> &roots, const Job &job);
+  // Same as Run on the workers only, returns at once; Wait joins the run,
+  // which must happen before the next one. Needs Size() > 1. O(R), R - roots
+  void Start(const std::vector<size_t> &roots, Job job);
+  // Returns when the run started last is over, rethrows as Run does. O(1) if
+  // it is, else O(T), T - tasks left
+  void Wait();
+
+ private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::vector<size_t> tasks;
+    // The tasks before head are stolen already
+    size_t head = 0;
+  };
+
+  // Hands the roots and job to the workers. O(R), R - roots
+  void Launch(const std::vector<size_t> &roots, const Job &job);
+  void WorkerLoop(size_t index);
+  // Runs tasks until the run is over, parking on park_cv_ after kSpins tries
+  // without a task.
+  void RunTasks(size_t index);
+  // Runs job on task unless the run has failed, keeping the first exception.
+  void Execute(size_t task, Worker &worker);
+  // Rethrows the exception of the run over, if any.
+  void Rethrow();
+  bool HasTasks();
+  bool Pop(size_t index, size_t &task);
+  bool Steal(size_t index, size_t &task);
+  void Push(size_t index, size_t task);
+
+  std::vector<std::thread> workers_;
+  std::vector<Queue> queues_;
+
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  // Guarded by mutex_
+  size_t generation_ = 0;
+  size_t active_ = 0;
+  bool stop_ = false;
+
+  // Set by Run before the workers start
+  const Job *job_ = nullptr;
+  // The job of Start, kept until Wait
+  Job started_;
+  // Tasks pushed and not finished yet, the run is over at 0
+  std::atomic<size_t> outstanding_{0};
+  // The first exception of the run, guarded by mutex_
+  std::exception_ptr error_;
+  std::atomic<bool> failed_{false};
+
+  // Tries for a task before parking
+  static constexpr int kSpins = 64;
+  // Wakes the parked threads on a push and at the end of the run.
+  std::mutex park_mutex_;
+  std::condition_variable park_cv_;
+  std::atomic<size_t> parked_{0};
+};
+
+#endif // SPREADSHEET_WORKER_POOL_H_